@@ -0,0 +1,68 @@
+#include <string.h>
+#include <sys/mman.h>
+
+#include "arena.h"
+
+#define NES_HUGE_PAGE_SZ    (2 * 1024 * 1024)
+#define NES_PAGE_SZ         4096
+
+int nes_arena_init(struct nes_arena *arena, size_t size, int flags)
+{
+    void *base = MAP_FAILED;
+
+    memset(arena, 0, sizeof(*arena));
+
+    if (flags & NES_ARENA_HUGE_PAGES) {
+        size = (size + NES_HUGE_PAGE_SZ - 1) & ~(size_t)(NES_HUGE_PAGE_SZ - 1);
+
+#ifdef MAP_HUGETLB
+        base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (base != MAP_FAILED)
+            arena->huge = 1;
+#endif
+    } else {
+        size = (size + NES_PAGE_SZ - 1) & ~(size_t)(NES_PAGE_SZ - 1);
+    }
+
+    if (base == MAP_FAILED) {
+        base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (base == MAP_FAILED)
+            return -1;
+
+#ifdef MADV_HUGEPAGE
+        // No reserved huge pages, ask for transparent ones
+        if (flags & NES_ARENA_HUGE_PAGES)
+            madvise(base, size, MADV_HUGEPAGE);
+#endif
+    }
+
+    arena->base = base;
+    arena->size = size;
+
+    return 0;
+}
+
+// Memory comes back zeroed, as the mapping is anonymous and
+// never reused. align must be a power of two.
+void *nes_arena_alloc(struct nes_arena *arena, size_t size, size_t align)
+{
+    size_t offset;
+
+    offset = (arena->used + align - 1) & ~(align - 1);
+    if (offset > arena->size || size > arena->size - offset)
+        return NULL;
+
+    arena->used = offset + size;
+
+    return arena->base + offset;
+}
+
+void nes_arena_destroy(struct nes_arena *arena)
+{
+    if (arena->base)
+        munmap(arena->base, arena->size);
+
+    memset(arena, 0, sizeof(*arena));
+}
@@ -0,0 +1,26 @@
+#ifndef NES_ARENA_HEADER
+#define NES_ARENA_HEADER
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define NES_ARENA_HUGE_PAGES    0x01
+
+// A single anonymous mapping carved up with a bump allocator.
+// Everything an instance owns comes out of one arena, so that
+// instance state is contiguous in memory and released with one
+// munmap. With NES_ARENA_HUGE_PAGES the mapping is backed by 2 MB
+// pages when the system has them (explicitly reserved hugetlb
+// pages first, transparent huge pages otherwise).
+struct nes_arena {
+    uint8_t *base;
+    size_t size;
+    size_t used;
+    uint8_t huge;
+};
+
+int nes_arena_init(struct nes_arena *arena, size_t size, int flags);
+void *nes_arena_alloc(struct nes_arena *arena, size_t size, size_t align);
+void nes_arena_destroy(struct nes_arena *arena);
+
+#endif
@@ -1,16 +1,64 @@
+#include <string.h>
+
 #include "bus.h"
 #include "ppu.h"
 #include "cartridge.h"
+#include "controller.h"
+#include "trace.h"
+#include "watch.h"
 
-uint8_t nes_bus_read(struct nes_bus *bus, uint16_t addr)
+const uint8_t nes_bus_fast_pages[256];
+
+// Points pages at the table for what is attached. Called whenever
+// the trace or the watch set, or its watchpoints, change.
+void nes_bus_update_pages(struct nes_bus *bus)
+{
+    struct nes_bus_hooks *hooks = bus->hooks;
+
+    if (!hooks->trace) {
+        bus->pages = hooks->watch ? hooks->watch->pages : nes_bus_fast_pages;
+        return;
+    }
+
+    if (hooks->watch)
+        memcpy(hooks->pages, hooks->watch->pages, sizeof(hooks->pages));
+    else
+        memset(hooks->pages, 0, sizeof(hooks->pages));
+
+    for (int page = 0x20; page <= 0x40; ++page)
+        hooks->pages[page] |= NES_BUS_TRACE;
+
+    bus->pages = hooks->pages;
+}
+
+static uint8_t nes_bus_io_read(struct nes_bus *bus, uint16_t addr)
 {
     switch (addr) {
-    case 0x0000 ... 0x1fff:
-        return bus->ram[addr & 0x07ff];
     case 0x2000 ... 0x3fff:
         return nes_ppu_reg_read(bus->ppu, addr);
-    case 0x4000 ... 0x401f:
-        return 0;   // TODO: APU + IO
+    case 0x4016:
+        return nes_controller_read(&bus->pads[0]);
+    case 0x4017:
+        return nes_controller_read(&bus->pads[1]);
+    default:
+        return 0;   // TODO: APU
+    }
+}
+
+static uint8_t nes_bus_dispatch_read(struct nes_bus *bus, uint16_t addr)
+{
+    uint8_t data;
+
+    switch (addr) {
+    case 0x0000 ... 0x1fff:
+        return bus->ram[addr & 0x07ff];
+    case 0x2000 ... 0x401f:
+        data = nes_bus_io_read(bus, addr);
+
+        if (__builtin_expect(bus->pages[addr >> 8] & NES_BUS_TRACE, 0))
+            nes_trace_bus(bus->hooks->trace, bus, NES_TRACE_READ, addr, data);
+
+        return data;
     case 0x4020 ... 0xffff:
         return nes_cart_read(bus->cart, addr);
     default:
@@ -18,22 +66,62 @@ uint8_t nes_bus_read(struct nes_bus *bus, uint16_t addr)
     }
 }
 
+uint8_t nes_bus_read(struct nes_bus *bus, uint16_t addr)
+{
+    uint8_t data = nes_bus_dispatch_read(bus, addr);
+
+    if (__builtin_expect(bus->pages[addr >> 8] & NES_WATCH_READ, 0))
+        nes_watch_check(bus, NES_WATCH_READ, addr, data);
+
+    return data;
+}
+
+// Opcode fetch, only checked against execute watchpoints
+uint8_t nes_bus_fetch(struct nes_bus *bus, uint16_t addr)
+{
+    uint8_t data = nes_bus_dispatch_read(bus, addr);
+
+    if (__builtin_expect(bus->pages[addr >> 8] & NES_WATCH_EXEC, 0))
+        nes_watch_check(bus, NES_WATCH_EXEC, addr, data);
+
+    return data;
+}
+
 void nes_bus_write(struct nes_bus *bus, uint16_t addr, uint8_t data)
 {
+    // Checked before the write, so the handler still sees the
+    // previous value in memory.
+    if (__builtin_expect(bus->pages[addr >> 8] & NES_WATCH_WRITE, 0))
+        nes_watch_check(bus, NES_WATCH_WRITE, addr, data);
+
     switch (addr) {
     case 0x0000 ... 0x1fff:
         bus->ram[addr & 0x07ff] = data;
         break;
     case 0x2000 ... 0x3fff:
+        if (__builtin_expect(bus->pages[addr >> 8] & NES_BUS_TRACE, 0))
+            nes_trace_bus(bus->hooks->trace, bus, NES_TRACE_WRITE, addr, data);
+
         nes_ppu_reg_write(bus->ppu, addr, data);
         break;
     case 0x4000 ... 0x401f:
+        if (__builtin_expect(bus->pages[addr >> 8] & NES_BUS_TRACE, 0))
+            nes_trace_bus(bus->hooks->trace, bus, NES_TRACE_WRITE, addr, data);
+
         if (addr == 0x4014) {
             nes_oam_dma_transfer(bus, data);
             return;
         }
 
-        /* TODO: APU + IO */
+        // A single strobe line is wired to both controller
+        // ports, so $4016 writes latch both of them.
+        if (addr == 0x4016) {
+            nes_controller_strobe(&bus->pads[0], data);
+            nes_controller_strobe(&bus->pads[1], data);
+            return;
+        }
+
+        /* TODO: APU */
         break;
     case 0x4020 ... 0xffff:
         nes_cart_write(bus->cart, addr, data);
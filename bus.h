@@ -24,16 +24,65 @@
 // +-----------------+ 0x4020
 // | Cartridge Space | PRG-ROM, PRG-RAM, mapper registers ($4020-$FFFF)
 // +-----------------+ 0xFFFF
-struct nes_bus {
+// Page flag of the register pages ($20-$40) while a trace is
+// attached, next to the watch types of watch.h
+#define NES_BUS_TRACE           0x08
+
+// Hooks for debugging and profiling, and the parts of the machine
+// they report on. The bus only follows them for accesses to pages
+// flagged in nes_bus.pages, and the CPU once per instruction for
+// those that are set, so they are kept out of struct nes_bus and
+// live with the cold fields of the instance.
+struct nes_bus_hooks {
     struct nes_emu *nes;
     struct cpu_6502 *cpu;
+
+    // Execution trace, see trace.h. Register accesses only reach
+    // it through NES_BUS_TRACE.
+    struct nes_trace *trace;
+
+    // Guest profiler, fed by the CPU once per instruction while
+    // attached, see profile.h.
+    struct nes_prof *prof;
+
+    // Idle loop skipping, also fed per instruction, see idle.h
+    struct nes_idle *idle;
+
+    // Watch set behind the flags in nes_bus.pages, see watch.h
+    struct nes_watch *watch;
+
+    // Page table of the bus while a trace is attached: the flags
+    // of the watch set, if any, plus NES_BUS_TRACE
+    uint8_t pages[256];
+};
+
+// Only what every access may follow, 48 bytes, so that the bus
+// and the CPU registers share a cache line.
+struct nes_bus {
     struct nes_ppu  *ppu;
     struct nes_cart *cart;
 
+    // Controller ports 1 ($4016) and 2 ($4017)
+    struct nes_controller *pads;
+
     uint8_t *ram;
+
+    // Watch type and trace flags per 256-byte page. Accesses to a
+    // page with a matching flag take the slow path through
+    // nes_watch_check() or nes_trace_bus(). Points at
+    // nes_bus_fast_pages while nothing is attached, see
+    // nes_bus_update_pages().
+    const uint8_t *pages;
+
+    struct nes_bus_hooks *hooks;
 };
 
+extern const uint8_t nes_bus_fast_pages[256];
+
+void nes_bus_update_pages(struct nes_bus *bus);
+
 uint8_t nes_bus_read(struct nes_bus *bus, uint16_t addr);
+uint8_t nes_bus_fetch(struct nes_bus *bus, uint16_t addr);
 
 void nes_bus_write(struct nes_bus *bus, uint16_t addr, uint8_t data);
 void nes_oam_dma_transfer(struct nes_bus *bus, uint8_t data);
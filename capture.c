@@ -0,0 +1,534 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "capture.h"
+
+// BT.601 limited range coefficients in 8.8 fixed point
+//
+//   Y = (( 66 R + 129 G +  25 B + 128) >> 8) +  16
+//   U = ((-38 R -  74 G + 112 B + 128) >> 8) + 128
+//   V = ((112 R -  94 G -  18 B + 128) >> 8) + 128
+//
+// Chroma is taken from the average of each 2x2 block of pixels.
+
+static void nes_yuv420_rows_scalar(const uint32_t *row0, const uint32_t *row1,
+                                   uint8_t *y0, uint8_t *y1, uint8_t *u,
+                                   uint8_t *v, int width)
+{
+    uint32_t px[4];
+    int r, g, b;
+
+    for (int x = 0; x < width; x += 2) {
+        px[0] = row0[x];
+        px[1] = row0[x + 1];
+        px[2] = row1[x];
+        px[3] = row1[x + 1];
+
+        r = g = b = 0;
+
+        for (int i = 0; i < 4; ++i) {
+            int pr = (px[i] >> 16) & 0xff;
+            int pg = (px[i] >> 8) & 0xff;
+            int pb = px[i] & 0xff;
+            uint8_t *py = (i < 2) ? &y0[x + i] : &y1[x + i - 2];
+
+            *py = ((66 * pr + 129 * pg + 25 * pb + 128) >> 8) + 16;
+
+            r += pr;
+            g += pg;
+            b += pb;
+        }
+
+        r = (r + 2) >> 2;
+        g = (g + 2) >> 2;
+        b = (b + 2) >> 2;
+
+        u[x >> 1] = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+        v[x >> 1] = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+    }
+}
+
+#if defined(__SSE2__)
+
+// Splits 8 ARGB pixels into 16-bit R, G and B lanes
+static inline void nes_argb_unpack_sse2(const uint32_t *p, __m128i *r,
+                                        __m128i *g, __m128i *b)
+{
+    __m128i mask = _mm_set1_epi32(0xff);
+    __m128i p0 = _mm_loadu_si128((const __m128i *)p);
+    __m128i p1 = _mm_loadu_si128((const __m128i *)(p + 4));
+
+    *b = _mm_packs_epi32(_mm_and_si128(p0, mask), _mm_and_si128(p1, mask));
+    *g = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(p0, 8), mask),
+                         _mm_and_si128(_mm_srli_epi32(p1, 8), mask));
+    *r = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(p0, 16), mask),
+                         _mm_and_si128(_mm_srli_epi32(p1, 16), mask));
+}
+
+// The luma sum never exceeds 56228, so it is computed with
+// wrapping 16-bit multiplies and a logical shift.
+static inline __m128i nes_luma_sse2(__m128i r, __m128i g, __m128i b)
+{
+    __m128i y;
+
+    y = _mm_mullo_epi16(r, _mm_set1_epi16(66));
+    y = _mm_add_epi16(y, _mm_mullo_epi16(g, _mm_set1_epi16(129)));
+    y = _mm_add_epi16(y, _mm_mullo_epi16(b, _mm_set1_epi16(25)));
+    y = _mm_add_epi16(y, _mm_set1_epi16(128));
+
+    return _mm_add_epi16(_mm_srli_epi16(y, 8), _mm_set1_epi16(16));
+}
+
+static inline __m128i nes_chroma_sse2(__m128i r, __m128i g, __m128i b,
+                                      int16_t cr, int16_t cg, int16_t cb)
+{
+    __m128i c;
+
+    c = _mm_mullo_epi16(r, _mm_set1_epi16(cr));
+    c = _mm_add_epi16(c, _mm_mullo_epi16(g, _mm_set1_epi16(cg)));
+    c = _mm_add_epi16(c, _mm_mullo_epi16(b, _mm_set1_epi16(cb)));
+    c = _mm_add_epi16(c, _mm_set1_epi16(128));
+
+    return _mm_add_epi16(_mm_srai_epi16(c, 8), _mm_set1_epi16(128));
+}
+
+// Sums the 2x2 blocks of 16 pixels over two rows into 8 averages
+static inline __m128i nes_block_avg_sse2(__m128i a0, __m128i a1,
+                                         __m128i b0, __m128i b1)
+{
+    __m128i ones = _mm_set1_epi16(1);
+    __m128i lo = _mm_madd_epi16(_mm_add_epi16(a0, b0), ones);
+    __m128i hi = _mm_madd_epi16(_mm_add_epi16(a1, b1), ones);
+
+    return _mm_srli_epi16(_mm_add_epi16(_mm_packs_epi32(lo, hi),
+                                        _mm_set1_epi16(2)), 2);
+}
+
+static void nes_yuv420_rows_sse2(const uint32_t *row0, const uint32_t *row1,
+                                 uint8_t *y0, uint8_t *y1, uint8_t *u,
+                                 uint8_t *v, int width)
+{
+    __m128i r[4], g[4], b[4], ra, ga, ba, yy, uu, vv;
+    int x;
+
+    for (x = 0; x + 16 <= width; x += 16) {
+        nes_argb_unpack_sse2(row0 + x,     &r[0], &g[0], &b[0]);
+        nes_argb_unpack_sse2(row0 + x + 8, &r[1], &g[1], &b[1]);
+        nes_argb_unpack_sse2(row1 + x,     &r[2], &g[2], &b[2]);
+        nes_argb_unpack_sse2(row1 + x + 8, &r[3], &g[3], &b[3]);
+
+        yy = _mm_packus_epi16(nes_luma_sse2(r[0], g[0], b[0]),
+                              nes_luma_sse2(r[1], g[1], b[1]));
+        _mm_storeu_si128((__m128i *)(y0 + x), yy);
+
+        yy = _mm_packus_epi16(nes_luma_sse2(r[2], g[2], b[2]),
+                              nes_luma_sse2(r[3], g[3], b[3]));
+        _mm_storeu_si128((__m128i *)(y1 + x), yy);
+
+        ra = nes_block_avg_sse2(r[0], r[1], r[2], r[3]);
+        ga = nes_block_avg_sse2(g[0], g[1], g[2], g[3]);
+        ba = nes_block_avg_sse2(b[0], b[1], b[2], b[3]);
+
+        uu = nes_chroma_sse2(ra, ga, ba, -38, -74, 112);
+        vv = nes_chroma_sse2(ra, ga, ba, 112, -94, -18);
+
+        _mm_storel_epi64((__m128i *)(u + (x >> 1)), _mm_packus_epi16(uu, uu));
+        _mm_storel_epi64((__m128i *)(v + (x >> 1)), _mm_packus_epi16(vv, vv));
+    }
+
+    if (x < width)
+        nes_yuv420_rows_scalar(row0 + x, row1 + x, y0 + x, y1 + x,
+                               u + (x >> 1), v + (x >> 1), width - x);
+}
+
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#define NES_AVX2 __attribute__((target("avx2")))
+
+// Splits 16 ARGB pixels into 16-bit R, G and B lanes. The halves
+// are swapped first so the in-lane packs come out in pixel order.
+static inline NES_AVX2 void nes_argb_unpack_avx2(const uint32_t *p, __m256i *r,
+                                                 __m256i *g, __m256i *b)
+{
+    __m256i mask = _mm256_set1_epi32(0xff);
+    __m256i l0 = _mm256_loadu_si256((const __m256i *)p);
+    __m256i l1 = _mm256_loadu_si256((const __m256i *)(p + 8));
+    __m256i p0 = _mm256_permute2x128_si256(l0, l1, 0x20);
+    __m256i p1 = _mm256_permute2x128_si256(l0, l1, 0x31);
+
+    *b = _mm256_packs_epi32(_mm256_and_si256(p0, mask),
+                            _mm256_and_si256(p1, mask));
+    *g = _mm256_packs_epi32(_mm256_and_si256(_mm256_srli_epi32(p0, 8), mask),
+                            _mm256_and_si256(_mm256_srli_epi32(p1, 8), mask));
+    *r = _mm256_packs_epi32(_mm256_and_si256(_mm256_srli_epi32(p0, 16), mask),
+                            _mm256_and_si256(_mm256_srli_epi32(p1, 16), mask));
+}
+
+static inline NES_AVX2 __m256i nes_luma_avx2(__m256i r, __m256i g, __m256i b)
+{
+    __m256i y;
+
+    y = _mm256_mullo_epi16(r, _mm256_set1_epi16(66));
+    y = _mm256_add_epi16(y, _mm256_mullo_epi16(g, _mm256_set1_epi16(129)));
+    y = _mm256_add_epi16(y, _mm256_mullo_epi16(b, _mm256_set1_epi16(25)));
+    y = _mm256_add_epi16(y, _mm256_set1_epi16(128));
+
+    return _mm256_add_epi16(_mm256_srli_epi16(y, 8), _mm256_set1_epi16(16));
+}
+
+static inline NES_AVX2 __m256i nes_chroma_avx2(__m256i r, __m256i g, __m256i b,
+                                               int16_t cr, int16_t cg, int16_t cb)
+{
+    __m256i c;
+
+    c = _mm256_mullo_epi16(r, _mm256_set1_epi16(cr));
+    c = _mm256_add_epi16(c, _mm256_mullo_epi16(g, _mm256_set1_epi16(cg)));
+    c = _mm256_add_epi16(c, _mm256_mullo_epi16(b, _mm256_set1_epi16(cb)));
+    c = _mm256_add_epi16(c, _mm256_set1_epi16(128));
+
+    return _mm256_add_epi16(_mm256_srai_epi16(c, 8), _mm256_set1_epi16(128));
+}
+
+static inline NES_AVX2 __m256i nes_block_avg_avx2(__m256i a0, __m256i a1,
+                                                  __m256i b0, __m256i b1)
+{
+    __m256i ones = _mm256_set1_epi16(1);
+    __m256i lo = _mm256_madd_epi16(_mm256_add_epi16(a0, b0), ones);
+    __m256i hi = _mm256_madd_epi16(_mm256_add_epi16(a1, b1), ones);
+    __m256i sum = _mm256_permute4x64_epi64(_mm256_packs_epi32(lo, hi), 0xd8);
+
+    return _mm256_srli_epi16(_mm256_add_epi16(sum, _mm256_set1_epi16(2)), 2);
+}
+
+// Packs 16 words to bytes in order, in the low 128 bits
+static inline NES_AVX2 __m128i nes_pack_avx2(__m256i w)
+{
+    __m256i p = _mm256_permute4x64_epi64(_mm256_packus_epi16(w, w), 0xd8);
+
+    return _mm256_castsi256_si128(p);
+}
+
+static NES_AVX2 void nes_yuv420_rows_avx2(const uint32_t *row0,
+                                          const uint32_t *row1,
+                                          uint8_t *y0, uint8_t *y1,
+                                          uint8_t *u, uint8_t *v, int width)
+{
+    __m256i r[4], g[4], b[4], ra, ga, ba;
+    int x;
+
+    for (x = 0; x + 32 <= width; x += 32) {
+        nes_argb_unpack_avx2(row0 + x,      &r[0], &g[0], &b[0]);
+        nes_argb_unpack_avx2(row0 + x + 16, &r[1], &g[1], &b[1]);
+        nes_argb_unpack_avx2(row1 + x,      &r[2], &g[2], &b[2]);
+        nes_argb_unpack_avx2(row1 + x + 16, &r[3], &g[3], &b[3]);
+
+        for (int i = 0; i < 4; ++i) {
+            uint8_t *dst = ((i < 2) ? y0 : y1) + x + ((i & 1) << 4);
+
+            _mm_storeu_si128((__m128i *)dst,
+                             nes_pack_avx2(nes_luma_avx2(r[i], g[i], b[i])));
+        }
+
+        ra = nes_block_avg_avx2(r[0], r[1], r[2], r[3]);
+        ga = nes_block_avg_avx2(g[0], g[1], g[2], g[3]);
+        ba = nes_block_avg_avx2(b[0], b[1], b[2], b[3]);
+
+        _mm_storeu_si128((__m128i *)(u + (x >> 1)),
+                         nes_pack_avx2(nes_chroma_avx2(ra, ga, ba, -38, -74, 112)));
+        _mm_storeu_si128((__m128i *)(v + (x >> 1)),
+                         nes_pack_avx2(nes_chroma_avx2(ra, ga, ba, 112, -94, -18)));
+    }
+
+    if (x < width)
+        nes_yuv420_rows_scalar(row0 + x, row1 + x, y0 + x, y1 + x,
+                               u + (x >> 1), v + (x >> 1), width - x);
+}
+
+#endif
+
+typedef void (*nes_yuv420_rows_fn)(const uint32_t *, const uint32_t *,
+                                   uint8_t *, uint8_t *, uint8_t *,
+                                   uint8_t *, int);
+
+static nes_yuv420_rows_fn nes_yuv420_rows_select(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2"))
+        return nes_yuv420_rows_avx2;
+#endif
+#if defined(__SSE2__)
+    return nes_yuv420_rows_sse2;
+#else
+    return nes_yuv420_rows_scalar;
+#endif
+}
+
+// Width and height must be even
+void nes_argb_to_yuv420(const uint32_t *argb, uint8_t *y, uint8_t *u,
+                        uint8_t *v, int width, int height)
+{
+    static nes_yuv420_rows_fn rows;
+
+    if (!rows)
+        rows = nes_yuv420_rows_select();
+
+    for (int j = 0; j < height; j += 2) {
+        rows(argb + j * width, argb + (j + 1) * width,
+             y + j * width, y + (j + 1) * width,
+             u + (j >> 1) * (width >> 1), v + (j >> 1) * (width >> 1),
+             width);
+    }
+}
+
+static uint64_t nes_capture_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static FILE *nes_capture_fopen(const char *name, uint8_t *pipe)
+{
+    *pipe = (name[0] == '|');
+
+    if (*pipe)
+        return popen(name + 1, "w");
+
+    return fopen(name, "wb");
+}
+
+static void nes_capture_fclose(FILE *fp, uint8_t pipe)
+{
+    if (pipe)
+        pclose(fp);
+    else
+        fclose(fp);
+}
+
+static void nes_le32(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+// Pipes cannot be rewound to patch the sizes on close, so they
+// are written as 0xffffffff which most readers treat as "until
+// end of stream".
+static void nes_wav_header(struct nes_capture *cap, uint32_t data_bytes)
+{
+    uint8_t hdr[44];
+
+    memcpy(hdr, "RIFF\0\0\0\0WAVEfmt ", 16);
+    nes_le32(hdr + 4, data_bytes == 0xffffffff ? data_bytes : data_bytes + 36);
+    nes_le32(hdr + 16, 16);                         // fmt chunk size
+    nes_le32(hdr + 20, 1 | (1 << 16));              // PCM, mono
+    nes_le32(hdr + 24, NES_CAPTURE_RATE);
+    nes_le32(hdr + 28, NES_CAPTURE_RATE * 2);       // byte rate
+    nes_le32(hdr + 32, 2 | (16 << 16));             // align, bits
+    memcpy(hdr + 36, "data", 4);
+    nes_le32(hdr + 40, data_bytes);
+
+    fwrite(hdr, 1, sizeof(hdr), cap->audio);
+}
+
+static void nes_capture_write(struct nes_capture *cap,
+                              struct nes_capture_slot *slot)
+{
+    const size_t luma = NES_CAPTURE_WIDTH * NES_CAPTURE_HEIGHT;
+    size_t bytes;
+
+    if (cap->video) {
+        nes_argb_to_yuv420(slot->argb, cap->yuv, cap->yuv + luma,
+                           cap->yuv + luma + luma / 4,
+                           NES_CAPTURE_WIDTH, NES_CAPTURE_HEIGHT);
+
+        fputs("FRAME\n", cap->video);
+        fwrite(cap->yuv, 1, luma + luma / 2, cap->video);
+    }
+
+    if (cap->audio) {
+        bytes = slot->sample_count * sizeof(int16_t);
+
+        fwrite(slot->samples, 1, bytes, cap->audio);
+        cap->audio_bytes += bytes;
+    }
+}
+
+static void *nes_capture_thread(void *arg)
+{
+    struct nes_capture *cap = arg;
+    struct nes_capture_slot *slot;
+
+    pthread_mutex_lock(&cap->lock);
+
+    for (;;) {
+        while (cap->head == cap->tail && !cap->stop)
+            pthread_cond_wait(&cap->cond, &cap->lock);
+
+        // Drain everything that was queued before stopping
+        if (cap->head == cap->tail)
+            break;
+
+        slot = &cap->slots[cap->tail % NES_CAPTURE_QUEUE];
+
+        // The producer never touches slots between tail and
+        // head, so the slot can be consumed without the lock.
+        pthread_mutex_unlock(&cap->lock);
+        nes_capture_write(cap, slot);
+        pthread_mutex_lock(&cap->lock);
+
+        cap->tail++;
+    }
+
+    pthread_mutex_unlock(&cap->lock);
+
+    return NULL;
+}
+
+int nes_capture_open(struct nes_capture *cap, const char *video,
+                     const char *audio)
+{
+    memset(cap, 0, sizeof(*cap));
+
+    cap->slots = calloc(NES_CAPTURE_QUEUE, sizeof(*cap->slots));
+    cap->yuv = malloc(NES_CAPTURE_WIDTH * NES_CAPTURE_HEIGHT * 3 / 2);
+    if (!cap->slots || !cap->yuv)
+        goto err;
+
+    if (video) {
+        cap->video = nes_capture_fopen(video, &cap->video_pipe);
+        if (!cap->video)
+            goto err;
+
+        // 8:7 is the pixel aspect ratio of the NTSC NES
+        fprintf(cap->video, "YUV4MPEG2 W%d H%d F%d:%d Ip A8:7 C420jpeg\n",
+                NES_CAPTURE_WIDTH, NES_CAPTURE_HEIGHT,
+                NES_CAPTURE_FPS_NUM, NES_CAPTURE_FPS_DEN);
+    }
+
+    if (audio) {
+        cap->audio = nes_capture_fopen(audio, &cap->audio_pipe);
+        if (!cap->audio)
+            goto err;
+
+        nes_wav_header(cap, cap->audio_pipe ? 0xffffffff : 0);
+    }
+
+    pthread_mutex_init(&cap->lock, NULL);
+    pthread_cond_init(&cap->cond, NULL);
+
+    if (pthread_create(&cap->thread, NULL, nes_capture_thread, cap)) {
+        pthread_cond_destroy(&cap->cond);
+        pthread_mutex_destroy(&cap->lock);
+        goto err;
+    }
+
+    return 0;
+
+err:
+    if (cap->video)
+        nes_capture_fclose(cap->video, cap->video_pipe);
+    if (cap->audio)
+        nes_capture_fclose(cap->audio, cap->audio_pipe);
+
+    free(cap->slots);
+    free(cap->yuv);
+
+    memset(cap, 0, sizeof(*cap));
+
+    return -1;
+}
+
+// Queues one frame and its audio. Without samples, one frame's
+// worth of silence is written so the audio track stays in sync.
+// Returns 1 if the frame was dropped because the writer is behind.
+int nes_capture_frame(struct nes_capture *cap, const uint32_t *argb,
+                      const int16_t *samples, uint32_t count)
+{
+    struct nes_capture_slot *slot;
+    uint64_t start, elapsed;
+
+    start = nes_capture_now_ns();
+
+    pthread_mutex_lock(&cap->lock);
+    if (cap->head - cap->tail == NES_CAPTURE_QUEUE) {
+        cap->drops++;
+        pthread_mutex_unlock(&cap->lock);
+        return 1;
+    }
+    slot = &cap->slots[cap->head % NES_CAPTURE_QUEUE];
+    pthread_mutex_unlock(&cap->lock);
+
+    memcpy(slot->argb, argb, sizeof(slot->argb));
+
+    if (!samples) {
+        cap->sample_frac += (uint64_t)NES_CAPTURE_RATE * NES_CAPTURE_FPS_DEN;
+        count = cap->sample_frac / NES_CAPTURE_FPS_NUM;
+        cap->sample_frac %= NES_CAPTURE_FPS_NUM;
+
+        memset(slot->samples, 0, count * sizeof(int16_t));
+    } else {
+        if (count > NES_CAPTURE_MAX_SAMPLES)
+            count = NES_CAPTURE_MAX_SAMPLES;
+
+        memcpy(slot->samples, samples, count * sizeof(int16_t));
+    }
+
+    slot->sample_count = count;
+
+    pthread_mutex_lock(&cap->lock);
+    cap->head++;
+    cap->frames++;
+    pthread_cond_signal(&cap->cond);
+    pthread_mutex_unlock(&cap->lock);
+
+    elapsed = nes_capture_now_ns() - start;
+    cap->submit_ns += elapsed;
+    if (elapsed > cap->submit_max_ns)
+        cap->submit_max_ns = elapsed;
+
+    return 0;
+}
+
+void nes_capture_close(struct nes_capture *cap)
+{
+    if (!cap->slots)
+        return;
+
+    pthread_mutex_lock(&cap->lock);
+    cap->stop = 1;
+    pthread_cond_signal(&cap->cond);
+    pthread_mutex_unlock(&cap->lock);
+
+    pthread_join(cap->thread, NULL);
+
+    pthread_cond_destroy(&cap->cond);
+    pthread_mutex_destroy(&cap->lock);
+
+    if (cap->video)
+        nes_capture_fclose(cap->video, cap->video_pipe);
+
+    if (cap->audio) {
+        if (!cap->audio_pipe && !fseek(cap->audio, 0, SEEK_SET))
+            nes_wav_header(cap, cap->audio_bytes);
+
+        nes_capture_fclose(cap->audio, cap->audio_pipe);
+    }
+
+    free(cap->slots);
+    free(cap->yuv);
+
+    cap->slots = NULL;
+    cap->yuv = NULL;
+}
@@ -0,0 +1,76 @@
+#ifndef NES_CAPTURE_HEADER
+#define NES_CAPTURE_HEADER
+
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#define NES_CAPTURE_WIDTH       256
+#define NES_CAPTURE_HEIGHT      240
+
+// Frames the emulation thread may run ahead of the writer before
+// frames start being dropped.
+#define NES_CAPTURE_QUEUE       8
+
+#define NES_CAPTURE_RATE        44100
+#define NES_CAPTURE_MAX_SAMPLES 2048
+
+// NTSC NES frame rate, 39375000 / 655171 (~60.0988 Hz)
+#define NES_CAPTURE_FPS_NUM     39375000
+#define NES_CAPTURE_FPS_DEN     655171
+
+struct nes_capture_slot {
+    uint32_t argb[NES_CAPTURE_WIDTH * NES_CAPTURE_HEIGHT];
+
+    int16_t samples[NES_CAPTURE_MAX_SAMPLES];
+    uint32_t sample_count;
+};
+
+// Streams frames as YUV4MPEG2 and audio as 16-bit mono WAV, to
+// files or to pipes ("|command") feeding an external encoder.
+//
+// The emulation thread only copies the frame into a free slot
+// of a bounded ring. Colour conversion and all I/O happen on a
+// background writer thread. When the writer falls behind and the
+// ring is full, frames are dropped and counted rather than
+// stalling emulation.
+struct nes_capture {
+    FILE *video;
+    FILE *audio;
+    uint8_t video_pipe;
+    uint8_t audio_pipe;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint8_t stop;
+
+    // Producer and consumer positions, head - tail slots are
+    // waiting for the writer.
+    uint32_t head;
+    uint32_t tail;
+    struct nes_capture_slot *slots;
+
+    // Writer side conversion buffer (Y, then U, then V)
+    uint8_t *yuv;
+
+    // Fractional audio samples carried over between frames
+    uint64_t sample_frac;
+    uint32_t audio_bytes;
+
+    uint64_t frames;
+    uint64_t drops;
+    uint64_t submit_ns;
+    uint64_t submit_max_ns;
+};
+
+int nes_capture_open(struct nes_capture *cap, const char *video,
+                     const char *audio);
+int nes_capture_frame(struct nes_capture *cap, const uint32_t *argb,
+                      const int16_t *samples, uint32_t count);
+void nes_capture_close(struct nes_capture *cap);
+
+void nes_argb_to_yuv420(const uint32_t *argb, uint8_t *y, uint8_t *u,
+                        uint8_t *v, int width, int height);
+
+#endif
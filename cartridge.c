@@ -1,4 +1,105 @@
+#include <string.h>
+
 #include "cartridge.h"
+#include "hash.h"
+
+// NES 2.0 ROM size: a 12-bit count of 16 KB/8 KB units, or when
+// the high nibble is all ones, 2^E * (M * 2 + 1) bytes. The
+// exponent goes up to 63, sizes that do not fit 32 bits fail.
+static int nes2_rom_bytes(uint8_t lsb, uint8_t msb, uint32_t unit,
+                          uint32_t *bytes)
+{
+    uint64_t size;
+
+    if (msb != 0x0f) {
+        *bytes = ((msb << 8) | lsb) * unit;
+        return 0;
+    }
+
+    if ((lsb >> 2) >= 32)
+        return -1;
+
+    size = ((uint64_t)1 << (lsb >> 2)) * ((lsb & 0x03) * 2 + 1);
+    if (size > UINT32_MAX)
+        return -1;
+
+    *bytes = size;
+
+    return 0;
+}
+
+// NES 2.0 RAM size: 0 for none, 64 << shift bytes otherwise
+static uint32_t nes2_ram_bytes(uint8_t shift)
+{
+    return shift ? 64u << shift : 0;
+}
+
+int nes_ines_parse(const struct ines_header *header, struct nes_rom_info *info)
+{
+    memset(info, 0, sizeof(*info));
+
+    if (memcmp(header->signature, NES_INES_SIGNATURE, 4))
+        return -1;
+
+    info->mirroring = header->flags6 & 0x01;
+    if (header->flags6 & 0x08)
+        info->mirroring = NES_MIRROR_FOUR_SCREEN;
+
+    info->battery = !!(header->flags6 & 0x02);
+    info->trainer = !!(header->flags6 & 0x04);
+    info->console = header->flags7 & 0x03;
+    info->mapper = header->flags6 >> 4;
+
+    info->nes2 = (header->flags7 & 0x0c) == 0x08;
+
+    if (info->nes2) {
+        // Bytes 8-12 are reinterpreted: mapper MSB and submapper,
+        // ROM size MSBs, PRG-RAM, CHR-RAM and timing
+        info->mapper |= (header->flags7 & 0xf0) |
+                        ((header->prg_ram_size & 0x0f) << 8);
+        info->submapper = header->prg_ram_size >> 4;
+
+        if (nes2_rom_bytes(header->prg_rom_size, header->tv_system & 0x0f,
+                           16 * 1024, &info->prg_rom_bytes) ||
+            nes2_rom_bytes(header->chr_rom_size, header->tv_system >> 4,
+                           8 * 1024, &info->chr_rom_bytes))
+            return -1;
+
+        info->prg_ram_bytes = nes2_ram_bytes(header->flags10 & 0x0f);
+        info->prg_nvram_bytes = nes2_ram_bytes(header->flags10 >> 4);
+        info->chr_ram_bytes = nes2_ram_bytes(header->unused[0] & 0x0f);
+        info->chr_nvram_bytes = nes2_ram_bytes(header->unused[0] >> 4);
+
+        info->timing = header->unused[1] & 0x03;
+
+        return 0;
+    }
+
+    // Old dumps often have a ripper tag ("DiskDude!") in bytes
+    // 7-15, in which case the upper mapper nibble is garbage.
+    if (!header->unused[1] && !header->unused[2] &&
+        !header->unused[3] && !header->unused[4])
+        info->mapper |= header->flags7 & 0xf0;
+
+    info->prg_rom_bytes = header->prg_rom_size * 16 * 1024;
+    info->chr_rom_bytes = header->chr_rom_size * 8 * 1024;
+
+    // iNES can not tell RAM from battery backed RAM, and a size
+    // of 0 means 8 KB for compatibility
+    info->prg_ram_bytes = (header->prg_ram_size ? header->prg_ram_size : 1) *
+                          8 * 1024;
+    if (info->battery) {
+        info->prg_nvram_bytes = info->prg_ram_bytes;
+        info->prg_ram_bytes = 0;
+    }
+
+    if (!info->chr_rom_bytes)
+        info->chr_ram_bytes = 8 * 1024;
+
+    info->timing = header->tv_system & 0x01;
+
+    return 0;
+}
 
 int nes_cart_read(struct nes_cart *cart, uint16_t addr)
 {
@@ -21,3 +122,31 @@ void nes_cart_write(struct nes_cart *cart, uint16_t addr, uint8_t data)
         if (cart->prg_ram)
             cart->prg_ram[addr - 0x6000] = data;
 }
+
+uint32_t nes_cart_crc32(struct nes_cart *cart)
+{
+    uint32_t crc = 0;
+
+    // Hash the PRG and CHR data only, so that dumps with
+    // different (or broken) iNES headers still match.
+    if (cart->prg_rom)
+        crc = nes_crc32(crc, cart->prg_rom,
+                        cart->header.prg_rom_size * 0x4000);
+
+    if (cart->chr_rom)
+        crc = nes_crc32(crc, cart->chr_rom,
+                        cart->header.chr_rom_size * 0x2000);
+
+    return crc;
+}
+
+// 16 KB PRG-ROM bank a CPU address reads from, or NES_CART_NO_BANK
+// outside of PRG-ROM. There are no mappers yet, so the banks are
+// where the iNES layout puts them.
+uint8_t nes_cart_prg_bank(struct nes_cart *cart, uint16_t addr)
+{
+    if (addr < 0x8000 || !cart->header.prg_rom_size)
+        return NES_CART_NO_BANK;
+
+    return ((addr - 0x8000) >> 14) % cart->header.prg_rom_size;
+}
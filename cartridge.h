@@ -3,6 +3,9 @@
 
 #include <stdint.h>
 
+struct nes_arena;
+struct nes_sram;
+
 struct ines_header {
     uint8_t signature[4];   // "NES\x1A"
     uint8_t prg_rom_size;   // PRG-ROM size in 16 KB units
@@ -22,8 +25,63 @@ struct ines_header {
     uint8_t unused[5];      // Must be zero in NES 2.0
 } __attribute__((packed));
 
+#define NES_INES_SIGNATURE      "NES\x1a"
+
+#define NES_MIRROR_HORIZONTAL   0
+#define NES_MIRROR_VERTICAL     1
+#define NES_MIRROR_FOUR_SCREEN  2
+
+// Mapper controlled, all four nametables on one CIRAM half
+#define NES_MIRROR_SINGLE_LOW   3
+#define NES_MIRROR_SINGLE_HIGH  4
+
+// Header fields decoded from either an iNES or a NES 2.0 header,
+// with all sizes in bytes.
+struct nes_rom_info {
+    uint32_t prg_rom_bytes;
+    uint32_t chr_rom_bytes;
+    uint32_t prg_ram_bytes;
+    uint32_t prg_nvram_bytes;
+    uint32_t chr_ram_bytes;
+    uint32_t chr_nvram_bytes;
+
+    uint16_t mapper;
+    uint8_t submapper;
+
+    uint8_t nes2;
+    uint8_t mirroring;
+    uint8_t battery;
+    uint8_t trainer;
+
+    // 0 NTSC, 1 PAL, 2 multi-region, 3 Dendy
+    uint8_t timing;
+
+    // 0 NES/Famicom, 1 Vs. System, 2 PlayChoice-10, 3 extended
+    uint8_t console;
+};
+
+// The data pointers come first as they are followed on every
+// CPU and PPU fetch, the header is only needed while loading.
 struct nes_cart {
-    struct ines_header header;
+    uint8_t *prg_rom;
+    uint8_t *chr_rom;
+
+    // Depending on flags6 bit 1, the cartridge can contain
+    // battery-backed PRG RAM mapped at CPU address 0x6000-
+    // 0x7fff or other persistent memory.
+    uint8_t *prg_ram;
+
+    // 1 KB CHR bank mapped at each PPU page $0000-$1FFF. After
+    // changing these or the mirroring, nes_ppu_map() has to run.
+    uint16_t chr_banks[8];
+
+    // NES_MIRROR_*
+    uint8_t mirroring;
+    uint8_t battery;
+
+    // Carts without CHR ROM have 8 KB of CHR RAM instead, which
+    // chr_rom then points at.
+    uint8_t chr_ram;
 
     // Many old NES games used special cart hardware that
     // required certain RAM values to be preset at 0x7000-
@@ -33,19 +91,26 @@ struct nes_cart {
     // make certain ROM dumps work without fully emulating 
     // the hardware. So the Trainer was added as a hack.
     uint8_t trainer_present;
-    uint8_t mirroring;
-    uint8_t battery;
 
-    // Depending on flags6 bit 1, the cartridge can contain
-    // battery-backed PRG RAM mapped at CPU address 0x6000-
-    // 0x7fff or other persistent memory.
-    uint8_t *prg_ram;
+    // Arena the data above was carved from, or NULL when it
+    // was allocated with malloc.
+    struct nes_arena *arena;
 
-    uint8_t *prg_rom;
-    uint8_t *chr_rom;
+    // Save file prg_ram is mapped from, NULL when it is plain
+    // memory (no battery, or the instance opted out of saving).
+    struct nes_sram *sram;
+
+    struct ines_header header;
 };
 
+int nes_ines_parse(const struct ines_header *header, struct nes_rom_info *info);
+
 int nes_cart_read(struct nes_cart *cart, uint16_t addr);
+uint32_t nes_cart_crc32(struct nes_cart *cart);
+
+#define NES_CART_NO_BANK        0xff
+
+uint8_t nes_cart_prg_bank(struct nes_cart *cart, uint16_t addr);
 
 void nes_cart_write(struct nes_cart *cart, uint16_t addr, uint8_t data);
 
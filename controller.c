@@ -0,0 +1,32 @@
+#include "controller.h"
+
+uint8_t nes_controller_read(struct nes_controller *pad)
+{
+    uint8_t bit;
+
+    // While the strobe is held high the shift register keeps
+    // reloading, so every read returns the state of A.
+    if (pad->strobe)
+        return 0x40 | (pad->buttons & 0x01);
+
+    bit = pad->shift & 0x01;
+
+    // Official controllers return 1 once all eight buttons
+    // have been shifted out.
+    pad->shift = (pad->shift >> 1) | 0x80;
+
+    // The upper bits are open bus, which usually holds the
+    // high byte of the $4016/$4017 address.
+    return 0x40 | bit;
+}
+
+void nes_controller_strobe(struct nes_controller *pad, uint8_t data)
+{
+    // The buttons are latched for as long as the strobe is
+    // high, so the register holds the state from the moment
+    // of the falling edge.
+    if (pad->strobe || (data & 0x01))
+        pad->shift = pad->buttons;
+
+    pad->strobe = data & 0x01;
+}
@@ -0,0 +1,33 @@
+#ifndef NES_CONTROLLER_HEADER
+#define NES_CONTROLLER_HEADER
+
+#include <stdint.h>
+
+// Standard controller buttons, in the order they are shifted
+// out of $4016/$4017 after a strobe.
+#define NES_BUTTON_A        0x01
+#define NES_BUTTON_B        0x02
+#define NES_BUTTON_SELECT   0x04
+#define NES_BUTTON_START    0x08
+#define NES_BUTTON_UP       0x10
+#define NES_BUTTON_DOWN     0x20
+#define NES_BUTTON_LEFT     0x40
+#define NES_BUTTON_RIGHT    0x80
+
+struct nes_controller {
+    // Live button state, set by the front end (or a movie)
+    // once per frame.
+    uint8_t buttons;
+
+    // The 4021 shift register inside the controller. It is
+    // parallel loaded from the buttons while the strobe is
+    // high and shifted out one bit per read once it is low.
+    uint8_t shift;
+    uint8_t strobe;
+};
+
+uint8_t nes_controller_read(struct nes_controller *pad);
+
+void nes_controller_strobe(struct nes_controller *pad, uint8_t data);
+
+#endif
@@ -10,6 +10,9 @@ struct cpu_6502 {
     uint8_t s;
     uint8_t p;
     uint16_t pc;
+
+    // CPU cycles executed since power on
+    uint64_t cycles;
 };
 
 #endif
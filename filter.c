@@ -0,0 +1,485 @@
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "filter.h"
+
+struct nes_filter_job {
+    const uint32_t *src;
+    int src_w;
+    int src_h;
+    int src_pitch;
+
+    uint32_t *dst;
+    int dst_pitch;
+
+    // Output rows per source row of the original frame, used
+    // by the scanline mask to darken one row per source row.
+    int factor;
+};
+
+#define SRC_ROW(job, y) \
+    ((job)->src + ((y) < 0 ? 0 : (y) >= (job)->src_h ? (job)->src_h - 1 : (y)) * \
+     (job)->src_pitch)
+
+#if defined(__SSE2__)
+
+static inline __m128i nes_sel(__m128i mask, __m128i a, __m128i b)
+{
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+// x == y && !(u || v), from the cmpeq masks
+static inline __m128i nes_rule(__m128i eq, __m128i u, __m128i v)
+{
+    return _mm_andnot_si128(_mm_or_si128(u, v), eq);
+}
+
+#define NES_EQ(a, b) _mm_cmpeq_epi32(a, b)
+#define NES_LOAD(p)  _mm_loadu_si128((const __m128i *)(p))
+#define NES_STORE(p, v) _mm_storeu_si128((__m128i *)(p), v)
+
+#endif
+
+// Scale2x (EPX). Each pixel E becomes a 2x2 block, and a corner
+// takes the colour of its two edge neighbours when they agree and
+// the opposite neighbours do not, which rounds off diagonal edges.
+//
+//   . B .        E0 E1
+//   D E F   =>   E2 E3
+//   . H .
+static void nes_scale2x_px(const uint32_t *above, const uint32_t *cur,
+                           const uint32_t *below, int x, int w,
+                           uint32_t *out0, uint32_t *out1)
+{
+    uint32_t b, d, e, f, h;
+
+    b = above[x];
+    h = below[x];
+    e = cur[x];
+    d = cur[x > 0 ? x - 1 : x];
+    f = cur[x < w - 1 ? x + 1 : x];
+
+    if (b != h && d != f) {
+        out0[2 * x]     = (d == b) ? d : e;
+        out0[2 * x + 1] = (b == f) ? f : e;
+        out1[2 * x]     = (d == h) ? d : e;
+        out1[2 * x + 1] = (h == f) ? f : e;
+    } else {
+        out0[2 * x] = out0[2 * x + 1] = e;
+        out1[2 * x] = out1[2 * x + 1] = e;
+    }
+}
+
+static void nes_scale2x_rows(void *arg, int start, int end)
+{
+    struct nes_filter_job *job = arg;
+    const uint32_t *above, *cur, *below;
+    uint32_t *out0, *out1;
+    int x, w = job->src_w;
+
+    for (int y = start; y < end; ++y) {
+        above = SRC_ROW(job, y - 1);
+        cur = SRC_ROW(job, y);
+        below = SRC_ROW(job, y + 1);
+        out0 = job->dst + (2 * y) * job->dst_pitch;
+        out1 = out0 + job->dst_pitch;
+
+        nes_scale2x_px(above, cur, below, 0, w, out0, out1);
+        x = 1;
+
+#if defined(__SSE2__)
+        for (; x + 5 <= w; x += 4) {
+            __m128i b = NES_LOAD(above + x), h = NES_LOAD(below + x);
+            __m128i e = NES_LOAD(cur + x);
+            __m128i d = NES_LOAD(cur + x - 1), f = NES_LOAD(cur + x + 1);
+            __m128i bh = NES_EQ(b, h), df = NES_EQ(d, f);
+            __m128i e0, e1, e2, e3;
+
+            e0 = nes_sel(nes_rule(NES_EQ(d, b), bh, df), d, e);
+            e1 = nes_sel(nes_rule(NES_EQ(b, f), bh, df), f, e);
+            e2 = nes_sel(nes_rule(NES_EQ(d, h), bh, df), d, e);
+            e3 = nes_sel(nes_rule(NES_EQ(h, f), bh, df), f, e);
+
+            NES_STORE(out0 + 2 * x,     _mm_unpacklo_epi32(e0, e1));
+            NES_STORE(out0 + 2 * x + 4, _mm_unpackhi_epi32(e0, e1));
+            NES_STORE(out1 + 2 * x,     _mm_unpacklo_epi32(e2, e3));
+            NES_STORE(out1 + 2 * x + 4, _mm_unpackhi_epi32(e2, e3));
+        }
+#endif
+
+        for (; x < w; ++x)
+            nes_scale2x_px(above, cur, below, x, w, out0, out1);
+    }
+}
+
+// Scale3x (AdvMAME3x), same idea over a 3x3 block
+//
+//   A B C        E0 E1 E2
+//   D E F   =>   E3 E4 E5
+//   G H I        E6 E7 E8
+static void nes_scale3x_px(const uint32_t *above, const uint32_t *cur,
+                           const uint32_t *below, int x, int w,
+                           uint32_t *out0, uint32_t *out1, uint32_t *out2)
+{
+    uint32_t a, b, c, d, e, f, g, h, i;
+    int l, r;
+
+    l = x > 0 ? x - 1 : x;
+    r = x < w - 1 ? x + 1 : x;
+
+    a = above[l]; b = above[x]; c = above[r];
+    d = cur[l];   e = cur[x];   f = cur[r];
+    g = below[l]; h = below[x]; i = below[r];
+
+    out0 += 3 * x;
+    out1 += 3 * x;
+    out2 += 3 * x;
+
+    if (b != h && d != f) {
+        out0[0] = (d == b) ? d : e;
+        out0[1] = ((d == b && e != c) || (b == f && e != a)) ? b : e;
+        out0[2] = (b == f) ? f : e;
+        out1[0] = ((d == b && e != g) || (d == h && e != a)) ? d : e;
+        out1[1] = e;
+        out1[2] = ((b == f && e != i) || (h == f && e != c)) ? f : e;
+        out2[0] = (d == h) ? d : e;
+        out2[1] = ((d == h && e != i) || (h == f && e != g)) ? h : e;
+        out2[2] = (h == f) ? f : e;
+    } else {
+        out0[0] = out0[1] = out0[2] = e;
+        out1[0] = out1[1] = out1[2] = e;
+        out2[0] = out2[1] = out2[2] = e;
+    }
+}
+
+#if defined(__SSE2__)
+
+// Stores [p0 q0 r0 p1 q1 r1 p2 q2 r2 p3 q3 r3]
+static inline void nes_store3_sse2(uint32_t *out, __m128i p, __m128i q,
+                                   __m128i r)
+{
+    __m128 pq_lo = _mm_castsi128_ps(_mm_unpacklo_epi32(p, q));
+    __m128 rp_lo = _mm_castsi128_ps(_mm_unpacklo_epi32(r, p));
+    __m128 qr_lo = _mm_castsi128_ps(_mm_unpacklo_epi32(q, r));
+    __m128 pq_hi = _mm_castsi128_ps(_mm_unpackhi_epi32(p, q));
+    __m128 rp_hi = _mm_castsi128_ps(_mm_unpackhi_epi32(r, p));
+    __m128 qr_hi = _mm_castsi128_ps(_mm_unpackhi_epi32(q, r));
+
+    _mm_storeu_ps((float *)out,
+                  _mm_shuffle_ps(pq_lo, rp_lo, _MM_SHUFFLE(3, 0, 1, 0)));
+    _mm_storeu_ps((float *)out + 4,
+                  _mm_shuffle_ps(qr_lo, pq_hi, _MM_SHUFFLE(1, 0, 3, 2)));
+    _mm_storeu_ps((float *)out + 8,
+                  _mm_shuffle_ps(rp_hi, qr_hi, _MM_SHUFFLE(3, 2, 3, 0)));
+}
+
+#endif
+
+static void nes_scale3x_rows(void *arg, int start, int end)
+{
+    struct nes_filter_job *job = arg;
+    const uint32_t *above, *cur, *below;
+    uint32_t *out0, *out1, *out2;
+    int x, w = job->src_w;
+
+    for (int y = start; y < end; ++y) {
+        above = SRC_ROW(job, y - 1);
+        cur = SRC_ROW(job, y);
+        below = SRC_ROW(job, y + 1);
+        out0 = job->dst + (3 * y) * job->dst_pitch;
+        out1 = out0 + job->dst_pitch;
+        out2 = out1 + job->dst_pitch;
+
+        nes_scale3x_px(above, cur, below, 0, w, out0, out1, out2);
+        x = 1;
+
+#if defined(__SSE2__)
+        for (; x + 5 <= w; x += 4) {
+            __m128i a = NES_LOAD(above + x - 1), b = NES_LOAD(above + x);
+            __m128i c = NES_LOAD(above + x + 1);
+            __m128i d = NES_LOAD(cur + x - 1), e = NES_LOAD(cur + x);
+            __m128i f = NES_LOAD(cur + x + 1);
+            __m128i g = NES_LOAD(below + x - 1), h = NES_LOAD(below + x);
+            __m128i i = NES_LOAD(below + x + 1);
+            __m128i bh = NES_EQ(b, h), df = NES_EQ(d, f);
+            __m128i db, bf, dh, hf, ne_a, ne_c, ne_g, ne_i;
+            __m128i e0, e1, e2, e3, e5, e6, e7, e8;
+
+            db = nes_rule(NES_EQ(d, b), bh, df);
+            bf = nes_rule(NES_EQ(b, f), bh, df);
+            dh = nes_rule(NES_EQ(d, h), bh, df);
+            hf = nes_rule(NES_EQ(h, f), bh, df);
+
+            // Masks of e != neighbour, applied with andnot
+            ne_a = NES_EQ(e, a);
+            ne_c = NES_EQ(e, c);
+            ne_g = NES_EQ(e, g);
+            ne_i = NES_EQ(e, i);
+
+            e0 = nes_sel(db, d, e);
+            e1 = nes_sel(_mm_or_si128(_mm_andnot_si128(ne_c, db),
+                                      _mm_andnot_si128(ne_a, bf)), b, e);
+            e2 = nes_sel(bf, f, e);
+            e3 = nes_sel(_mm_or_si128(_mm_andnot_si128(ne_g, db),
+                                      _mm_andnot_si128(ne_a, dh)), d, e);
+            e5 = nes_sel(_mm_or_si128(_mm_andnot_si128(ne_i, bf),
+                                      _mm_andnot_si128(ne_c, hf)), f, e);
+            e6 = nes_sel(dh, d, e);
+            e7 = nes_sel(_mm_or_si128(_mm_andnot_si128(ne_i, dh),
+                                      _mm_andnot_si128(ne_g, hf)), h, e);
+            e8 = nes_sel(hf, f, e);
+
+            nes_store3_sse2(out0 + 3 * x, e0, e1, e2);
+            nes_store3_sse2(out1 + 3 * x, e3, e, e5);
+            nes_store3_sse2(out2 + 3 * x, e6, e7, e8);
+        }
+#endif
+
+        for (; x < w; ++x)
+            nes_scale3x_px(above, cur, below, x, w, out0, out1, out2);
+    }
+}
+
+// Darkens the last output row of every source row by 25%, like
+// the gaps between the beam lines of a CRT. On an unscaled frame
+// that would be every row, so every other one is darkened instead.
+static void nes_scanlines_rows(void *arg, int start, int end)
+{
+    struct nes_filter_job *job = arg;
+    const uint32_t *src;
+    uint32_t *dst;
+    int x, w = job->src_w;
+    int period = job->factor > 1 ? job->factor : 2;
+
+    for (int y = start; y < end; ++y) {
+        src = job->src + y * job->src_pitch;
+        dst = job->dst + y * job->dst_pitch;
+
+        if ((y % period) != period - 1) {
+            memcpy(dst, src, w * sizeof(uint32_t));
+            continue;
+        }
+
+        x = 0;
+
+#if defined(__SSE2__)
+        for (; x + 4 <= w; x += 4) {
+            __m128i p = NES_LOAD(src + x);
+            __m128i q = _mm_and_si128(_mm_srli_epi32(p, 2),
+                                      _mm_set1_epi32(0x003f3f3f));
+
+            NES_STORE(dst + x, _mm_sub_epi32(p, q));
+        }
+#endif
+
+        for (; x < w; ++x)
+            dst[x] = src[x] - ((src[x] >> 2) & 0x003f3f3f);
+    }
+}
+
+static inline uint32_t nes_avg(uint32_t a, uint32_t b)
+{
+    // Per byte rounded average, the same as pavgb
+    return (a | b) - (((a ^ b) >> 1) & 0x7f7f7f7f);
+}
+
+// Horizontal [1 2 1] blur, the way an NTSC signal smears colour
+// into the neighbouring pixels.
+static void nes_blur_rows(void *arg, int start, int end)
+{
+    struct nes_filter_job *job = arg;
+    const uint32_t *src;
+    uint32_t *dst;
+    int x, w = job->src_w;
+
+    for (int y = start; y < end; ++y) {
+        src = job->src + y * job->src_pitch;
+        dst = job->dst + y * job->dst_pitch;
+
+        dst[0] = nes_avg(nes_avg(src[0], src[1]), src[0]);
+        x = 1;
+
+#if defined(__SSE2__)
+        for (; x + 5 <= w; x += 4) {
+            __m128i l = NES_LOAD(src + x - 1);
+            __m128i c = NES_LOAD(src + x);
+            __m128i r = NES_LOAD(src + x + 1);
+
+            NES_STORE(dst + x, _mm_avg_epu8(_mm_avg_epu8(l, r), c));
+        }
+#endif
+
+        for (; x < w - 1; ++x)
+            dst[x] = nes_avg(nes_avg(src[x - 1], src[x + 1]), src[x]);
+
+        dst[w - 1] = nes_avg(nes_avg(src[w - 2], src[w - 1]), src[w - 1]);
+    }
+}
+
+static int nes_filter_scale(enum nes_filter filter)
+{
+    switch (filter) {
+    case NES_FILTER_SCALE2X:
+        return 2;
+    case NES_FILTER_SCALE3X:
+        return 3;
+    default:
+        return 1;
+    }
+}
+
+static int nes_filter_parse(struct nes_filter_chain *chain, const char *name,
+                            size_t len)
+{
+    static const struct {
+        const char *name;
+        enum nes_filter stages[2];
+        int count;
+    } filters[] = {
+        { "scale2x",   { NES_FILTER_SCALE2X },                     1 },
+        { "scale3x",   { NES_FILTER_SCALE3X },                     1 },
+        // Scale4x is Scale2x applied twice
+        { "scale4x",   { NES_FILTER_SCALE2X, NES_FILTER_SCALE2X }, 2 },
+        { "scanlines", { NES_FILTER_SCANLINES },                   1 },
+        { "blur",      { NES_FILTER_BLUR },                        1 },
+    };
+
+    for (size_t i = 0; i < sizeof(filters) / sizeof(filters[0]); ++i) {
+        if (strlen(filters[i].name) != len ||
+            strncmp(filters[i].name, name, len))
+            continue;
+
+        if (chain->count + filters[i].count > NES_FILTER_MAX_STAGES)
+            return -1;
+
+        for (int k = 0; k < filters[i].count; ++k)
+            chain->stages[chain->count++] = filters[i].stages[k];
+
+        return 0;
+    }
+
+    return -1;
+}
+
+// The spec is a comma separated list of filters, for example
+// "scale3x,scanlines".
+int nes_filter_chain_init(struct nes_filter_chain *chain,
+                          struct nes_pool *pool, const char *spec)
+{
+    const char *p, *comma;
+    size_t pixels, largest;
+
+    memset(chain, 0, sizeof(*chain));
+
+    chain->pool = pool;
+    chain->width = 256;
+    chain->height = 240;
+
+    for (p = spec; *p; p = *comma ? comma + 1 : comma) {
+        comma = strchr(p, ',');
+        if (!comma)
+            comma = p + strlen(p);
+
+        if (nes_filter_parse(chain, p, comma - p))
+            return -1;
+    }
+
+    largest = 0;
+
+    for (int i = 0; i < chain->count; ++i) {
+        chain->width *= nes_filter_scale(chain->stages[i]);
+        chain->height *= nes_filter_scale(chain->stages[i]);
+
+        // The output of the last stage goes to the caller
+        pixels = (size_t)chain->width * chain->height;
+        if (i < chain->count - 1 && pixels > largest)
+            largest = pixels;
+    }
+
+    if (largest) {
+        chain->scratch[0] = malloc(largest * sizeof(uint32_t));
+        chain->scratch[1] = malloc(largest * sizeof(uint32_t));
+
+        if (!chain->scratch[0] || !chain->scratch[1]) {
+            nes_filter_chain_free(chain);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// dst_pitch is in pixels
+void nes_filter_chain_run(struct nes_filter_chain *chain,
+                          const uint32_t *src, uint32_t *dst, int dst_pitch)
+{
+    struct nes_filter_job job;
+    nes_pool_fn fn;
+    int scale, rows;
+
+    job.src = src;
+    job.src_w = 256;
+    job.src_h = 240;
+    job.src_pitch = 256;
+
+    if (chain->count == 0) {
+        for (int y = 0; y < 240; ++y)
+            memcpy(dst + y * dst_pitch, src + y * 256, 256 * sizeof(uint32_t));
+        return;
+    }
+
+    for (int i = 0; i < chain->count; ++i) {
+        scale = nes_filter_scale(chain->stages[i]);
+
+        if (i == chain->count - 1) {
+            job.dst = dst;
+            job.dst_pitch = dst_pitch;
+        } else {
+            job.dst = chain->scratch[i & 1];
+            job.dst_pitch = job.src_w * scale;
+        }
+
+        job.factor = job.src_h / 240;
+
+        switch (chain->stages[i]) {
+        case NES_FILTER_SCALE2X:
+            fn = nes_scale2x_rows;
+            break;
+        case NES_FILTER_SCALE3X:
+            fn = nes_scale3x_rows;
+            break;
+        case NES_FILTER_SCANLINES:
+            fn = nes_scanlines_rows;
+            break;
+        case NES_FILTER_BLUR:
+        default:
+            fn = nes_blur_rows;
+            break;
+        }
+
+        // Scalers are split by source row, so that a stripe
+        // covers whole blocks of output rows.
+        rows = job.src_h;
+
+        nes_pool_run(chain->pool, fn, &job, rows,
+                     (NES_FILTER_STRIPE + scale - 1) / scale);
+
+        job.src = job.dst;
+        job.src_w *= scale;
+        job.src_h *= scale;
+        job.src_pitch = job.dst_pitch;
+    }
+}
+
+void nes_filter_chain_free(struct nes_filter_chain *chain)
+{
+    free(chain->scratch[0]);
+    free(chain->scratch[1]);
+
+    chain->scratch[0] = NULL;
+    chain->scratch[1] = NULL;
+}
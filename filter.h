@@ -0,0 +1,44 @@
+#ifndef NES_FILTER_HEADER
+#define NES_FILTER_HEADER
+
+#include <stdint.h>
+
+#include "pool.h"
+
+#define NES_FILTER_MAX_STAGES   8
+
+// Rows of output handed to a worker at a time
+#define NES_FILTER_STRIPE       16
+
+enum nes_filter {
+    NES_FILTER_SCALE2X = 0,
+    NES_FILTER_SCALE3X,
+    NES_FILTER_SCANLINES,
+    NES_FILTER_BLUR,
+};
+
+// Post-processing applied to the 256x240 ARGB8888 frame before
+// it is presented. Stages run in order, each one split into row
+// stripes across the pool. Intermediate results live in scratch
+// buffers, and the last stage writes straight into the caller's
+// destination (typically a locked SDL texture).
+struct nes_filter_chain {
+    enum nes_filter stages[NES_FILTER_MAX_STAGES];
+    int count;
+
+    // Output size of the whole chain
+    int width;
+    int height;
+
+    uint32_t *scratch[2];
+
+    struct nes_pool *pool;
+};
+
+int nes_filter_chain_init(struct nes_filter_chain *chain,
+                          struct nes_pool *pool, const char *spec);
+void nes_filter_chain_run(struct nes_filter_chain *chain,
+                          const uint32_t *src, uint32_t *dst, int dst_pitch);
+void nes_filter_chain_free(struct nes_filter_chain *chain);
+
+#endif
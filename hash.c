@@ -0,0 +1,323 @@
+#include <string.h>
+#include <pthread.h>
+
+#include "hash.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#include <cpuid.h>
+#endif
+
+// Slicing-by-8: crc32_table[k][i] is the CRC of byte i followed
+// by k zero bytes, so eight input bytes are folded per step.
+static uint32_t crc32_table[8][256];
+static pthread_once_t crc32_once = PTHREAD_ONCE_INIT;
+
+static void nes_crc32_table_init(void)
+{
+    uint32_t c;
+
+    for (uint32_t i = 0; i < 256; ++i) {
+        c = i;
+
+        for (int k = 0; k < 8; ++k)
+            c = (c & 1) ? (c >> 1) ^ 0xedb88320 : (c >> 1);
+
+        crc32_table[0][i] = c;
+    }
+
+    for (uint32_t i = 0; i < 256; ++i) {
+        c = crc32_table[0][i];
+
+        for (int k = 1; k < 8; ++k) {
+            c = crc32_table[0][c & 0xff] ^ (c >> 8);
+            crc32_table[k][i] = c;
+        }
+    }
+}
+
+static inline uint32_t nes_load_le32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+uint32_t nes_crc32(uint32_t crc, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    uint32_t one, two;
+
+    pthread_once(&crc32_once, nes_crc32_table_init);
+
+    crc = ~crc;
+
+    for (; len >= 8; len -= 8, p += 8) {
+        one = nes_load_le32(p) ^ crc;
+        two = nes_load_le32(p + 4);
+
+        crc = crc32_table[7][one & 0xff] ^
+              crc32_table[6][(one >> 8) & 0xff] ^
+              crc32_table[5][(one >> 16) & 0xff] ^
+              crc32_table[4][one >> 24] ^
+              crc32_table[3][two & 0xff] ^
+              crc32_table[2][(two >> 8) & 0xff] ^
+              crc32_table[1][(two >> 16) & 0xff] ^
+              crc32_table[0][two >> 24];
+    }
+
+    while (len--)
+        crc = crc32_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+    return ~crc;
+}
+
+#define ROL(x, n)   (((x) << (n)) | ((x) >> (32 - (n))))
+
+static void nes_sha1_blocks_scalar(uint32_t h[5], const uint8_t *p,
+                                   size_t blocks)
+{
+    uint32_t w[80], a, b, c, d, e, f, k, t;
+
+    for (; blocks; --blocks, p += 64) {
+        for (int i = 0; i < 16; ++i)
+            w[i] = ((uint32_t)p[4 * i] << 24) | (p[4 * i + 1] << 16) |
+                   (p[4 * i + 2] << 8) | p[4 * i + 3];
+
+        for (int i = 16; i < 80; ++i)
+            w[i] = ROL(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+        a = h[0];
+        b = h[1];
+        c = h[2];
+        d = h[3];
+        e = h[4];
+
+        for (int i = 0; i < 80; ++i) {
+            if (i < 20) {
+                f = (b & c) | (~b & d);
+                k = 0x5a827999;
+            } else if (i < 40) {
+                f = b ^ c ^ d;
+                k = 0x6ed9eba1;
+            } else if (i < 60) {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8f1bbcdc;
+            } else {
+                f = b ^ c ^ d;
+                k = 0xca62c1d6;
+            }
+
+            t = ROL(a, 5) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = ROL(b, 30);
+            b = a;
+            a = t;
+        }
+
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#define NES_SHA __attribute__((target("sha,sse4.1")))
+
+// Four rounds: ea takes the message words, eb keeps the state
+// the next group needs.
+#define SHA1_QUAD(ea, eb, m, f)                                 \
+    do {                                                        \
+        ea = _mm_sha1nexte_epu32(ea, m);                        \
+        eb = abcd;                                              \
+        abcd = _mm_sha1rnds4_epu32(abcd, ea, f);                \
+    } while (0)
+
+// Message schedule step for the three groups following m
+#define SHA1_SCHED(m, n1, n2, n3)                               \
+    do {                                                        \
+        n1 = _mm_sha1msg2_epu32(n1, m);                         \
+        n2 = _mm_xor_si128(n2, m);                              \
+        n3 = _mm_sha1msg1_epu32(n3, m);                         \
+    } while (0)
+
+static NES_SHA void nes_sha1_blocks_ni(uint32_t h[5], const uint8_t *p,
+                                       size_t blocks)
+{
+    const __m128i swap = _mm_set_epi64x(0x0001020304050607ULL,
+                                        0x08090a0b0c0d0e0fULL);
+    __m128i abcd, abcd_save, e0, e1, e_save, m0, m1, m2, m3;
+
+    abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)h), 0x1b);
+    e0 = _mm_set_epi32(h[4], 0, 0, 0);
+
+    for (; blocks; --blocks, p += 64) {
+        abcd_save = abcd;
+        e_save = e0;
+
+        m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)p), swap);
+        m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 16)), swap);
+        m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 32)), swap);
+        m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 48)), swap);
+
+        // Rounds 0-15, the schedule fills up
+        e0 = _mm_add_epi32(e0, m0);
+        e1 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+        SHA1_QUAD(e1, e0, m1, 0);
+        m0 = _mm_sha1msg1_epu32(m0, m1);
+
+        SHA1_QUAD(e0, e1, m2, 0);
+        m1 = _mm_sha1msg1_epu32(m1, m2);
+        m0 = _mm_xor_si128(m0, m2);
+
+        SHA1_QUAD(e1, e0, m3, 0);
+        SHA1_SCHED(m3, m0, m1, m2);
+
+        // Rounds 16-67
+        SHA1_QUAD(e0, e1, m0, 0); SHA1_SCHED(m0, m1, m2, m3);
+        SHA1_QUAD(e1, e0, m1, 1); SHA1_SCHED(m1, m2, m3, m0);
+        SHA1_QUAD(e0, e1, m2, 1); SHA1_SCHED(m2, m3, m0, m1);
+        SHA1_QUAD(e1, e0, m3, 1); SHA1_SCHED(m3, m0, m1, m2);
+        SHA1_QUAD(e0, e1, m0, 1); SHA1_SCHED(m0, m1, m2, m3);
+        SHA1_QUAD(e1, e0, m1, 1); SHA1_SCHED(m1, m2, m3, m0);
+        SHA1_QUAD(e0, e1, m2, 2); SHA1_SCHED(m2, m3, m0, m1);
+        SHA1_QUAD(e1, e0, m3, 2); SHA1_SCHED(m3, m0, m1, m2);
+        SHA1_QUAD(e0, e1, m0, 2); SHA1_SCHED(m0, m1, m2, m3);
+        SHA1_QUAD(e1, e0, m1, 2); SHA1_SCHED(m1, m2, m3, m0);
+        SHA1_QUAD(e0, e1, m2, 2); SHA1_SCHED(m2, m3, m0, m1);
+        SHA1_QUAD(e1, e0, m3, 3); SHA1_SCHED(m3, m0, m1, m2);
+        SHA1_QUAD(e0, e1, m0, 3); SHA1_SCHED(m0, m1, m2, m3);
+
+        // Rounds 68-79, the schedule drains
+        SHA1_QUAD(e1, e0, m1, 3);
+        m2 = _mm_sha1msg2_epu32(m2, m1);
+        m3 = _mm_xor_si128(m3, m1);
+
+        SHA1_QUAD(e0, e1, m2, 3);
+        m3 = _mm_sha1msg2_epu32(m3, m2);
+
+        SHA1_QUAD(e1, e0, m3, 3);
+
+        e0 = _mm_sha1nexte_epu32(e0, e_save);
+        abcd = _mm_add_epi32(abcd, abcd_save);
+    }
+
+    _mm_storeu_si128((__m128i *)h, _mm_shuffle_epi32(abcd, 0x1b));
+    h[4] = _mm_extract_epi32(e0, 3);
+}
+
+static int nes_cpu_has_sha(void)
+{
+    unsigned int a, b, c, d;
+
+    if (!__get_cpuid(1, &a, &b, &c, &d) || !(c & bit_SSE4_1))
+        return 0;
+
+    if (!__get_cpuid_count(7, 0, &a, &b, &c, &d))
+        return 0;
+
+    return !!(b & bit_SHA);
+}
+
+#endif
+
+typedef void (*nes_sha1_blocks_fn)(uint32_t h[5], const uint8_t *p,
+                                   size_t blocks);
+
+static nes_sha1_blocks_fn nes_sha1_blocks;
+static pthread_once_t sha1_once = PTHREAD_ONCE_INIT;
+
+static void nes_sha1_select(void)
+{
+    nes_sha1_blocks = nes_sha1_blocks_scalar;
+
+#if defined(__x86_64__) || defined(__i386__)
+    if (nes_cpu_has_sha())
+        nes_sha1_blocks = nes_sha1_blocks_ni;
+#endif
+}
+
+void nes_sha1_init(struct nes_sha1 *ctx)
+{
+    pthread_once(&sha1_once, nes_sha1_select);
+
+    ctx->h[0] = 0x67452301;
+    ctx->h[1] = 0xefcdab89;
+    ctx->h[2] = 0x98badcfe;
+    ctx->h[3] = 0x10325476;
+    ctx->h[4] = 0xc3d2e1f0;
+    ctx->len = 0;
+}
+
+void nes_sha1_update(struct nes_sha1 *ctx, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    size_t used = ctx->len & 63;
+    size_t n;
+
+    ctx->len += len;
+
+    if (used) {
+        n = 64 - used;
+        if (n > len)
+            n = len;
+
+        memcpy(ctx->buf + used, p, n);
+        p += n;
+        len -= n;
+
+        if (used + n < 64)
+            return;
+
+        nes_sha1_blocks(ctx->h, ctx->buf, 1);
+    }
+
+    if (len >= 64) {
+        nes_sha1_blocks(ctx->h, p, len / 64);
+        p += len & ~(size_t)63;
+        len &= 63;
+    }
+
+    memcpy(ctx->buf, p, len);
+}
+
+void nes_sha1_final(struct nes_sha1 *ctx, uint8_t digest[NES_SHA1_SIZE])
+{
+    uint64_t bits = ctx->len * 8;
+    size_t used = ctx->len & 63;
+
+    ctx->buf[used++] = 0x80;
+
+    if (used > 56) {
+        memset(ctx->buf + used, 0, 64 - used);
+        nes_sha1_blocks(ctx->h, ctx->buf, 1);
+        used = 0;
+    }
+
+    memset(ctx->buf + used, 0, 56 - used);
+
+    for (int i = 0; i < 8; ++i)
+        ctx->buf[56 + i] = bits >> (56 - 8 * i);
+
+    nes_sha1_blocks(ctx->h, ctx->buf, 1);
+
+    for (int i = 0; i < 5; ++i) {
+        digest[4 * i] = ctx->h[i] >> 24;
+        digest[4 * i + 1] = ctx->h[i] >> 16;
+        digest[4 * i + 2] = ctx->h[i] >> 8;
+        digest[4 * i + 3] = ctx->h[i];
+    }
+}
+
+void nes_sha1(const void *data, size_t len, uint8_t digest[NES_SHA1_SIZE])
+{
+    struct nes_sha1 ctx;
+
+    nes_sha1_init(&ctx);
+    nes_sha1_update(&ctx, data, len);
+    nes_sha1_final(&ctx, digest);
+}
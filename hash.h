@@ -0,0 +1,28 @@
+#ifndef NES_HASH_HEADER
+#define NES_HASH_HEADER
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define NES_SHA1_SIZE   20
+
+// CRC-32 (IEEE 802.3, as used by zlib and No-Intro). Pass 0
+// as the initial crc and feed the result back in to hash data
+// in several pieces. Safe to call from several threads.
+uint32_t nes_crc32(uint32_t crc, const void *buf, size_t len);
+
+// Incremental SHA-1. Uses the SHA extensions when the host
+// CPU has them.
+struct nes_sha1 {
+    uint32_t h[5];
+    uint64_t len;
+    uint8_t buf[64];
+};
+
+void nes_sha1_init(struct nes_sha1 *ctx);
+void nes_sha1_update(struct nes_sha1 *ctx, const void *data, size_t len);
+void nes_sha1_final(struct nes_sha1 *ctx, uint8_t digest[NES_SHA1_SIZE]);
+
+void nes_sha1(const void *data, size_t len, uint8_t digest[NES_SHA1_SIZE]);
+
+#endif
@@ -0,0 +1,341 @@
+#include <string.h>
+
+#include "idle.h"
+#include "nes.h"
+
+// How an instruction may appear in an idle loop
+#define NES_IDLE_OP_NO          0   // Writes, stack, indirect reads
+#define NES_IDLE_OP_REG         1   // Implied, accumulator, immediate
+#define NES_IDLE_OP_ZP          2
+#define NES_IDLE_OP_ZPX         3
+#define NES_IDLE_OP_ZPY         4
+#define NES_IDLE_OP_ABS         5
+#define NES_IDLE_OP_ABX         6
+#define NES_IDLE_OP_ABY         7
+#define NES_IDLE_OP_BRANCH      8
+#define NES_IDLE_OP_JMP         9
+
+static const uint8_t nes_idle_ops[256] = {
+    // LDA, LDX, LDY
+    [0xa9] = NES_IDLE_OP_REG, [0xa5] = NES_IDLE_OP_ZP,
+    [0xb5] = NES_IDLE_OP_ZPX, [0xad] = NES_IDLE_OP_ABS,
+    [0xbd] = NES_IDLE_OP_ABX, [0xb9] = NES_IDLE_OP_ABY,
+    [0xa2] = NES_IDLE_OP_REG, [0xa6] = NES_IDLE_OP_ZP,
+    [0xb6] = NES_IDLE_OP_ZPY, [0xae] = NES_IDLE_OP_ABS,
+    [0xbe] = NES_IDLE_OP_ABY,
+    [0xa0] = NES_IDLE_OP_REG, [0xa4] = NES_IDLE_OP_ZP,
+    [0xb4] = NES_IDLE_OP_ZPX, [0xac] = NES_IDLE_OP_ABS,
+    [0xbc] = NES_IDLE_OP_ABX,
+
+    // BIT, CMP, CPX, CPY
+    [0x24] = NES_IDLE_OP_ZP,  [0x2c] = NES_IDLE_OP_ABS,
+    [0xc9] = NES_IDLE_OP_REG, [0xc5] = NES_IDLE_OP_ZP,
+    [0xd5] = NES_IDLE_OP_ZPX, [0xcd] = NES_IDLE_OP_ABS,
+    [0xdd] = NES_IDLE_OP_ABX, [0xd9] = NES_IDLE_OP_ABY,
+    [0xe0] = NES_IDLE_OP_REG, [0xe4] = NES_IDLE_OP_ZP,
+    [0xec] = NES_IDLE_OP_ABS,
+    [0xc0] = NES_IDLE_OP_REG, [0xc4] = NES_IDLE_OP_ZP,
+    [0xcc] = NES_IDLE_OP_ABS,
+
+    // AND, ORA, EOR, ADC, SBC
+    [0x29] = NES_IDLE_OP_REG, [0x25] = NES_IDLE_OP_ZP,
+    [0x35] = NES_IDLE_OP_ZPX, [0x2d] = NES_IDLE_OP_ABS,
+    [0x3d] = NES_IDLE_OP_ABX, [0x39] = NES_IDLE_OP_ABY,
+    [0x09] = NES_IDLE_OP_REG, [0x05] = NES_IDLE_OP_ZP,
+    [0x15] = NES_IDLE_OP_ZPX, [0x0d] = NES_IDLE_OP_ABS,
+    [0x1d] = NES_IDLE_OP_ABX, [0x19] = NES_IDLE_OP_ABY,
+    [0x49] = NES_IDLE_OP_REG, [0x45] = NES_IDLE_OP_ZP,
+    [0x55] = NES_IDLE_OP_ZPX, [0x4d] = NES_IDLE_OP_ABS,
+    [0x5d] = NES_IDLE_OP_ABX, [0x59] = NES_IDLE_OP_ABY,
+    [0x69] = NES_IDLE_OP_REG, [0x65] = NES_IDLE_OP_ZP,
+    [0x75] = NES_IDLE_OP_ZPX, [0x6d] = NES_IDLE_OP_ABS,
+    [0x7d] = NES_IDLE_OP_ABX, [0x79] = NES_IDLE_OP_ABY,
+    [0xe9] = NES_IDLE_OP_REG, [0xe5] = NES_IDLE_OP_ZP,
+    [0xf5] = NES_IDLE_OP_ZPX, [0xed] = NES_IDLE_OP_ABS,
+    [0xfd] = NES_IDLE_OP_ABX, [0xf9] = NES_IDLE_OP_ABY,
+
+    // Flags, transfers, register increments and shifts. Loops
+    // counting a register down never come back to the same
+    // registers, so they are never taken for idle.
+    [0x18] = NES_IDLE_OP_REG, [0x38] = NES_IDLE_OP_REG,
+    [0x58] = NES_IDLE_OP_REG, [0x78] = NES_IDLE_OP_REG,
+    [0xb8] = NES_IDLE_OP_REG, [0xd8] = NES_IDLE_OP_REG,
+    [0xf8] = NES_IDLE_OP_REG, [0xaa] = NES_IDLE_OP_REG,
+    [0xa8] = NES_IDLE_OP_REG, [0x8a] = NES_IDLE_OP_REG,
+    [0x98] = NES_IDLE_OP_REG, [0xba] = NES_IDLE_OP_REG,
+    [0x9a] = NES_IDLE_OP_REG, [0xca] = NES_IDLE_OP_REG,
+    [0x88] = NES_IDLE_OP_REG, [0xe8] = NES_IDLE_OP_REG,
+    [0xc8] = NES_IDLE_OP_REG, [0xea] = NES_IDLE_OP_REG,
+    [0x0a] = NES_IDLE_OP_REG, [0x4a] = NES_IDLE_OP_REG,
+    [0x2a] = NES_IDLE_OP_REG, [0x6a] = NES_IDLE_OP_REG,
+
+    [0x10] = NES_IDLE_OP_BRANCH, [0x30] = NES_IDLE_OP_BRANCH,
+    [0x50] = NES_IDLE_OP_BRANCH, [0x70] = NES_IDLE_OP_BRANCH,
+    [0x90] = NES_IDLE_OP_BRANCH, [0xb0] = NES_IDLE_OP_BRANCH,
+    [0xd0] = NES_IDLE_OP_BRANCH, [0xf0] = NES_IDLE_OP_BRANCH,
+
+    [0x4c] = NES_IDLE_OP_JMP,
+};
+
+void nes_idle_init(struct nes_idle *idle, int verify)
+{
+    memset(idle, 0, sizeof(*idle));
+
+    idle->verify = verify;
+    idle->irq_cycle = UINT64_MAX;
+}
+
+static inline void nes_idle_save(struct nes_idle_regs *regs,
+                                 const struct cpu_6502 *cpu)
+{
+    regs->a = cpu->a;
+    regs->x = cpu->x;
+    regs->y = cpu->y;
+    regs->p = cpu->p;
+    regs->s = cpu->s;
+}
+
+static inline int nes_idle_same(const struct nes_idle_regs *regs,
+                                const struct cpu_6502 *cpu)
+{
+    return regs->a == cpu->a && regs->x == cpu->x && regs->y == cpu->y &&
+           regs->p == cpu->p && regs->s == cpu->s;
+}
+
+// RAM only changes when the CPU writes it, and PPUSTATUS only on
+// the PPU events nes_ppu_dots_to_event() looks for, except that a
+// read with the vblank flag set clears it: the next iteration then
+// reads something else.
+static inline int nes_idle_stable(struct nes_bus *bus, uint16_t addr)
+{
+    if ((addr & 0xe007) == 0x2002)
+        return !(bus->ppu->status & 0x80);
+
+    return addr < 0x2000;
+}
+
+// Whether the instruction can be part of an idle loop body
+static int nes_idle_allowed(struct nes_bus *bus, const uint8_t *op)
+{
+    const struct cpu_6502 *cpu = bus->hooks->cpu;
+    uint16_t abs = op[1] | (op[2] << 8);
+
+    switch (nes_idle_ops[op[0]]) {
+    case NES_IDLE_OP_REG:
+    case NES_IDLE_OP_BRANCH:
+    case NES_IDLE_OP_JMP:
+    case NES_IDLE_OP_ZP:
+    case NES_IDLE_OP_ZPX:
+    case NES_IDLE_OP_ZPY:
+        return 1;
+    case NES_IDLE_OP_ABS:
+        return nes_idle_stable(bus, abs);
+    case NES_IDLE_OP_ABX:
+        return nes_idle_stable(bus, abs + cpu->x);
+    case NES_IDLE_OP_ABY:
+        return nes_idle_stable(bus, abs + cpu->y);
+    default:
+        return 0;
+    }
+}
+
+// Loop head of a backward branch or JMP at pc, or -1
+static int nes_idle_target(uint16_t pc, const uint8_t *op)
+{
+    uint16_t target, end;
+
+    switch (nes_idle_ops[op[0]]) {
+    case NES_IDLE_OP_BRANCH:
+        end = pc + 2;
+        target = end + (int8_t)op[1];
+        break;
+    case NES_IDLE_OP_JMP:
+        end = pc + 3;
+        target = op[1] | (op[2] << 8);
+        break;
+    default:
+        return -1;
+    }
+
+    if (target > pc || end - target > NES_IDLE_BODY)
+        return -1;
+
+    return target;
+}
+
+// CPU cycle of the next point at which anything the loop reads,
+// or the interrupt lines, can change
+static uint64_t nes_idle_event(struct nes_idle *idle, struct nes_bus *bus)
+{
+    uint64_t event;
+
+    event = bus->hooks->cpu->cycles + nes_ppu_dots_to_event(bus->ppu) / 3;
+    if (idle->irq_cycle < event)
+        event = idle->irq_cycle;
+
+    return event;
+}
+
+static void nes_idle_mismatch(struct nes_idle *idle, const struct cpu_6502 *cpu)
+{
+    if (!idle->mismatches++) {
+        idle->mismatch_pc = cpu->pc;
+        idle->mismatch_cycles = cpu->cycles;
+    }
+
+    idle->predicting = 0;
+}
+
+// Verify mode: the real run has to stay in the loop until the
+// predicted cycle, and be back at the head with the same
+// registers exactly then.
+static void nes_idle_check(struct nes_idle *idle, const struct cpu_6502 *cpu)
+{
+    if (cpu->cycles < idle->predict_cycles) {
+        if (cpu->pc < idle->predict_head || cpu->pc > idle->predict_tail)
+            nes_idle_mismatch(idle, cpu);
+        return;
+    }
+
+    if (cpu->cycles != idle->predict_cycles ||
+        cpu->pc != idle->predict_head ||
+        !nes_idle_same(&idle->predict_regs, cpu)) {
+        nes_idle_mismatch(idle, cpu);
+        return;
+    }
+
+    idle->verified++;
+    idle->predicting = 0;
+}
+
+// An iteration is over. Returns the cycles to skip, if any.
+static uint32_t nes_idle_head(struct nes_idle *idle, struct nes_bus *bus)
+{
+    struct cpu_6502 *cpu = bus->hooks->cpu;
+    uint64_t event, n;
+    uint32_t iter, skip = 0;
+
+    // Back from a skip, the registers have not changed
+    if (idle->resume) {
+        idle->resume = 0;
+        idle->head_cycles = cpu->cycles;
+        idle->clean = 1;
+        return 0;
+    }
+
+    iter = cpu->cycles - idle->head_cycles;
+    event = nes_idle_event(idle, bus);
+
+    // The iteration just run proves the loop idle only if nothing
+    // could change under it while it ran. Skips are whole
+    // iterations and leave at least one to run before the event.
+    if (idle->state == NES_IDLE_TRACKING && idle->clean && iter &&
+        cpu->cycles < idle->event_cycle && nes_idle_same(&idle->regs, cpu) &&
+        !idle->predicting) {
+        n = (event - cpu->cycles) / iter;
+        if (n >= 2)
+            skip = (n - 1) * iter;
+    }
+
+    // Trace records and watchpoints need every access to happen
+    if (skip && !idle->verify && (bus->hooks->trace || bus->hooks->watch))
+        skip = 0;
+
+    if (skip) {
+        idle->skips++;
+        idle->skipped += skip;
+        idle->frame_skipped += skip;
+
+        if (idle->verify) {
+            idle->predicting = 1;
+            idle->predict_head = idle->head;
+            idle->predict_tail = idle->tail;
+            idle->predict_cycles = cpu->cycles + skip;
+            nes_idle_save(&idle->predict_regs, cpu);
+            skip = 0;
+        } else {
+            idle->resume = 1;
+        }
+    }
+
+    idle->state = NES_IDLE_TRACKING;
+    idle->clean = 1;
+    idle->head_cycles = cpu->cycles;
+    idle->event_cycle = event;
+    nes_idle_save(&idle->regs, cpu);
+
+    return skip;
+}
+
+// Called by the CPU before executing the instruction at cpu->pc,
+// with the opcode and the two bytes following it. Returns a number
+// of cycles the CPU can add to its cycle count instead of running
+// anything, staying at the same instruction.
+uint32_t nes_idle_instr(struct nes_idle *idle, struct nes_bus *bus,
+                        const uint8_t *op)
+{
+    struct cpu_6502 *cpu = bus->hooks->cpu;
+    uint16_t pc = cpu->pc;
+    uint32_t skip;
+    int target;
+
+    if (idle->predicting)
+        nes_idle_check(idle, cpu);
+
+    if (idle->state != NES_IDLE_NONE &&
+        (pc < idle->head || pc > idle->tail)) {
+        idle->state = NES_IDLE_NONE;
+        idle->resume = 0;
+    }
+
+    if (idle->state != NES_IDLE_NONE && pc == idle->head) {
+        skip = nes_idle_head(idle, bus);
+        if (skip)
+            return skip;
+    }
+
+    if (idle->state == NES_IDLE_TRACKING && !nes_idle_allowed(bus, op))
+        idle->clean = 0;
+
+    // A new loop, or one nested in the current
+    target = nes_idle_target(pc, op);
+    if (target >= 0 && (idle->state == NES_IDLE_NONE ||
+                        target != idle->head)) {
+        idle->state = NES_IDLE_ARMED;
+        idle->resume = 0;
+        idle->head = target;
+        idle->tail = pc;
+    }
+
+    return 0;
+}
+
+void nes_idle_frame(struct nes_idle *idle)
+{
+    if (idle->frame_skipped > idle->max_frame_skipped)
+        idle->max_frame_skipped = idle->frame_skipped;
+
+    idle->frame_skipped = 0;
+    idle->frames++;
+}
+
+void nes_idle_report(struct nes_idle *idle, FILE *fp)
+{
+    fprintf(fp, "idle: %llu loops %s, %llu cycles (%.0f/frame, max %llu)\n",
+            (unsigned long long)idle->skips,
+            idle->verify ? "would be skipped" : "skipped",
+            (unsigned long long)idle->skipped,
+            idle->frames ? (double)idle->skipped / idle->frames : 0.0,
+            (unsigned long long)idle->max_frame_skipped);
+
+    if (!idle->verify)
+        return;
+
+    fprintf(fp, "idle: %llu skips verified, %llu mismatches",
+            (unsigned long long)idle->verified,
+            (unsigned long long)idle->mismatches);
+    if (idle->mismatches)
+        fprintf(fp, ", first at $%04X cycle %llu", idle->mismatch_pc,
+                (unsigned long long)idle->mismatch_cycles);
+    fputc('\n', fp);
+}
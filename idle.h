@@ -0,0 +1,93 @@
+#ifndef NES_IDLE_HEADER
+#define NES_IDLE_HEADER
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Longest loop body, in bytes, considered for skipping
+#define NES_IDLE_BODY           32
+
+#define NES_IDLE_NONE           0
+#define NES_IDLE_ARMED          1
+#define NES_IDLE_TRACKING       2
+
+struct nes_bus;
+
+struct nes_idle_regs {
+    uint8_t a;
+    uint8_t x;
+    uint8_t y;
+    uint8_t p;
+    uint8_t s;
+};
+
+// Idle loop detection. Games wait for vblank or for a flag their
+// NMI handler sets with loops like
+//
+//     wait: LDA $2002     or    wait: LDA nmi_done
+//           BPL wait                  BEQ wait
+//
+// The CPU reports every instruction through nes_idle_instr().
+// A short loop closed by a backward branch or JMP, whose body
+// only reads RAM or PPUSTATUS (while the vblank flag is clear)
+// and otherwise just works on registers, is idle once an
+// iteration comes back to the loop head with the registers
+// unchanged: until something outside the CPU changes what those
+// reads return, every further iteration is the same. Nothing does
+// before the next PPU status change, NMI or IRQ, so the iterations
+// up to then are skipped whole, by handing their cycles back to
+// the core.
+//
+// In verify mode nothing is skipped. Each skip that would have
+// been made is checked against the real run instead, which has to
+// reach the loop head at the predicted cycle with the same
+// registers without ever leaving the loop.
+struct nes_idle {
+    uint8_t state;
+    uint8_t clean;
+    uint8_t resume;
+    uint8_t verify;
+
+    // Loop being watched, from the branch target to the branch
+    uint16_t head;
+    uint16_t tail;
+
+    // Registers and cycle count at the loop head, and when the
+    // next event is due from there
+    struct nes_idle_regs regs;
+    uint64_t head_cycles;
+    uint64_t event_cycle;
+
+    // CPU cycle at which an IRQ source will assert its line,
+    // UINT64_MAX while none is scheduled. Set by the APU and
+    // mappers.
+    uint64_t irq_cycle;
+
+    // Skip made in verify mode that is still being checked
+    uint8_t predicting;
+    uint16_t predict_head;
+    uint16_t predict_tail;
+    uint64_t predict_cycles;
+    struct nes_idle_regs predict_regs;
+
+    uint64_t skips;
+    uint64_t skipped;
+    uint64_t frame_skipped;
+    uint64_t max_frame_skipped;
+    uint64_t frames;
+
+    uint64_t verified;
+    uint64_t mismatches;
+    uint16_t mismatch_pc;
+    uint64_t mismatch_cycles;
+};
+
+void nes_idle_init(struct nes_idle *idle, int verify);
+
+uint32_t nes_idle_instr(struct nes_idle *idle, struct nes_bus *bus,
+                        const uint8_t *op);
+void nes_idle_frame(struct nes_idle *idle);
+
+void nes_idle_report(struct nes_idle *idle, FILE *fp);
+
+#endif
@@ -0,0 +1,610 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <limits.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "library.h"
+#include "pool.h"
+
+static int nes_hex_decode(const char *s, uint8_t *out, size_t bytes)
+{
+    unsigned int byte;
+
+    for (size_t i = 0; i < bytes; ++i) {
+        if (sscanf(s + 2 * i, "%2x", &byte) != 1)
+            return -1;
+
+        out[i] = byte;
+    }
+
+    return 0;
+}
+
+static int nes_romdb_cmp(const void *a, const void *b)
+{
+    return memcmp(a, b, NES_SHA1_SIZE);
+}
+
+int nes_romdb_load(struct nes_romdb *db, const char *name)
+{
+    struct nes_romdb_entry *entries;
+    char line[256], sha1[41], header[33];
+    size_t cap = 0;
+    FILE *fp;
+    int ret = 0;
+
+    memset(db, 0, sizeof(*db));
+
+    fp = fopen(name, "r");
+    if (!fp)
+        return -1;
+
+    while (fgets(line, sizeof(line), fp)) {
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+
+        if (sscanf(line, "%40s %32s", sha1, header) != 2 ||
+            strlen(sha1) != 40 || strlen(header) != 32) {
+            ret = -1;
+            goto cleanup;
+        }
+
+        if (db->count == cap) {
+            cap = cap ? cap * 2 : 256;
+            entries = realloc(db->entries, cap * sizeof(*entries));
+            if (!entries) {
+                ret = -1;
+                goto cleanup;
+            }
+            db->entries = entries;
+        }
+
+        if (nes_hex_decode(sha1, db->entries[db->count].sha1, NES_SHA1_SIZE) ||
+            nes_hex_decode(header, (uint8_t *)&db->entries[db->count].header,
+                           sizeof(struct ines_header))) {
+            ret = -1;
+            goto cleanup;
+        }
+
+        db->count++;
+    }
+
+    qsort(db->entries, db->count, sizeof(*db->entries), nes_romdb_cmp);
+
+cleanup:
+    fclose(fp);
+
+    if (ret)
+        nes_romdb_free(db);
+
+    return ret;
+}
+
+const struct ines_header *nes_romdb_find(const struct nes_romdb *db,
+                                         const uint8_t *sha1)
+{
+    const struct nes_romdb_entry *entry;
+
+    if (!db || !db->count)
+        return NULL;
+
+    entry = bsearch(sha1, db->entries, db->count, sizeof(*entry),
+                    nes_romdb_cmp);
+
+    return entry ? &entry->header : NULL;
+}
+
+void nes_romdb_free(struct nes_romdb *db)
+{
+    free(db->entries);
+
+    memset(db, 0, sizeof(*db));
+}
+
+int nes_index_open(struct nes_index *index, const char *name)
+{
+    const struct nes_index_file *file;
+    struct stat st;
+    uint64_t entries_end, order_end, strings_end;
+    int fd;
+
+    memset(index, 0, sizeof(*index));
+
+    fd = open(name, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    if (fstat(fd, &st) || (size_t)st.st_size < sizeof(*file)) {
+        close(fd);
+        return -1;
+    }
+
+    index->size = st.st_size;
+    index->map = mmap(NULL, index->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (index->map == MAP_FAILED) {
+        index->map = NULL;
+        return -1;
+    }
+
+    file = index->map;
+
+    // Validate once, so lookups can trust every offset
+    entries_end = sizeof(*file) +
+                  (uint64_t)file->count * sizeof(struct nes_index_entry);
+    order_end = (uint64_t)file->crc_order + file->count * sizeof(uint32_t);
+    strings_end = (uint64_t)file->strings + file->strings_size;
+
+    if (memcmp(file->magic, NES_INDEX_MAGIC, 4) ||
+        file->version != NES_INDEX_VERSION ||
+        file->entry_size != sizeof(struct nes_index_entry) ||
+        entries_end > index->size || file->crc_order < entries_end ||
+        (file->crc_order & 3) || order_end > index->size ||
+        file->strings < order_end || strings_end > index->size ||
+        !file->strings_size)
+        goto bad;
+
+    index->file = file;
+    index->entries = (const void *)((const uint8_t *)index->map + sizeof(*file));
+    index->crc_order = (const void *)((const uint8_t *)index->map + file->crc_order);
+    index->strings = (const char *)index->map + file->strings;
+
+    if (index->strings[file->strings_size - 1])
+        goto bad;
+
+    for (uint32_t i = 0; i < file->count; ++i) {
+        if (index->entries[i].path >= file->strings_size ||
+            index->crc_order[i] >= file->count)
+            goto bad;
+    }
+
+    return 0;
+
+bad:
+    nes_index_close(index);
+
+    return -1;
+}
+
+void nes_index_close(struct nes_index *index)
+{
+    if (index->map)
+        munmap(index->map, index->size);
+
+    memset(index, 0, sizeof(*index));
+}
+
+const char *nes_index_path(const struct nes_index *index,
+                           const struct nes_index_entry *entry)
+{
+    return index->strings + entry->path;
+}
+
+const struct nes_index_entry *nes_index_find_path(const struct nes_index *index,
+                                                  const char *path)
+{
+    uint32_t lo = 0, hi, mid;
+    int cmp;
+
+    if (!index->file)
+        return NULL;
+
+    hi = index->file->count;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        cmp = strcmp(path, nes_index_path(index, &index->entries[mid]));
+
+        if (!cmp)
+            return &index->entries[mid];
+
+        if (cmp < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+
+    return NULL;
+}
+
+// Returns the first entry with the given CRC32. Several files
+// (copies, different headers) can share the same data.
+const struct nes_index_entry *nes_index_find_crc32(const struct nes_index *index,
+                                                   uint32_t crc)
+{
+    const struct nes_index_entry *entry;
+    uint32_t lo = 0, hi, mid;
+
+    if (!index->file)
+        return NULL;
+
+    hi = index->file->count;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+
+        if (index->entries[index->crc_order[mid]].crc32 < crc)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo == index->file->count)
+        return NULL;
+
+    entry = &index->entries[index->crc_order[lo]];
+
+    return entry->crc32 == crc ? entry : NULL;
+}
+
+struct nes_scan_job {
+    char **paths;
+    struct nes_index_entry *entries;
+
+    const struct nes_romdb *db;
+    const struct nes_index *prev;
+
+    struct nes_scan_stats *stats;
+};
+
+static void nes_scan_entry_info(struct nes_index_entry *entry)
+{
+    struct nes_rom_info info;
+
+    if (nes_ines_parse(&entry->header, &info)) {
+        entry->flags |= NES_INDEX_BAD;
+        return;
+    }
+
+    entry->mapper = info.mapper;
+    entry->submapper = info.submapper;
+    if (info.nes2)
+        entry->flags |= NES_INDEX_NES2;
+}
+
+// A known hash vouches for the data, whatever the dump's own
+// header said. Applied to reused entries as well, so a database
+// given on a later scan still corrects them.
+static void nes_scan_correct(struct nes_scan_job *job,
+                             struct nes_index_entry *entry)
+{
+    const struct ines_header *fix;
+
+    fix = nes_romdb_find(job->db, entry->sha1);
+    if (!fix)
+        return;
+
+    entry->header = *fix;
+    entry->flags &= ~NES_INDEX_NES2;
+    entry->flags |= NES_INDEX_CORRECTED;
+    __atomic_fetch_add(&job->stats->corrected, 1, __ATOMIC_RELAXED);
+
+    nes_scan_entry_info(entry);
+}
+
+static void nes_scan_hash(struct nes_scan_job *job,
+                          struct nes_index_entry *entry,
+                          const uint8_t *data, size_t size)
+{
+    struct nes_rom_info info;
+    size_t start = 0, len = size;
+
+    if (size >= sizeof(struct ines_header) &&
+        !nes_ines_parse((const struct ines_header *)data, &info)) {
+        memcpy(&entry->header, data, sizeof(entry->header));
+
+        // Everything after the header is hashed, the sizes it gives
+        // only tell whether the data is all there
+        start = sizeof(struct ines_header) + (info.trainer ? 512 : 0);
+        if (start > size)
+            start = size;
+
+        len = size - start;
+        if ((uint64_t)info.prg_rom_bytes + info.chr_rom_bytes > len)
+            entry->flags |= NES_INDEX_BAD;
+    } else {
+        // Not a ROM we understand, keep its hashes anyway
+        entry->flags |= NES_INDEX_BAD;
+    }
+
+    entry->crc32 = nes_crc32(0, data + start, len);
+    nes_sha1(data + start, len, entry->sha1);
+
+    __atomic_fetch_add(&job->stats->bytes, len, __ATOMIC_RELAXED);
+
+    if (!(entry->flags & NES_INDEX_BAD))
+        nes_scan_entry_info(entry);
+
+    nes_scan_correct(job, entry);
+}
+
+static void nes_scan_file(struct nes_scan_job *job, uint32_t i)
+{
+    struct nes_index_entry *entry = &job->entries[i];
+    const struct nes_index_entry *old;
+    const char *path = job->paths[i];
+    struct stat st;
+    void *data = NULL;
+    int fd;
+
+    memset(entry, 0, sizeof(*entry));
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st)) {
+        entry->flags = NES_INDEX_BAD;
+        goto done;
+    }
+
+    entry->size = st.st_size;
+    entry->mtime_ns = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+
+    // Unchanged since the last scan, nothing to read
+    old = job->prev ? nes_index_find_path(job->prev, path) : NULL;
+    if (old && old->size == entry->size && old->mtime_ns == entry->mtime_ns) {
+        *entry = *old;
+        __atomic_fetch_add(&job->stats->reused, 1, __ATOMIC_RELAXED);
+        nes_scan_correct(job, entry);
+        goto done;
+    }
+
+    if (entry->size) {
+        data = mmap(NULL, entry->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            data = NULL;
+            entry->flags = NES_INDEX_BAD;
+            goto done;
+        }
+
+        madvise(data, entry->size, MADV_WILLNEED);
+    }
+
+    nes_scan_hash(job, entry, data, entry->size);
+    __atomic_fetch_add(&job->stats->hashed, 1, __ATOMIC_RELAXED);
+
+done:
+    if (entry->flags & NES_INDEX_BAD)
+        __atomic_fetch_add(&job->stats->bad, 1, __ATOMIC_RELAXED);
+
+    if (data)
+        munmap(data, entry->size);
+    if (fd >= 0)
+        close(fd);
+}
+
+static void nes_scan_rows(void *arg, int start, int end)
+{
+    for (int i = start; i < end; ++i)
+        nes_scan_file(arg, i);
+}
+
+struct nes_path_list {
+    char **paths;
+    uint32_t count;
+    uint32_t cap;
+};
+
+static int nes_path_add(struct nes_path_list *list, const char *path)
+{
+    char **paths;
+
+    if (list->count == list->cap) {
+        list->cap = list->cap ? list->cap * 2 : 1024;
+        paths = realloc(list->paths, list->cap * sizeof(*paths));
+        if (!paths)
+            return -1;
+        list->paths = paths;
+    }
+
+    list->paths[list->count] = strdup(path);
+    if (!list->paths[list->count])
+        return -1;
+
+    list->count++;
+
+    return 0;
+}
+
+// Collects every *.nes file below dir, skipping hidden entries
+static int nes_scan_dir(struct nes_path_list *list, const char *dir)
+{
+    char path[PATH_MAX];
+    struct dirent *de;
+    struct stat st;
+    size_t len;
+    DIR *d;
+    int ret = 0;
+
+    d = opendir(dir);
+    if (!d)
+        return -1;
+
+    while (!ret && (de = readdir(d))) {
+        if (de->d_name[0] == '.')
+            continue;
+
+        if (snprintf(path, sizeof(path), "%s/%s", dir, de->d_name) >=
+            (int)sizeof(path))
+            continue;
+
+        // lstat(), like d_type, does not follow symlinks, so a link
+        // back up the tree can not make this recurse forever
+        if (de->d_type == DT_DIR ||
+            (de->d_type == DT_UNKNOWN && !lstat(path, &st) &&
+             S_ISDIR(st.st_mode))) {
+            ret = nes_scan_dir(list, path);
+            continue;
+        }
+
+        len = strlen(de->d_name);
+        if (len > 4 && !strcasecmp(de->d_name + len - 4, ".nes"))
+            ret = nes_path_add(list, path);
+    }
+
+    closedir(d);
+
+    return ret;
+}
+
+static int nes_path_cmp(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+struct nes_crc_key {
+    uint32_t crc32;
+    uint32_t entry;
+};
+
+static int nes_crc_cmp(const void *a, const void *b)
+{
+    const struct nes_crc_key *x = a, *y = b;
+
+    if (x->crc32 != y->crc32)
+        return x->crc32 < y->crc32 ? -1 : 1;
+
+    return (x->entry > y->entry) - (x->entry < y->entry);
+}
+
+static int nes_index_write(const char *name, char **paths,
+                           struct nes_index_entry *entries, uint32_t count)
+{
+    struct nes_index_file file;
+    char tmp[PATH_MAX];
+    struct nes_crc_key *keys;
+    uint32_t *order = NULL;
+    uint64_t strings_size = 0;
+    FILE *fp = NULL;
+    int ret = -1;
+
+    for (uint32_t i = 0; i < count; ++i) {
+        entries[i].path = strings_size;
+        strings_size += strlen(paths[i]) + 1;
+    }
+
+    // An empty table still holds one NUL, which keeps it valid
+    if (!strings_size)
+        strings_size = 1;
+
+    if (strings_size > UINT32_MAX)
+        return -1;
+
+    keys = malloc((count ? count : 1) * sizeof(*keys));
+    if (!keys)
+        return -1;
+
+    for (uint32_t i = 0; i < count; ++i) {
+        keys[i].crc32 = entries[i].crc32;
+        keys[i].entry = i;
+    }
+
+    qsort(keys, count, sizeof(*keys), nes_crc_cmp);
+
+    // The entry numbers are packed in place over the keys
+    order = (uint32_t *)keys;
+    for (uint32_t i = 0; i < count; ++i)
+        order[i] = keys[i].entry;
+
+    memset(&file, 0, sizeof(file));
+    memcpy(file.magic, NES_INDEX_MAGIC, 4);
+    file.version = NES_INDEX_VERSION;
+    file.entry_size = sizeof(struct nes_index_entry);
+    file.count = count;
+    file.crc_order = sizeof(file) + count * sizeof(*entries);
+    file.strings = file.crc_order + count * sizeof(*order);
+    file.strings_size = strings_size;
+
+    // Written next to the old index and renamed over it, so that
+    // readers always see a complete file
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", name) >= (int)sizeof(tmp))
+        goto cleanup;
+
+    fp = fopen(tmp, "wb");
+    if (!fp)
+        goto cleanup;
+
+    if (fwrite(&file, sizeof(file), 1, fp) != 1 ||
+        fwrite(entries, sizeof(*entries), count, fp) != count ||
+        fwrite(order, sizeof(*order), count, fp) != count)
+        goto cleanup;
+
+    for (uint32_t i = 0; i < count; ++i) {
+        if (fwrite(paths[i], strlen(paths[i]) + 1, 1, fp) != 1)
+            goto cleanup;
+    }
+
+    if (!count && fputc(0, fp) == EOF)
+        goto cleanup;
+
+    ret = 0;
+
+cleanup:
+    if (fp && fclose(fp))
+        ret = -1;
+
+    if (fp && !ret && rename(tmp, name))
+        ret = -1;
+
+    if (fp && ret)
+        unlink(tmp);
+
+    free(order);
+
+    return ret;
+}
+
+// Hashes every ROM below dir on the pool threads and writes the
+// index to name. Files that kept their size and modification time
+// since the index was last written are not read again.
+int nes_library_scan(struct nes_pool *pool, const char *dir,
+                     const struct nes_romdb *db, const char *name,
+                     struct nes_scan_stats *stats)
+{
+    struct nes_path_list list;
+    struct nes_scan_job job;
+    struct nes_index prev;
+    int ret = -1;
+
+    memset(&list, 0, sizeof(list));
+    memset(stats, 0, sizeof(*stats));
+
+    // A missing or unreadable index just means a full scan
+    nes_index_open(&prev, name);
+
+    if (nes_scan_dir(&list, dir))
+        goto cleanup;
+
+    qsort(list.paths, list.count, sizeof(*list.paths), nes_path_cmp);
+
+    job.paths = list.paths;
+    job.entries = calloc(list.count ? list.count : 1, sizeof(*job.entries));
+    job.db = db;
+    job.prev = prev.file ? &prev : NULL;
+    job.stats = stats;
+
+    if (!job.entries)
+        goto cleanup;
+
+    stats->files = list.count;
+
+    nes_pool_run(pool, nes_scan_rows, &job, list.count, 1);
+
+    ret = nes_index_write(name, list.paths, job.entries, list.count);
+
+    free(job.entries);
+
+cleanup:
+    nes_index_close(&prev);
+
+    for (uint32_t i = 0; i < list.count; ++i)
+        free(list.paths[i]);
+    free(list.paths);
+
+    return ret;
+}
@@ -0,0 +1,110 @@
+#ifndef NES_LIBRARY_HEADER
+#define NES_LIBRARY_HEADER
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "cartridge.h"
+#include "hash.h"
+
+struct nes_pool;
+
+#define NES_INDEX_MAGIC         "NESI"
+#define NES_INDEX_VERSION       2
+
+// Entry flags
+#define NES_INDEX_NES2          0x01
+#define NES_INDEX_CORRECTED     0x02    // header taken from the database
+#define NES_INDEX_BAD           0x04    // no signature or truncated data
+
+// Index file layout: this header, count entries sorted by path,
+// count entry numbers (uint32_t) sorted by CRC32, then the NUL
+// terminated paths. Offsets are from the start of the file, and
+// everything is naturally aligned so the file can be used in place
+// once mapped.
+struct nes_index_file {
+    uint8_t magic[4];
+    uint16_t version;
+    uint16_t entry_size;
+    uint32_t count;
+    uint32_t crc_order;
+    uint32_t strings;
+    uint32_t strings_size;
+    uint8_t reserved[8];
+};
+
+// One ROM file. The hashes cover the PRG and CHR data only, like
+// nes_cart_crc32() and the No-Intro databases, so the same game
+// matches whatever header it was dumped with.
+struct nes_index_entry {
+    uint8_t sha1[NES_SHA1_SIZE];
+    uint32_t crc32;
+
+    // To tell whether the file changed since it was hashed
+    uint64_t size;
+    int64_t mtime_ns;
+
+    // Offset of the path in the string table
+    uint32_t path;
+
+    // Header after corrections, and the fields most often asked for
+    struct ines_header header;
+    uint16_t mapper;
+    uint8_t submapper;
+    uint8_t flags;
+};
+
+// Mapped index
+struct nes_index {
+    void *map;
+    size_t size;
+
+    const struct nes_index_file *file;
+    const struct nes_index_entry *entries;
+    const uint32_t *crc_order;
+    const char *strings;
+};
+
+// Header corrections, keyed by the SHA-1 of the ROM data. The
+// database is a text file with one correction per line: the SHA-1
+// and the 16 header bytes that replace the dumped ones, both in hex.
+// Lines starting with '#' are comments.
+struct nes_romdb_entry {
+    uint8_t sha1[NES_SHA1_SIZE];
+    struct ines_header header;
+};
+
+struct nes_romdb {
+    struct nes_romdb_entry *entries;
+    size_t count;
+};
+
+struct nes_scan_stats {
+    uint32_t files;
+    uint32_t hashed;
+    uint32_t reused;
+    uint32_t corrected;
+    uint32_t bad;
+    uint64_t bytes;
+};
+
+int nes_romdb_load(struct nes_romdb *db, const char *name);
+const struct ines_header *nes_romdb_find(const struct nes_romdb *db,
+                                         const uint8_t *sha1);
+void nes_romdb_free(struct nes_romdb *db);
+
+int nes_library_scan(struct nes_pool *pool, const char *dir,
+                     const struct nes_romdb *db, const char *name,
+                     struct nes_scan_stats *stats);
+
+int nes_index_open(struct nes_index *index, const char *name);
+void nes_index_close(struct nes_index *index);
+
+const struct nes_index_entry *nes_index_find_path(const struct nes_index *index,
+                                                  const char *path);
+const struct nes_index_entry *nes_index_find_crc32(const struct nes_index *index,
+                                                   uint32_t crc);
+const char *nes_index_path(const struct nes_index *index,
+                           const struct nes_index_entry *entry);
+
+#endif
@@ -0,0 +1,329 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "movie.h"
+#include "nes.h"
+
+static int nes_movie_checkpoint(struct nes_movie *movie, struct nes_emu *nes)
+{
+    struct nes_savestate *cp;
+    uint32_t count;
+
+    count = movie->header.checkpoint_count;
+
+    cp = realloc(movie->checkpoints, (count + 1) * sizeof(*cp));
+    if (!cp)
+        return -1;
+
+    nes_state_save(nes, &cp[count]);
+
+    movie->checkpoints = cp;
+    movie->header.checkpoint_count++;
+
+    return 0;
+}
+
+static int nes_movie_reserve(struct nes_movie *movie, uint32_t frames)
+{
+    uint8_t *inputs;
+    uint32_t capacity;
+
+    if (frames <= movie->capacity)
+        return 0;
+
+    if (frames > NES_MOVIE_MAX_FRAMES)
+        return -1;
+
+    capacity = movie->capacity ? movie->capacity : 3600;
+    while (capacity < frames)
+        capacity <<= 1;
+
+    inputs = realloc(movie->inputs, (size_t)capacity * 2);
+    if (!inputs)
+        return -1;
+
+    movie->inputs = inputs;
+    movie->capacity = capacity;
+
+    return 0;
+}
+
+int nes_movie_record(struct nes_movie *movie, struct nes_emu *nes)
+{
+    memset(movie, 0, sizeof(*movie));
+
+    memcpy(movie->header.magic, NES_MOVIE_MAGIC, 4);
+    movie->header.version = NES_MOVIE_VERSION;
+    movie->header.checkpoint_interval = NES_MOVIE_CHECKPOINT;
+    movie->header.rom_crc32 = nes_cart_crc32(&nes->cart);
+
+    movie->mode = NES_MOVIE_RECORD;
+
+    return 0;
+}
+
+// Called once per frame, before the frame is emulated, with the
+// controllers already holding the input for that frame.
+int nes_movie_record_frame(struct nes_movie *movie, struct nes_emu *nes)
+{
+    uint32_t frame = movie->cursor;
+
+    if (movie->mode != NES_MOVIE_RECORD)
+        return -1;
+
+    if (nes_movie_reserve(movie, frame + 1))
+        return -1;
+
+    if ((frame % movie->header.checkpoint_interval) == 0)
+        if (nes_movie_checkpoint(movie, nes))
+            return -1;
+
+    movie->inputs[frame * 2 + 0] = nes->pads[0].buttons;
+    movie->inputs[frame * 2 + 1] = nes->pads[1].buttons;
+
+    movie->cursor++;
+    movie->header.frame_count = movie->cursor;
+
+    return 0;
+}
+
+// Input rarely changes from one frame to the next, so runs of
+// identical frames collapse into a single triplet.
+static uint32_t nes_movie_rle_encode(struct nes_movie *movie, uint8_t *out)
+{
+    uint32_t frames, len, i;
+    uint8_t run;
+
+    frames = movie->header.frame_count;
+    len = 0;
+    i = 0;
+
+    while (i < frames) {
+        run = 1;
+
+        while ((i + run) < frames && run < 0xff &&
+               movie->inputs[(i + run) * 2 + 0] == movie->inputs[i * 2 + 0] &&
+               movie->inputs[(i + run) * 2 + 1] == movie->inputs[i * 2 + 1])
+            run++;
+
+        out[len++] = run;
+        out[len++] = movie->inputs[i * 2 + 0];
+        out[len++] = movie->inputs[i * 2 + 1];
+
+        i += run;
+    }
+
+    return len;
+}
+
+static int nes_movie_rle_decode(struct nes_movie *movie, const uint8_t *in)
+{
+    uint32_t frame, len;
+    uint8_t run;
+
+    frame = 0;
+
+    for (len = 0; len + 3 <= movie->header.input_bytes; len += 3) {
+        run = in[len];
+
+        if (run == 0 || frame + run > movie->header.frame_count)
+            return -1;
+
+        while (run--) {
+            movie->inputs[frame * 2 + 0] = in[len + 1];
+            movie->inputs[frame * 2 + 1] = in[len + 2];
+            frame++;
+        }
+    }
+
+    return (frame == movie->header.frame_count) ? 0 : -1;
+}
+
+int nes_movie_save(struct nes_movie *movie, const char *name)
+{
+    struct nes_movie_header *hdr = &movie->header;
+    uint8_t *stream;
+    size_t ret;
+    FILE *fp;
+
+    // Worst case is one triplet per frame
+    stream = malloc((size_t)hdr->frame_count * 3 + 1);
+    if (!stream)
+        return -1;
+
+    hdr->input_bytes = nes_movie_rle_encode(movie, stream);
+
+    fp = fopen(name, "wb");
+    if (!fp) {
+        free(stream);
+        return -1;
+    }
+
+    ret = fwrite(hdr, sizeof(*hdr), 1, fp);
+    ret += fwrite(stream, 1, hdr->input_bytes, fp) == hdr->input_bytes;
+    ret += fwrite(movie->checkpoints, sizeof(struct nes_savestate),
+                  hdr->checkpoint_count, fp) == hdr->checkpoint_count;
+
+    free(stream);
+
+    if (fclose(fp) || ret != 3)
+        return -1;
+
+    return 0;
+}
+
+int nes_movie_load(struct nes_movie *movie, const char *name)
+{
+    struct nes_movie_header *hdr = &movie->header;
+    uint8_t *stream = NULL;
+    long start, end;
+    size_t bytes;
+    FILE *fp;
+    int ret = -1;
+
+    memset(movie, 0, sizeof(*movie));
+
+    fp = fopen(name, "rb");
+    if (!fp)
+        return -1;
+
+    if (fread(hdr, sizeof(*hdr), 1, fp) != 1)
+        goto cleanup;
+
+    if (memcmp(hdr->magic, NES_MOVIE_MAGIC, 4) ||
+        hdr->version != NES_MOVIE_VERSION ||
+        hdr->checkpoint_interval == 0 ||
+        hdr->checkpoint_count == 0)
+        goto cleanup;
+
+    // Nothing in the header is trusted before it is checked
+    // against itself and the file: the stream holds whole
+    // triplets of at most one frame each, and the stream and
+    // checkpoints have to be there in full.
+    if (hdr->frame_count > NES_MOVIE_MAX_FRAMES ||
+        hdr->input_bytes % 3 ||
+        hdr->input_bytes > (size_t)hdr->frame_count * 3 ||
+        hdr->checkpoint_count > hdr->frame_count /
+                                hdr->checkpoint_interval + 1)
+        goto cleanup;
+
+    start = ftell(fp);
+    if (start < 0 || fseek(fp, 0, SEEK_END))
+        goto cleanup;
+    end = ftell(fp);
+    if (end < start || fseek(fp, start, SEEK_SET))
+        goto cleanup;
+
+    bytes = hdr->input_bytes +
+            (size_t)hdr->checkpoint_count * sizeof(struct nes_savestate);
+    if (bytes > (size_t)(end - start))
+        goto cleanup;
+
+    stream = malloc((size_t)hdr->input_bytes + 1);
+    if (!stream || nes_movie_reserve(movie, hdr->frame_count + 1))
+        goto cleanup;
+
+    if (fread(stream, 1, hdr->input_bytes, fp) != hdr->input_bytes)
+        goto cleanup;
+
+    if (nes_movie_rle_decode(movie, stream))
+        goto cleanup;
+
+    movie->checkpoints = malloc((size_t)hdr->checkpoint_count *
+                                sizeof(struct nes_savestate));
+    if (!movie->checkpoints)
+        goto cleanup;
+
+    if (fread(movie->checkpoints, sizeof(struct nes_savestate),
+              hdr->checkpoint_count, fp) != hdr->checkpoint_count)
+        goto cleanup;
+
+    ret = 0;
+
+cleanup:
+    free(stream);
+    fclose(fp);
+
+    if (ret)
+        nes_movie_free(movie);
+
+    return ret;
+}
+
+int nes_movie_play(struct nes_movie *movie, struct nes_emu *nes)
+{
+    // A movie only replays deterministically against the
+    // exact ROM it was recorded with.
+    if (movie->header.rom_crc32 != nes_cart_crc32(&nes->cart))
+        return -1;
+
+    // Start from the recorded power-on state rather than
+    // whatever state the instance happens to be in.
+    if (nes_state_load(nes, &movie->checkpoints[0]))
+        return -1;
+
+    movie->mode = NES_MOVIE_PLAY;
+    movie->cursor = 0;
+
+    return 0;
+}
+
+// Called once per frame, before the frame is emulated. Returns
+// 1 once the end of the movie has been reached.
+int nes_movie_play_frame(struct nes_movie *movie, struct nes_emu *nes)
+{
+    uint32_t frame = movie->cursor;
+
+    if (movie->mode != NES_MOVIE_PLAY)
+        return -1;
+
+    if (frame >= movie->header.frame_count)
+        return 1;
+
+    nes->pads[0].buttons = movie->inputs[frame * 2 + 0];
+    nes->pads[1].buttons = movie->inputs[frame * 2 + 1];
+
+    movie->cursor++;
+
+    return 0;
+}
+
+int nes_movie_seek(struct nes_movie *movie, struct nes_emu *nes, uint32_t frame)
+{
+    uint32_t cp;
+    uint8_t skip_render;
+
+    if (movie->mode != NES_MOVIE_PLAY || frame > movie->header.frame_count)
+        return -1;
+
+    cp = frame / movie->header.checkpoint_interval;
+    if (cp >= movie->header.checkpoint_count)
+        cp = movie->header.checkpoint_count - 1;
+
+    if (nes_state_load(nes, &movie->checkpoints[cp]))
+        return -1;
+
+    movie->cursor = cp * movie->header.checkpoint_interval;
+
+    // Nobody sees the frames in between, so skip rendering them
+    skip_render = nes->ppu.skip_render;
+    nes->ppu.skip_render = 1;
+
+    while (movie->cursor < frame) {
+        nes_movie_play_frame(movie, nes);
+        nes_run_frame(nes);
+    }
+
+    nes->ppu.skip_render = skip_render;
+
+    return 0;
+}
+
+void nes_movie_free(struct nes_movie *movie)
+{
+    free(movie->inputs);
+    free(movie->checkpoints);
+
+    memset(movie, 0, sizeof(*movie));
+}
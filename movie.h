@@ -0,0 +1,72 @@
+#ifndef NES_MOVIE_HEADER
+#define NES_MOVIE_HEADER
+
+#include <stdint.h>
+
+#include "savestate.h"
+
+#define NES_MOVIE_MAGIC         "NESM"
+#define NES_MOVIE_VERSION       1
+
+// Frames between embedded savestates. Seeking replays at most
+// this many frames past the nearest checkpoint.
+#define NES_MOVIE_CHECKPOINT    600
+
+// Longest movie accepted, a day at 60 frames per second
+#define NES_MOVIE_MAX_FRAMES    (24 * 60 * 60 * 60)
+
+struct nes_emu;
+
+// Movie file layout
+//
+// +---------------------------+
+// | struct nes_movie_header   |
+// +---------------------------+
+// | Input stream              | input_bytes, run-length encoded
+// |                           | as [count][pad 1][pad 2] triplets
+// +---------------------------+
+// | Checkpoints               | checkpoint_count x
+// |                           | struct nes_savestate
+// +---------------------------+
+struct nes_movie_header {
+    uint8_t magic[4];
+    uint16_t version;
+    uint16_t checkpoint_interval;
+    uint32_t rom_crc32;
+    uint32_t frame_count;
+    uint32_t input_bytes;
+    uint32_t checkpoint_count;
+} __attribute__((packed));
+
+enum nes_movie_mode {
+    NES_MOVIE_IDLE = 0,
+    NES_MOVIE_RECORD,
+    NES_MOVIE_PLAY,
+};
+
+struct nes_movie {
+    struct nes_movie_header header;
+    enum nes_movie_mode mode;
+
+    // Decoded input, two bytes (pad 1, pad 2) per frame
+    uint8_t *inputs;
+    uint32_t capacity;
+
+    // The next frame to record or play back
+    uint32_t cursor;
+
+    struct nes_savestate *checkpoints;
+};
+
+int nes_movie_record(struct nes_movie *movie, struct nes_emu *nes);
+int nes_movie_record_frame(struct nes_movie *movie, struct nes_emu *nes);
+int nes_movie_save(struct nes_movie *movie, const char *name);
+
+int nes_movie_load(struct nes_movie *movie, const char *name);
+int nes_movie_play(struct nes_movie *movie, struct nes_emu *nes);
+int nes_movie_play_frame(struct nes_movie *movie, struct nes_emu *nes);
+int nes_movie_seek(struct nes_movie *movie, struct nes_emu *nes, uint32_t frame);
+
+void nes_movie_free(struct nes_movie *movie);
+
+#endif
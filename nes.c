@@ -3,40 +3,23 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 #include <SDL2/SDL.h>
 
-#include "cartridge.h"
-#include "ppu.h"
-#include "cpu.h"
-#include "bus.h"
-
-#define NINTENDO_RAM_SZ         0x800
-#define NINTENDO_PRG_RAM_SZ     0x2000
-#define NINTENDO_PRG_ROM_SZ     0x4000
-#define NINTENDO_CHR_ROM_SZ     0x2000
-
-struct nes_emu {
-    struct cpu_6502 cpu;
-    struct nes_ppu  ppu;
-    struct nes_cart cart;
-    struct nes_bus bus;
-
-    uint8_t ram[NINTENDO_RAM_SZ];
-};
-
-int nes_load_ines_header(FILE *fp, struct nes_cart *cart);
-int nes_prg_ram_alloc(struct nes_cart *cart);
-void nes_trainer_set(FILE *fp, struct nes_cart *cart);
-int nes_prg_rom_load(FILE *fp, struct nes_cart *cart);
-int nes_chr_rom_load(FILE *fp, struct nes_cart *cart);
-int nes_load_catridge(struct nes_emu *nes,
-                      struct nes_cart *cart,
-                      const char *name);
-
-void nes_init(struct nes_emu *nes);
-void nes_ppu_init(struct nes_emu *nes);
-void nes_init_bus(struct nes_emu *nes);
-
+#include "nes.h"
+#include "movie.h"
+#include "savestate.h"
+#include "capture.h"
+#include "filter.h"
+#include "pool.h"
+#include "netplay.h"
+#include "trace.h"
+#include "watch.h"
+#include "profile.h"
+#include "idle.h"
+#include "library.h"
+#include "render.h"
+#include "sram.h"
 
 int nes_load_catridge(struct nes_emu *nes,
                       struct nes_cart *cart,
@@ -48,6 +31,8 @@ int nes_load_catridge(struct nes_emu *nes,
     if (!name ||name[0] == '\0')
         return -1;
 
+    cart->arena = nes->arena.base ? &nes->arena : NULL;
+
     fp = fopen(name, "rb");
     if (!fp)
         return -1;
@@ -69,9 +54,17 @@ int nes_load_catridge(struct nes_emu *nes,
     ret = nes_prg_ram_alloc(cart);
 
     cart->mirroring = cart->header.flags6 & 0x01;
+    if (cart->header.flags6 & 0x08)
+        cart->mirroring = NES_MIRROR_FOUR_SCREEN;
     cart->battery = cart->header.flags6 & 0x02;
 
-    nes->cart = *cart;
+    for (int i = 0; i < 8; ++i)
+        cart->chr_banks[i] = i;
+
+    if (cart != &nes->cart)
+        nes->cart = *cart;
+
+    nes_ppu_map(&nes->ppu);
 
 cleanup:
     fclose(fp);
@@ -87,6 +80,9 @@ int nes_load_ines_header(FILE *fp, struct nes_cart *cart)
     if (ret != sizeof(struct ines_header))
         return -1;
 
+    if (memcmp(cart->header.signature, NES_INES_SIGNATURE, 4))
+        return -1;
+
     return 0;
 }
 
@@ -98,13 +94,28 @@ void nes_trainer_set(FILE *fp, struct nes_cart *cart)
         fseek(fp, 512, SEEK_CUR);
 }
 
+static void *nes_cart_alloc(struct nes_cart *cart, size_t bytes)
+{
+    if (cart->arena)
+        return nes_arena_alloc(cart->arena, bytes, 64);
+
+    return malloc(bytes);
+}
+
+// Arena memory is only given back when the whole instance goes
+static void nes_cart_free(struct nes_cart *cart, void *p)
+{
+    if (!cart->arena)
+        free(p);
+}
+
 int nes_prg_ram_alloc(struct nes_cart *cart)
 {
     cart->prg_ram = NULL;
 
     if (cart->header.flags6 & 0x02) {
         // Assuming NES format, and no NES v2 support.
-        cart->prg_ram = malloc(NINTENDO_PRG_RAM_SZ);
+        cart->prg_ram = nes_cart_alloc(cart, NINTENDO_PRG_RAM_SZ);
         if (!cart->prg_ram)
             return -1;
     }
@@ -123,14 +134,14 @@ int nes_prg_rom_load(FILE *fp, struct nes_cart *cart)
 
     prg_bytes = cart->header.prg_rom_size * NINTENDO_PRG_ROM_SZ;
 
-    cart->prg_rom = malloc(prg_bytes);
+    cart->prg_rom = nes_cart_alloc(cart, prg_bytes);
 
     if (!cart->prg_rom)
         return -1;
 
     ret = fread(cart->prg_rom, 1, prg_bytes, fp);
     if (ret != prg_bytes) {
-        free(cart->prg_rom);
+        nes_cart_free(cart, cart->prg_rom);
         cart->prg_rom = NULL;
         return -1;
     }
@@ -143,19 +154,27 @@ int nes_chr_rom_load(FILE *fp, struct nes_cart *cart)
     size_t chr_bytes, ret;
 
     cart->chr_rom = NULL;
+    cart->chr_ram = 0;
+
+    if (cart->header.chr_rom_size == 0) {
+        cart->chr_rom = nes_cart_alloc(cart, NINTENDO_CHR_ROM_SZ);
+        if (!cart->chr_rom)
+            return -1;
 
-    if (cart->header.chr_rom_size == 0)
+        memset(cart->chr_rom, 0, NINTENDO_CHR_ROM_SZ);
+        cart->chr_ram = 1;
         return 0;
+    }
 
     chr_bytes = cart->header.chr_rom_size * NINTENDO_CHR_ROM_SZ;
 
-    cart->chr_rom = malloc(chr_bytes);
+    cart->chr_rom = nes_cart_alloc(cart, chr_bytes);
     if (!cart->chr_rom)
         return -1;
 
     ret = fread(cart->chr_rom, 1, chr_bytes, fp);
     if (ret != chr_bytes) {
-        free(cart->chr_rom);
+        nes_cart_free(cart, cart->chr_rom);
         cart->chr_rom = NULL;
         return -1;
     }
@@ -165,24 +184,141 @@ int nes_chr_rom_load(FILE *fp, struct nes_cart *cart)
 
 int nes_eject_catridge(struct nes_emu *nes, struct nes_cart *cart)
 {
+    int ret = 0;
+
     if (cart->prg_rom != NULL)
-        free(cart->prg_rom);
+        nes_cart_free(cart, cart->prg_rom);
 
     if (cart->chr_rom != NULL)
-        free(cart->chr_rom);
+        nes_cart_free(cart, cart->chr_rom);
+
+    if (cart->sram) {
+        if (nes_sram_close(cart->sram))
+            ret = -1;
+        free(cart->sram);
+        cart->sram = NULL;
+    } else if (cart->prg_ram != NULL) {
+        nes_cart_free(cart, cart->prg_ram);
+    }
+
+    cart->prg_rom = NULL;
+    cart->chr_rom = NULL;
+    cart->prg_ram = NULL;
+
+    return ret;
+}
+
+// Moves battery RAM into the save file of the ROM. Arena memory
+// nes_prg_ram_alloc() handed out stays behind unused.
+int nes_sram_attach(struct nes_cart *cart, const char *rom)
+{
+    char name[4096];
+
+    if (!cart->battery || cart->sram)
+        return 0;
+
+    if (nes_sram_name(rom, name, sizeof(name)))
+        return -1;
 
-    if (cart->prg_ram != NULL)
-        free(cart->prg_ram);
+    cart->sram = malloc(sizeof(*cart->sram));
+    if (!cart->sram)
+        return -1;
+
+    if (nes_sram_open(cart->sram, name, NINTENDO_PRG_RAM_SZ)) {
+        free(cart->sram);
+        cart->sram = NULL;
+        return -1;
+    }
+
+    nes_cart_free(cart, cart->prg_ram);
+    cart->prg_ram = cart->sram->data;
 
     return 0;
 }
 
+// Creates an instance with the cartridge loaded. The instance,
+// its frame buffer and all cartridge memory come from a single
+// arena sized from the iNES header, so the whole instance is one
+// mapping (optionally on huge pages).
+struct nes_emu *nes_create(const char *name, int flags)
+{
+    struct nes_arena arena;
+    struct nes_cart probe;
+    struct nes_emu *nes;
+    uint32_t *frame_buffer;
+    size_t bytes;
+    FILE *fp;
+    int ret;
+
+    if (!name || name[0] == '\0')
+        return NULL;
+
+    fp = fopen(name, "rb");
+    if (!fp)
+        return NULL;
+
+    ret = nes_load_ines_header(fp, &probe);
+    fclose(fp);
+    if (ret)
+        return NULL;
+
+    // A page of slack covers the alignment between allocations
+    bytes = sizeof(struct nes_emu) + FRAME_BUFF_SZ +
+            probe.header.prg_rom_size * NINTENDO_PRG_ROM_SZ +
+            (probe.header.chr_rom_size ? probe.header.chr_rom_size : 1) *
+            NINTENDO_CHR_ROM_SZ +
+            NINTENDO_PRG_RAM_SZ + 4096;
+
+    if (nes_arena_init(&arena, bytes, flags & NES_ARENA_HUGE_PAGES))
+        return NULL;
+
+    nes = nes_arena_alloc(&arena, sizeof(*nes), 64);
+    frame_buffer = nes_arena_alloc(&arena, FRAME_BUFF_SZ, 64);
+
+    nes_init(nes);
+
+    nes->arena = arena;
+    nes->ppu.frame_buffer = frame_buffer;
+
+    if (nes_load_catridge(nes, &nes->cart, name)) {
+        nes_destroy(nes);
+        return NULL;
+    }
+
+    // The game still runs without its save file, it just forgets
+    if (!(flags & NES_CREATE_NO_SAVE) && nes_sram_attach(&nes->cart, name))
+        fprintf(stderr, "cannot map save file for %s, saves are lost "
+                "on exit\n", name);
+
+    return nes;
+}
+
+// Returns -1 when the save file could not be written back
+int nes_destroy(struct nes_emu *nes)
+{
+    struct nes_arena arena;
+    int ret;
+
+    ret = nes_eject_catridge(nes, &nes->cart);
+
+    // The instance lives inside the arena it describes
+    arena = nes->arena;
+    nes_arena_destroy(&arena);
+
+    return ret;
+}
+
 void nes_init_bus(struct nes_emu *nes)
 {
-    nes->bus.cpu = &nes->cpu;
+    nes->hooks.nes = nes;
+    nes->hooks.cpu = &nes->cpu;
+
     nes->bus.ppu = &nes->ppu;
     nes->bus.cart = &nes->cart;
+    nes->bus.pads = nes->pads;
     nes->bus.ram = nes->ram;
+    nes->bus.pages = nes_bus_fast_pages;
+    nes->bus.hooks = &nes->hooks;
 }
 
 void nes_init(struct nes_emu *nes)
@@ -199,9 +335,43 @@ void nes_ppu_init(struct nes_emu *nes)
 
     nes->ppu.cycle = 0;
     nes->ppu.scanline = 0;
-    nes->ppu.palette_table = nes_canonical_palette;
 
-    memset(nes->ppu.frame_buffer, 0, sizeof(nes->ppu.frame_buffer));
+    if (!nes->ppu.palette_table)
+        nes_set_palette(nes, NULL, NES_PIXEL_ARGB8888);
+
+    if (nes->ppu.frame_buffer)
+        memset(nes->ppu.frame_buffer, 0, FRAME_BUFF_SZ);
+}
+
+// Switches the colors frames are drawn with, the canonical palette
+// when pal is NULL. Only the output table is rebuilt, nothing on
+// the drawing path changes.
+void nes_set_palette(struct nes_emu *nes, const struct nes_palette *pal,
+                     enum nes_pixel_format format)
+{
+    struct nes_palette canonical;
+
+    if (!pal) {
+        nes_palette_default(&canonical);
+        pal = &canonical;
+    }
+
+    nes_palette_lut(pal, format, nes->palette_lut);
+    nes->ppu.palette_table = nes->palette_lut;
+}
+
+void nes_run_frame(struct nes_emu *nes)
+{
+    for (int i = 0; i < NES_FRAME_DOTS; ++i)
+        nes_ppu_tick(&nes->ppu);
+
+    if (nes->hooks.prof)
+        nes_prof_frame(nes->hooks.prof, nes->frame);
+
+    if (nes->hooks.idle)
+        nes_idle_frame(nes->hooks.idle);
+
+    nes->frame++;
 }
 
 static void simulate_cpu_writes(struct nes_emu *nes)
@@ -237,65 +407,850 @@ static void simulate_cpu_writes(struct nes_emu *nes)
     }
 }
 
+static uint64_t nes_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Runs the same stretch of frames with and without rendering and
+// reports how much faster the render-less PPU mode is.
+static void nes_ff_bench(struct nes_emu *nes, struct nes_render_log *log,
+                         uint32_t frames)
+{
+    struct nes_savestate st;
+    uint64_t start, full, fast, deferred;
+    uint32_t *inline_frame;
+
+    nes_state_save(nes, &st);
+
+    nes->ppu.skip_render = 0;
+    start = nes_now_ns();
+    for (uint32_t i = 0; i < frames; ++i)
+        nes_run_frame(nes);
+    full = nes_now_ns() - start;
+
+    nes_state_load(nes, &st);
+
+    nes->ppu.skip_render = 1;
+    start = nes_now_ns();
+    for (uint32_t i = 0; i < frames; ++i)
+        nes_run_frame(nes);
+    fast = nes_now_ns() - start;
+
+    nes->ppu.skip_render = 0;
+
+    printf("rendered:    %8.1f fps\n", frames * 1e9 / full);
+    printf("render-less: %8.1f fps\n", frames * 1e9 / fast);
+    printf("fast-forward multiplier: %.2fx\n", (double)full / fast);
+
+    // Same frames drawn per line at the end of the visible area,
+    // which must come out identical to the per-dot renderer
+    inline_frame = malloc(FRAME_BUFF_SZ);
+    if (!inline_frame)
+        return;
+
+    nes_state_load(nes, &st);
+    nes_run_frame(nes);
+    memcpy(inline_frame, nes->ppu.frame_buffer, FRAME_BUFF_SZ);
+
+    nes_state_load(nes, &st);
+    nes_render_log_attach(log, &nes->ppu);
+    start = nes_now_ns();
+    for (uint32_t i = 0; i < frames; ++i)
+        nes_run_frame(nes);
+    deferred = nes_now_ns() - start;
+    nes_render_log_detach(&nes->ppu);
+
+    nes_state_load(nes, &st);
+    nes_render_log_attach(log, &nes->ppu);
+    nes_run_frame(nes);
+    nes_render_log_detach(&nes->ppu);
+
+    printf("deferred:    %8.1f fps (%.2fx, %s)\n", frames * 1e9 / deferred,
+           (double)full / deferred,
+           memcmp(inline_frame, nes->ppu.frame_buffer, FRAME_BUFF_SZ) ?
+           "frames differ" : "same frames");
+
+    free(inline_frame);
+}
+
+// PPU writes for one dot of the render check, as a function of
+// the frame and dot only. Single PPUCTRL, PPUMASK, palette and
+// nametable writes here and there on the visible lines, and on
+// some frames bursts that overflow the render log: nametable
+// writes over several lines, or more register and palette writes
+// on one line than the log holds.
+static void nes_render_check_dot(struct nes_emu *nes, uint32_t frame,
+                                 uint32_t dot)
+{
+    uint32_t h = (frame * NES_FRAME_DOTS + dot) * 2654435761u;
+    int line = nes->ppu.scanline;
+    uint16_t addr;
+
+    if (line >= 240)
+        return;
+
+    if ((frame & 3) == 1 && line >= 64 && line < 72) {
+        addr = 0x2000 + (h >> 12) % 0x0f00;
+        nes_bus_write(&nes->bus, 0x2006, addr >> 8);
+        nes_bus_write(&nes->bus, 0x2006, addr & 0xff);
+        nes_bus_write(&nes->bus, 0x2007, h >> 24);
+        return;
+    }
+
+    if ((frame & 3) == 3 && line == 100 + (int)((frame >> 2) & 63)) {
+        nes_bus_write(&nes->bus, 0x2000, (h >> 3) & 0x13);
+        nes_bus_write(&nes->bus, 0x2001, ((h >> 9) & 0xe1) | 0x1e);
+        nes_bus_write(&nes->bus, 0x2006, 0x3f);
+        nes_bus_write(&nes->bus, 0x2006, (h >> 16) & 0x1f);
+        for (int i = 0; i < 8; ++i)
+            nes_bus_write(&nes->bus, 0x2007, (h >> (i * 3)) & 0x3f);
+        return;
+    }
+
+    if ((h >> 20) % 400)
+        return;
+
+    switch ((h >> 8) & 3) {
+    case 0:
+        nes_bus_write(&nes->bus, 0x2000, (h >> 3) & 0x13);
+        break;
+    case 1:
+        nes_bus_write(&nes->bus, 0x2001, ((h >> 9) & 0xe1) | 0x1e);
+        break;
+    default:
+        addr = (h >> 8) & 1 ? 0x3f00 + ((h >> 13) & 0x1f) :
+                              0x2000 + (h >> 12) % 0x0f00;
+        nes_bus_write(&nes->bus, 0x2006, addr >> 8);
+        nes_bus_write(&nes->bus, 0x2006, addr & 0xff);
+        nes_bus_write(&nes->bus, 0x2007, (h >> 16) & 0x3f);
+        break;
+    }
+}
+
+static void nes_render_check_frame(struct nes_emu *nes, uint32_t frame)
+{
+    for (uint32_t dot = 0; dot < NES_FRAME_DOTS; ++dot) {
+        nes_render_check_dot(nes, frame, dot);
+        nes_ppu_tick(&nes->ppu);
+    }
+}
+
+// Draws each frame per dot and again deferred, from the same
+// state and with the same writes made during the visible lines,
+// and compares the two. Returns the number of frames that differ.
+static uint32_t nes_render_check(struct nes_emu *nes,
+                                 struct nes_render_log *log, uint32_t frames)
+{
+    struct nes_savestate st;
+    uint32_t *inline_frame;
+    uint32_t bad = 0;
+    int p;
+
+    inline_frame = malloc(FRAME_BUFF_SZ);
+    if (!inline_frame)
+        return frames;
+
+    log->flushes = 0;
+
+    for (uint32_t f = 0; f < frames; ++f) {
+        nes_state_save(nes, &st);
+        nes_render_check_frame(nes, f);
+        memcpy(inline_frame, nes->ppu.frame_buffer, FRAME_BUFF_SZ);
+
+        // Cleared, so that pixels the deferred run misses show
+        nes_state_load(nes, &st);
+        memset(nes->ppu.frame_buffer, 0, FRAME_BUFF_SZ);
+        nes_render_log_attach(log, &nes->ppu);
+        nes_render_check_frame(nes, f);
+        nes_render_log_detach(&nes->ppu);
+
+        if (!memcmp(inline_frame, nes->ppu.frame_buffer, FRAME_BUFF_SZ))
+            continue;
+
+        for (p = 0; inline_frame[p] == nes->ppu.frame_buffer[p]; ++p)
+            ;
+
+        if (bad++ < 8)
+            printf("frame %u differs, first at line %d, x %d\n",
+                   f, p / 256, p % 256);
+    }
+
+    printf("render check: %u frames, %u differ, %llu log overflows\n",
+           frames, bad, (unsigned long long)log->flushes);
+
+    free(inline_frame);
+
+    return bad;
+}
+
+// Times every filter on its own and in typical chains, at each
+// output size they produce.
+static void nes_filter_bench(struct nes_pool *pool, const uint32_t *frame,
+                             uint32_t frames)
+{
+    static const char *specs[] = {
+        "scale2x", "scale3x", "scale4x", "scanlines", "blur",
+        "scale2x,scanlines", "scale3x,scanlines", "scale4x,scanlines",
+        "scale4x,blur", "scale4x,scanlines,blur",
+    };
+    struct nes_filter_chain chain;
+    uint32_t *out;
+    uint64_t start, elapsed;
+
+    printf("filter bench, %d worker threads\n", pool->count);
+
+    for (size_t i = 0; i < sizeof(specs) / sizeof(specs[0]); ++i) {
+        if (nes_filter_chain_init(&chain, pool, specs[i]))
+            continue;
+
+        out = malloc((size_t)chain.width * chain.height * sizeof(uint32_t));
+        if (!out) {
+            nes_filter_chain_free(&chain);
+            continue;
+        }
+
+        start = nes_now_ns();
+        for (uint32_t f = 0; f < frames; ++f)
+            nes_filter_chain_run(&chain, frame, out, chain.width);
+        elapsed = nes_now_ns() - start;
+
+        printf("%-24s %4dx%-4d %8.3f ms/frame\n", specs[i],
+               chain.width, chain.height, elapsed / 1e6 / frames);
+
+        free(out);
+        nes_filter_chain_free(&chain);
+    }
+}
+
+// Plays two instances against each other over a lossy, delayed
+// loopback with changing inputs, and reports what rollback costs.
+static int nes_netplay_test(const char *rom, uint32_t frames)
+{
+    struct nes_transport link[2];
+    struct nes_netplay *np;
+    struct nes_emu *nes[2] = { NULL, NULL };
+    uint32_t seed = 1;
+    uint8_t buttons[2] = { 0, 0 };
+    int ret = -1;
+
+    np = calloc(2, sizeof(*np));
+
+    if (!np || nes_loopback_open(&link[0], &link[1], 4, 10, 1))
+        goto cleanup;
+
+    for (int i = 0; i < 2; ++i) {
+        nes[i] = nes_create(rom, NES_CREATE_NO_SAVE);
+        if (!nes[i])
+            goto cleanup;
+
+        nes[i]->ppu.mask = 0x1e;
+        simulate_cpu_writes(nes[i]);
+        nes_netplay_init(&np[i], nes[i], &link[i], i);
+    }
+
+    while (np[0].frame < frames || np[1].frame < frames) {
+        for (int i = 0; i < 2; ++i) {
+            seed = seed * 1103515245 + 12345;
+            if (((seed >> 16) & 0x0f) == 0)
+                buttons[i] = seed >> 24;
+
+            nes_netplay_advance(&np[i], buttons[i]);
+        }
+
+        nes_loopback_tick(&link[0]);
+    }
+
+    for (int i = 0; i < 2; ++i) {
+        printf("player %d: %u frames, %llu rollbacks, %llu frames resimulated, "
+               "max rollback %.3f ms, %llu stalls, %llu hash checks, ",
+               i + 1, np[i].frame,
+               (unsigned long long)np[i].rollbacks,
+               (unsigned long long)np[i].resim_frames,
+               np[i].resim_max_ns / 1e6,
+               (unsigned long long)np[i].stalls,
+               (unsigned long long)np[i].hash_checks);
+
+        if (np[i].desync)
+            printf("desync at frame %u\n", np[i].desync_frame);
+        else
+            printf("in sync\n");
+    }
+
+    ret = (np[0].desync || np[1].desync) ? 1 : 0;
+
+    link[0].close(link[0].ctx);
+    link[1].close(link[1].ctx);
+
+cleanup:
+    for (int i = 0; i < 2; ++i)
+        if (nes[i])
+            nes_destroy(nes[i]);
+    free(np);
+
+    return ret;
+}
+
+static uint8_t nes_sdl_input(void)
+{
+    const uint8_t *keys = SDL_GetKeyboardState(NULL);
+    uint8_t buttons = 0;
+
+    if (keys[SDL_SCANCODE_X])       buttons |= NES_BUTTON_A;
+    if (keys[SDL_SCANCODE_Z])       buttons |= NES_BUTTON_B;
+    if (keys[SDL_SCANCODE_RSHIFT])  buttons |= NES_BUTTON_SELECT;
+    if (keys[SDL_SCANCODE_RETURN])  buttons |= NES_BUTTON_START;
+    if (keys[SDL_SCANCODE_UP])      buttons |= NES_BUTTON_UP;
+    if (keys[SDL_SCANCODE_DOWN])    buttons |= NES_BUTTON_DOWN;
+    if (keys[SDL_SCANCODE_LEFT])    buttons |= NES_BUTTON_LEFT;
+    if (keys[SDL_SCANCODE_RIGHT])   buttons |= NES_BUTTON_RIGHT;
+
+    return buttons;
+}
+
+static int nes_watch_print(void *ctx, const struct nes_watch_hit *hit)
+{
+    static const char *types[] = {
+        [NES_WATCH_READ] = "read", [NES_WATCH_WRITE] = "write",
+        [NES_WATCH_EXEC] = "exec",
+    };
+
+    (void)ctx;
+
+    fprintf(stderr, "watch %d: %-5s $%04X = $%02X  PC:%04X A:%02X X:%02X "
+            "Y:%02X P:%02X SP:%02X PPU:%3u,%3u CTRL:%02X MASK:%02X "
+            "STATUS:%02X v:%04X t:%04X x:%u w:%u frame %u\n",
+            hit->id, types[hit->type], hit->addr, hit->data,
+            hit->cpu.pc, hit->cpu.a, hit->cpu.x, hit->cpu.y, hit->cpu.p,
+            hit->cpu.s, hit->scanline, hit->dot, hit->ctrl, hit->mask,
+            hit->status, hit->v, hit->t, hit->x, hit->w, hit->frame);
+
+    return 0;
+}
+
+// Parses "lo:hi:rwx" (hex addresses, any subset of r, w and x)
+static int nes_watch_parse(struct nes_watch *watch, const char *spec)
+{
+    unsigned int lo, hi;
+    char flags[4];
+    uint8_t types = 0;
+
+    if (sscanf(spec, "%x:%x:%3s", &lo, &hi, flags) != 3 ||
+        lo > 0xffff || hi > 0xffff)
+        return -1;
+
+    for (char *c = flags; *c; ++c) {
+        switch (*c) {
+        case 'r': types |= NES_WATCH_READ; break;
+        case 'w': types |= NES_WATCH_WRITE; break;
+        case 'x': types |= NES_WATCH_EXEC; break;
+        default: return -1;
+        }
+    }
+
+    return nes_watch_add(watch, lo, hi, types) < 0 ? -1 : 0;
+}
+
+static int nes_scan(struct nes_pool *pool, const char *dir,
+                    const char *index, const char *romdb)
+{
+    struct nes_romdb db;
+    struct nes_scan_stats stats;
+    uint64_t t0;
+    int ret;
+
+    memset(&db, 0, sizeof(db));
+
+    if (romdb && nes_romdb_load(&db, romdb)) {
+        fprintf(stderr, "cannot load header database %s\n", romdb);
+        return 1;
+    }
+
+    t0 = nes_now_ns();
+    ret = nes_library_scan(pool, dir, &db, index, &stats);
+
+    if (ret)
+        fprintf(stderr, "cannot scan %s into %s\n", dir, index);
+    else
+        printf("%u files: %u hashed (%.1f MB), %u unchanged, "
+               "%u corrected, %u bad, %.1f ms on %d threads\n",
+               stats.files, stats.hashed, stats.bytes / 1e6, stats.reused,
+               stats.corrected, stats.bad, (nes_now_ns() - t0) / 1e6,
+               pool->count + 1);
+
+    nes_romdb_free(&db);
+
+    return ret ? 1 : 0;
+}
+
+static int nes_lookup(const char *index_name, const char *rom)
+{
+    const struct nes_index_entry *entry;
+    struct nes_index index;
+
+    if (nes_index_open(&index, index_name)) {
+        fprintf(stderr, "cannot open index %s\n", index_name);
+        return 1;
+    }
+
+    entry = nes_index_find_path(&index, rom);
+    if (!entry) {
+        fprintf(stderr, "%s is not in %s\n", rom, index_name);
+        nes_index_close(&index);
+        return 1;
+    }
+
+    printf("%s\n  crc32 %08x sha1 ", nes_index_path(&index, entry),
+           entry->crc32);
+    for (int i = 0; i < NES_SHA1_SIZE; ++i)
+        printf("%02x", entry->sha1[i]);
+    printf("\n  mapper %u.%u, %u KB PRG, %u KB CHR%s%s%s\n",
+           entry->mapper, entry->submapper,
+           entry->header.prg_rom_size * 16, entry->header.chr_rom_size * 8,
+           entry->flags & NES_INDEX_NES2 ? ", NES 2.0" : "",
+           entry->flags & NES_INDEX_CORRECTED ? ", corrected" : "",
+           entry->flags & NES_INDEX_BAD ? ", bad dump" : "");
+
+    nes_index_close(&index);
+
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [options] [rom]\n"
+            "  --record <movie>   record controller input to a movie\n"
+            "  --play <movie>     replay a movie\n"
+            "  --seek <frame>     start replay at the given frame\n"
+            "  --headless         no window, run unthrottled\n"
+            "  --huge-pages       back the instance with 2 MB pages\n"
+            "  --skip-render      do not render frames (headless only)\n"
+            "  --ff-bench <n>     time n frames with and without rendering\n"
+            "  --render-check <n> compare n frames drawn deferred and per dot\n"
+            "  --deferred         draw each frame at the end of the visible lines\n"
+            "  --filter <list>    post-process, e.g. scale3x,scanlines,blur\n"
+            "  --threads <n>      filter worker threads\n"
+            "  --filter-bench <n> time n frames through each filter\n"
+            "  --netplay <p>:<q>  rollback netplay, UDP port p to peer port q\n"
+            "  --player <1|2>     controller port of the local netplay player\n"
+            "  --netplay-test <n> run n frames of netplay over a lossy loopback\n"
+            "  --capture <file>   stream video as Y4M (\"|cmd\" for a pipe)\n"
+            "  --capture-wav <f>  stream audio as WAV (\"|cmd\" for a pipe)\n"
+            "  --trace <file>     dump an execution trace on exit\n"
+            "  --trace-frames <a>:<b>  only trace frames a to b\n"
+            "  --trace-addr <lo>:<hi>  only trace addresses lo to hi\n"
+            "  --watch <lo>:<hi>:<rwx> report accesses to lo..hi\n"
+            "  --profile <file>   profile guest code, folded stacks to file\n"
+            "  --idle-skip        skip over idle loops\n"
+            "  --idle-verify      check idle loop skips instead of making them\n"
+            "  --palette <file>   draw with the colors of a .pal file (F5 toggles)\n"
+            "  --scan <dir>       hash every ROM below dir into the index\n"
+            "  --index <file>     ROM index to write or read (roms.idx)\n"
+            "  --romdb <file>     header corrections applied while scanning\n"
+            "  --lookup <rom>     print what the index knows about a ROM\n",
+            prog);
+}
+
 int main(int argc, char *argv[])
 {
-    struct nes_emu nes;
-    struct nes_cart cart;
-    uint8_t running, frame_count, ret;
+    struct nes_emu *nes;
+    struct nes_movie movie;
+    struct nes_capture capture;
+    struct nes_filter_chain chain;
+    struct nes_pool pool;
+    struct nes_netplay netplay;
+    struct nes_transport transport;
+    struct nes_trace trace;
+    struct nes_watch watch;
+    struct nes_prof *prof;
+    struct nes_idle idle;
+    struct nes_render_log render_log;
+    struct nes_palette palette;
+    unsigned int netplay_port, netplay_peer;
+    unsigned int trace_first, trace_last, trace_lo, trace_hi;
+    const char *rom, *record, *play, *video, *audio, *filter, *trace_file;
+    const char *scan, *index, *romdb, *lookup, *profile, *palette_file;
+    uint32_t seek, bench, render_check, filter_bench, netplay_test;
+    int threads, player;
+    void *pixels;
+    int pitch;
+    uint8_t running, headless, skip_render, huge_pages, watching, deferred;
+    uint8_t idle_skip, idle_verify, user_palette;
+    int ret;
     SDL_Event event;
+    SDL_Window *window = NULL;
+    SDL_Renderer *renderer = NULL;
+    SDL_Texture *texture = NULL;
+
+    rom = "roms/tetris.nes";
+    record = NULL;
+    play = NULL;
+    video = NULL;
+    audio = NULL;
+    filter = "";
+    trace_file = NULL;
+    scan = NULL;
+    index = "roms.idx";
+    romdb = NULL;
+    lookup = NULL;
+    profile = NULL;
+    palette_file = NULL;
+    prof = NULL;
+    trace_first = 0;
+    trace_last = UINT32_MAX;
+    trace_lo = 0x0000;
+    trace_hi = 0xffff;
+    seek = 0;
+    bench = 0;
+    render_check = 0;
+    filter_bench = 0;
+    netplay_test = 0;
+    netplay_port = 0;
+    netplay_peer = 0;
+    player = 1;
+    threads = nes_pool_default_threads();
+    headless = 0;
+    skip_render = 0;
+    huge_pages = 0;
+    watching = 0;
+    deferred = 0;
+    idle_skip = 0;
+    idle_verify = 0;
+    user_palette = 0;
+
+    nes_watch_init(&watch, nes_watch_print, NULL);
+
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--record") && i + 1 < argc) {
+            record = argv[++i];
+        } else if (!strcmp(argv[i], "--play") && i + 1 < argc) {
+            play = argv[++i];
+        } else if (!strcmp(argv[i], "--capture") && i + 1 < argc) {
+            video = argv[++i];
+        } else if (!strcmp(argv[i], "--capture-wav") && i + 1 < argc) {
+            audio = argv[++i];
+        } else if (!strcmp(argv[i], "--filter") && i + 1 < argc) {
+            filter = argv[++i];
+        } else if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--filter-bench") && i + 1 < argc) {
+            filter_bench = strtoul(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "--netplay") && i + 1 < argc) {
+            if (sscanf(argv[++i], "%u:%u", &netplay_port, &netplay_peer) != 2) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "--player") && i + 1 < argc) {
+            player = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--netplay-test") && i + 1 < argc) {
+            netplay_test = strtoul(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "--trace") && i + 1 < argc) {
+            trace_file = argv[++i];
+        } else if (!strcmp(argv[i], "--trace-frames") && i + 1 < argc) {
+            if (sscanf(argv[++i], "%u:%u", &trace_first, &trace_last) != 2) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "--trace-addr") && i + 1 < argc) {
+            if (sscanf(argv[++i], "%x:%x", &trace_lo, &trace_hi) != 2 ||
+                trace_hi > 0xffff) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "--idle-skip")) {
+            idle_skip = 1;
+        } else if (!strcmp(argv[i], "--idle-verify")) {
+            idle_verify = 1;
+        } else if (!strcmp(argv[i], "--profile") && i + 1 < argc) {
+            profile = argv[++i];
+        } else if (!strcmp(argv[i], "--palette") && i + 1 < argc) {
+            palette_file = argv[++i];
+        } else if (!strcmp(argv[i], "--watch") && i + 1 < argc) {
+            if (nes_watch_parse(&watch, argv[++i])) {
+                usage(argv[0]);
+                return 1;
+            }
+            watching = 1;
+        } else if (!strcmp(argv[i], "--scan") && i + 1 < argc) {
+            scan = argv[++i];
+        } else if (!strcmp(argv[i], "--index") && i + 1 < argc) {
+            index = argv[++i];
+        } else if (!strcmp(argv[i], "--romdb") && i + 1 < argc) {
+            romdb = argv[++i];
+        } else if (!strcmp(argv[i], "--lookup") && i + 1 < argc) {
+            lookup = argv[++i];
+        } else if (!strcmp(argv[i], "--seek") && i + 1 < argc) {
+            seek = strtoul(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "--headless")) {
+            headless = 1;
+        } else if (!strcmp(argv[i], "--huge-pages")) {
+            huge_pages = 1;
+        } else if (!strcmp(argv[i], "--deferred")) {
+            deferred = 1;
+        } else if (!strcmp(argv[i], "--skip-render")) {
+            skip_render = 1;
+        } else if (!strcmp(argv[i], "--ff-bench") && i + 1 < argc) {
+            bench = strtoul(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "--render-check") && i + 1 < argc) {
+            render_check = strtoul(argv[++i], NULL, 0);
+        } else if (argv[i][0] == '-') {
+            usage(argv[0]);
+            return 1;
+        } else {
+            rom = argv[i];
+        }
+    }
+
+    // Recording needs a human at the keyboard, and headless
+    // mode has nothing to run other than a replay.
+    if ((record && (play || headless)) ||
+        (headless && !play && !bench && !render_check && !filter_bench &&
+         !netplay_test) ||
+        (skip_render && !headless) ||
+        (netplay_port && (record || play || headless)) ||
+        (player != 1 && player != 2)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    memset(&movie, 0, sizeof(movie));
+    memset(&capture, 0, sizeof(capture));
+    memset(&netplay, 0, sizeof(netplay));
+    memset(&trace, 0, sizeof(trace));
+
+    if (netplay_test)
+        return nes_netplay_test(rom, netplay_test);
 
-    nes_init(&nes);
+    // Answered from the index alone, no ROM is opened
+    if (lookup)
+        return nes_lookup(index, lookup);
 
-    ret = nes_load_catridge(&nes, &cart, "roms/tetris.nes");
-    if (ret < 0)
+    if (palette_file && nes_palette_load(&palette, palette_file)) {
+        fprintf(stderr, "cannot load palette %s\n", palette_file);
+        return 1;
+    }
+
+    if (nes_pool_init(&pool, threads))
+        return 1;
+
+    if (scan) {
+        ret = nes_scan(&pool, scan, index, romdb);
+        nes_pool_destroy(&pool);
+        return ret;
+    }
+
+    if (nes_filter_chain_init(&chain, &pool, filter)) {
+        fprintf(stderr, "bad filter list %s\n", filter);
+        nes_pool_destroy(&pool);
+        return 1;
+    }
+
+    // Movies and netplay sessions start from power-on, whatever
+    // the save file holds, and benchmarks leave it alone
+    nes = nes_create(rom, (huge_pages ? NES_CREATE_HUGE_PAGES : 0) |
+                          (record || play || netplay_port ||
+                           bench || render_check || filter_bench ?
+                           NES_CREATE_NO_SAVE : 0));
+    if (!nes) {
+        fprintf(stderr, "cannot load %s\n", rom);
+        ret = 1;
         goto cleanup;
+    }
+
+    ret = 0;
+
+    if (palette_file) {
+        nes_set_palette(nes, &palette, NES_PIXEL_ARGB8888);
+        user_palette = 1;
+    }
+
+    if (watching)
+        nes_watch_attach(&watch, &nes->bus);
+
+    nes_render_log_init(&render_log, &pool);
+    if (deferred)
+        nes_render_log_attach(&render_log, &nes->ppu);
 
 #define SCALE 3
+#define NES_TRACE_RECORDS   (1 << 20)
 
-    if (SDL_Init(SDL_INIT_VIDEO) < 0) {
-        fprintf(stderr, "SDL init failed: %s\n", SDL_GetError());
-        return 1;
+    if (bench) {
+        nes->ppu.mask = 0x1e;
+        simulate_cpu_writes(nes);
+        nes_ff_bench(nes, &render_log, bench);
+        goto cleanup;
     }
 
-    SDL_Window *window = SDL_CreateWindow(
-        "NES Emulator",
-        SDL_WINDOWPOS_CENTERED, 
-        SDL_WINDOWPOS_CENTERED,
-        256 * SCALE, 
-        240 * SCALE, 
-        SDL_WINDOW_SHOWN
-    );
-    
-    SDL_Renderer *renderer = SDL_CreateRenderer(
-        window, 
-        -1, 
-        SDL_RENDERER_ACCELERATED
-    );
-    SDL_Texture *texture = SDL_CreateTexture(
-        renderer,
-        SDL_PIXELFORMAT_ARGB8888, 
-        SDL_TEXTUREACCESS_STREAMING,
-        256, 
-        240
-    );
+    if (render_check) {
+        nes->ppu.mask = 0x1e;
+        simulate_cpu_writes(nes);
+        ret = nes_render_check(nes, &render_log, render_check) ? 1 : 0;
+        goto cleanup;
+    }
+
+    if (filter_bench) {
+        nes->ppu.mask = 0x1e;
+        simulate_cpu_writes(nes);
+        nes_run_frame(nes);
+        nes_filter_bench(&pool, nes->ppu.frame_buffer, filter_bench);
+        goto cleanup;
+    }
+
+    if (!headless) {
+        if (SDL_Init(SDL_INIT_VIDEO) < 0) {
+            fprintf(stderr, "SDL init failed: %s\n", SDL_GetError());
+            ret = 1;
+            goto cleanup;
+        }
+
+        window = SDL_CreateWindow(
+            "NES Emulator",
+            SDL_WINDOWPOS_CENTERED, 
+            SDL_WINDOWPOS_CENTERED,
+            256 * SCALE, 
+            240 * SCALE, 
+            SDL_WINDOW_SHOWN
+        );
+
+        renderer = SDL_CreateRenderer(
+            window, 
+            -1, 
+            SDL_RENDERER_ACCELERATED
+        );
+        texture = SDL_CreateTexture(
+            renderer,
+            SDL_PIXELFORMAT_ARGB8888, 
+            SDL_TEXTUREACCESS_STREAMING,
+            chain.width, 
+            chain.height
+        );
+    }
 
     running = 1;
 
-    nes.ppu.mask = 0x1e;
+    nes->ppu.mask = 0x1e;
+
+    // Attached before the setup writes, which are the only register
+    // accesses made until a CPU core drives the bus. --trace-frames
+    // narrows it down to the frames played.
+    if (trace_file) {
+        if (nes_trace_init(&trace, NES_TRACE_RECORDS)) {
+            fprintf(stderr, "cannot allocate trace ring\n");
+            ret = 1;
+            goto shutdown;
+        }
+
+        nes_trace_filter(&trace, NES_TRACE_ALL, trace_lo, trace_hi,
+                         trace_first, trace_last);
+        nes_trace_attach(&trace, &nes->bus);
+    }
+
+    simulate_cpu_writes(nes);
+
+    nes->ppu.skip_render = skip_render;
 
-    simulate_cpu_writes(&nes);
+    if (record)
+        nes_movie_record(&movie, nes);
+
+    if (play) {
+        ret = nes_movie_load(&movie, play);
+        if (!ret)
+            ret = nes_movie_play(&movie, nes);
+        if (!ret && seek)
+            ret = nes_movie_seek(&movie, nes, seek);
+        if (ret) {
+            fprintf(stderr, "cannot replay movie %s\n", play);
+            goto shutdown;
+        }
+    }
+
+    if (netplay_port) {
+        if (nes_udp_open(&transport, netplay_port, "127.0.0.1", netplay_peer)) {
+            fprintf(stderr, "cannot open netplay port %u\n", netplay_port);
+            ret = 1;
+            goto shutdown;
+        }
+
+        nes_netplay_init(&netplay, nes, &transport, player - 1);
+    }
+
+    if (profile) {
+        prof = malloc(sizeof(*prof));
+        if (!prof || nes_prof_init(prof)) {
+            fprintf(stderr, "cannot allocate profiler\n");
+            free(prof);
+            prof = NULL;
+            ret = 1;
+            goto shutdown;
+        }
+
+        nes->hooks.prof = prof;
+    }
+
+    if (idle_skip || idle_verify) {
+        nes_idle_init(&idle, idle_verify);
+        nes->hooks.idle = &idle;
+    }
+
+    if ((video || audio) && nes_capture_open(&capture, video, audio)) {
+        fprintf(stderr, "cannot start capture\n");
+        ret = 1;
+        goto shutdown;
+    }
 
     while(running) {
-        while (SDL_PollEvent(&event)) {
+        while (!headless && SDL_PollEvent(&event)) {
             if (event.type == SDL_QUIT)
                 running = 0;
+
+            // Switches between the .pal file, read again so edits
+            // to it show up, and the built-in colors
+            if (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_F5 &&
+                palette_file) {
+                user_palette = !user_palette;
+                if (user_palette && nes_palette_load(&palette, palette_file)) {
+                    fprintf(stderr, "cannot load palette %s\n", palette_file);
+                    user_palette = 0;
+                }
+                nes_set_palette(nes, user_palette ? &palette : NULL,
+                                NES_PIXEL_ARGB8888);
+            }
         }
 
-        for (int i = 0; i < 341 * 262; ++i) {
-            nes_ppu_tick(&nes.ppu);
+        if (movie.mode == NES_MOVIE_PLAY) {
+            if (nes_movie_play_frame(&movie, nes))
+                break;
+        } else if (!headless && !netplay.nes) {
+            nes->pads[0].buttons = nes_sdl_input();
         }
 
-        SDL_UpdateTexture(texture, NULL, nes.ppu.frame_buffer, 256 * sizeof(uint32_t));
+        if (movie.mode == NES_MOVIE_RECORD)
+            nes_movie_record_frame(&movie, nes);
+
+        // Netplay decides itself which frames get emulated
+        if (netplay.nes)
+            nes_netplay_advance(&netplay, nes_sdl_input());
+        else
+            nes_run_frame(nes);
+
+        if (capture.slots)
+            nes_capture_frame(&capture, nes->ppu.frame_buffer, NULL, 0);
+
+        // Headless replays run as fast as the host allows
+        if (headless)
+            continue;
+
+        // Filters write straight into the texture memory
+        if (!SDL_LockTexture(texture, NULL, &pixels, &pitch)) {
+            nes_filter_chain_run(&chain, nes->ppu.frame_buffer, pixels,
+                                 pitch / sizeof(uint32_t));
+            SDL_UnlockTexture(texture);
+        }
         SDL_RenderClear(renderer);
         SDL_RenderCopy(renderer, texture, NULL, NULL);
         SDL_RenderPresent(renderer);
@@ -303,13 +1258,77 @@ int main(int argc, char *argv[])
         SDL_Delay(16);
     }
 
-    SDL_DestroyTexture(texture);
-    SDL_DestroyRenderer(renderer);
-    SDL_DestroyWindow(window);
-    SDL_Quit();
+    if (play)
+        printf("replayed %u frames, state crc32 %08x\n",
+               nes->frame, nes_state_hash(nes));
+
+    if (record && nes_movie_save(&movie, record))
+        fprintf(stderr, "cannot save movie %s\n", record);
+
+shutdown:
+    if (netplay.nes) {
+        transport.close(transport.ctx);
+        fprintf(stderr, "netplay: %llu rollbacks, max %.3f ms, %s\n",
+                (unsigned long long)netplay.rollbacks,
+                netplay.resim_max_ns / 1e6,
+                netplay.desync ? "desynced" : "in sync");
+    }
+
+    if (capture.slots) {
+        nes_capture_close(&capture);
+        fprintf(stderr, "captured %llu frames, %llu dropped, "
+                "%.1f us/frame (max %.1f us)\n",
+                (unsigned long long)capture.frames,
+                (unsigned long long)capture.drops,
+                capture.frames ? capture.submit_ns / 1e3 / capture.frames : 0.0,
+                capture.submit_max_ns / 1e3);
+    }
+
+    if (trace.ring) {
+        nes_trace_detach(&nes->bus);
+        if (nes_trace_dump(&trace, trace_file))
+            fprintf(stderr, "cannot write trace %s\n", trace_file);
+        nes_trace_free(&trace);
+    }
+
+    if (nes->hooks.idle) {
+        nes->hooks.idle = NULL;
+        nes_idle_report(&idle, stderr);
+    }
+
+    if (prof) {
+        nes->hooks.prof = NULL;
+
+        // Only a CPU core that reports its instructions through
+        // nes_prof_instr() gives the profiler anything to count
+        if (!prof->total)
+            fprintf(stderr, "profile: no cycles recorded, the CPU did not "
+                    "report any instructions\n");
+
+        nes_prof_report(prof, stderr, 16);
+        if (nes_prof_dump_folded(prof, profile))
+            fprintf(stderr, "cannot write profile %s\n", profile);
+        nes_prof_free(prof);
+        free(prof);
+    }
+
+    nes_movie_free(&movie);
+
+    if (!headless) {
+        SDL_DestroyTexture(texture);
+        SDL_DestroyRenderer(renderer);
+        SDL_DestroyWindow(window);
+        SDL_Quit();
+    }
 
 cleanup:
-    nes_eject_catridge(NULL, &cart);
+    if (nes && nes_destroy(nes)) {
+        fprintf(stderr, "cannot write save file for %s\n", rom);
+        ret = 1;
+    }
 
-    return 0;
+    nes_filter_chain_free(&chain);
+    nes_pool_destroy(&pool);
+
+    return ret;
 }
@@ -0,0 +1,83 @@
+#ifndef NES_EMU_HEADER
+#define NES_EMU_HEADER
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include "arena.h"
+#include "cartridge.h"
+#include "controller.h"
+#include "ppu.h"
+#include "cpu.h"
+#include "bus.h"
+#include "palette.h"
+
+#define NINTENDO_RAM_SZ         0x800
+#define NINTENDO_PRG_RAM_SZ     0x2000
+#define NINTENDO_PRG_ROM_SZ     0x4000
+#define NINTENDO_CHR_ROM_SZ     0x2000
+
+// NTSC frame length in PPU dots (341 dots x 262 scanlines)
+#define NES_FRAME_DOTS          (341 * 262)
+
+#define NES_CREATE_HUGE_PAGES   NES_ARENA_HUGE_PAGES
+
+// Keep battery RAM in memory only instead of in the .sav file
+// next to the ROM, for runs that must start from power-on state.
+#define NES_CREATE_NO_SAVE      0x100
+
+// The CPU registers and bus fill the first cache line and the
+// per-dot PPU fields the second. The arrays touched while
+// emulating follow, then the cartridge (whose data pointers sit
+// together on one line) and the cold fields last. The frame
+// buffer and ROM data live further along in the same arena, see
+// nes_create().
+struct nes_emu {
+    struct cpu_6502 cpu;
+    struct nes_bus bus;
+    struct nes_ppu  ppu;
+    struct nes_cart cart;
+
+    uint8_t ram[NINTENDO_RAM_SZ];
+
+    // Output colors the PPU draws with, see nes_set_palette()
+    uint32_t palette_lut[NES_PALETTE_ENTRIES];
+
+    // Standard controllers plugged into $4016 and $4017
+    struct nes_controller pads[2];
+
+    // Number of frames emulated since power on
+    uint32_t frame;
+
+    struct nes_bus_hooks hooks;
+
+    struct nes_arena arena;
+} __attribute__((aligned(64)));
+
+_Static_assert(offsetof(struct nes_emu, ppu) == 64,
+               "CPU registers and bus must fit the first cache line");
+
+int nes_load_ines_header(FILE *fp, struct nes_cart *cart);
+int nes_prg_ram_alloc(struct nes_cart *cart);
+void nes_trainer_set(FILE *fp, struct nes_cart *cart);
+int nes_prg_rom_load(FILE *fp, struct nes_cart *cart);
+int nes_chr_rom_load(FILE *fp, struct nes_cart *cart);
+int nes_load_catridge(struct nes_emu *nes,
+                      struct nes_cart *cart,
+                      const char *name);
+int nes_eject_catridge(struct nes_emu *nes, struct nes_cart *cart);
+int nes_sram_attach(struct nes_cart *cart, const char *rom);
+
+struct nes_emu *nes_create(const char *name, int flags);
+int nes_destroy(struct nes_emu *nes);
+
+void nes_init(struct nes_emu *nes);
+void nes_ppu_init(struct nes_emu *nes);
+void nes_init_bus(struct nes_emu *nes);
+void nes_set_palette(struct nes_emu *nes, const struct nes_palette *pal,
+                     enum nes_pixel_format format);
+
+void nes_run_frame(struct nes_emu *nes);
+
+#endif
@@ -0,0 +1,444 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "netplay.h"
+#include "nes.h"
+
+#define H(frame)    ((frame) & (NES_NETPLAY_HISTORY - 1))
+
+static uint64_t nes_netplay_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int nes_netplay_init(struct nes_netplay *np, struct nes_emu *nes,
+                     struct nes_transport *transport, int local)
+{
+    if (local != 0 && local != 1)
+        return -1;
+
+    memset(np, 0, sizeof(*np));
+
+    np->nes = nes;
+    np->transport = transport;
+    np->local = local;
+
+    return 0;
+}
+
+// Sets up the controllers for a frame, with the real remote input
+// when it is known and a prediction otherwise.
+static void nes_netplay_apply(struct nes_netplay *np, uint32_t frame)
+{
+    uint8_t remote;
+
+    if (frame < np->remote_frame)
+        remote = np->remote_input[H(frame)];
+    else if (np->remote_frame)
+        remote = np->remote_input[H(np->remote_frame - 1)];
+    else
+        remote = 0;
+
+    np->predicted[H(frame)] = remote;
+
+    np->nes->pads[np->local].buttons = np->local_input[H(frame)];
+    np->nes->pads[!np->local].buttons = remote;
+}
+
+static void nes_netplay_send(struct nes_netplay *np)
+{
+    struct nes_netplay_packet pkt;
+    uint32_t first;
+
+    memset(&pkt, 0, sizeof(pkt));
+
+    first = np->peer_ack;
+    if (np->frame - first > sizeof(pkt.inputs))
+        first = np->frame - sizeof(pkt.inputs);
+
+    pkt.magic = NES_NETPLAY_MAGIC;
+    pkt.frame = first;
+    pkt.count = np->frame - first;
+    pkt.ack = np->remote_frame;
+
+    for (int i = 0; i < pkt.count; ++i)
+        pkt.inputs[i] = np->local_input[H(first + i)];
+
+    if (np->hashed) {
+        pkt.flags |= NES_NETPLAY_HAS_HASH;
+        pkt.hash_frame = np->hash_frame;
+        pkt.hash = np->hash;
+    }
+
+    np->transport->send(np->transport->ctx, &pkt, sizeof(pkt));
+}
+
+// Drains the transport. Returns the first frame that was simulated
+// with a wrong prediction, or UINT32_MAX if there is none.
+static uint32_t nes_netplay_poll(struct nes_netplay *np)
+{
+    struct nes_netplay_packet pkt;
+    uint32_t rollback, frame;
+    uint8_t input;
+    int ret;
+
+    rollback = UINT32_MAX;
+
+    // Errors (a refused send to a peer that is not up yet comes
+    // back as one) and stray datagrams are skipped, the packets
+    // queued behind them are still wanted this frame
+    for (int n = 0; n < NES_NETPLAY_DRAIN; ++n) {
+        ret = np->transport->recv(np->transport->ctx, &pkt, sizeof(pkt));
+        if (ret == 0)
+            break;
+
+        if (ret != sizeof(pkt) ||
+            pkt.magic != NES_NETPLAY_MAGIC ||
+            pkt.count > sizeof(pkt.inputs))
+            continue;
+
+        if ((int32_t)(pkt.ack - np->peer_ack) > 0)
+            np->peer_ack = pkt.ack;
+
+        if ((pkt.flags & NES_NETPLAY_HAS_HASH) &&
+            (!np->remote_hash_seen ||
+             (int32_t)(pkt.hash_frame - np->remote_hash_frame) > 0)) {
+            np->remote_hash_seen = 1;
+            np->remote_hash_valid = 1;
+            np->remote_hash_frame = pkt.hash_frame;
+            np->remote_hash = pkt.hash;
+        }
+
+        // Only the next frame in sequence is accepted, anything
+        // older is a duplicate and anything newer leaves a gap.
+        for (int i = 0; i < pkt.count; ++i) {
+            frame = pkt.frame + i;
+            if (frame != np->remote_frame)
+                continue;
+
+            input = pkt.inputs[i];
+            np->remote_input[H(frame)] = input;
+            np->remote_frame++;
+
+            if (frame < np->frame && frame < rollback &&
+                np->predicted[H(frame)] != input)
+                rollback = frame;
+        }
+    }
+
+    return rollback;
+}
+
+static void nes_netplay_rollback(struct nes_netplay *np, uint32_t from)
+{
+    struct nes_emu *nes = np->nes;
+    uint64_t start, elapsed;
+    uint8_t skip_render;
+
+    start = nes_netplay_now_ns();
+    skip_render = nes->ppu.skip_render;
+
+    nes_state_load(nes, &np->states[H(from)]);
+
+    // Only the frame that ends up on screen is rendered
+    for (uint32_t frame = from; frame < np->frame; ++frame) {
+        if (frame != from)
+            nes_state_save(nes, &np->states[H(frame)]);
+
+        nes_netplay_apply(np, frame);
+
+        nes->ppu.skip_render = skip_render || (frame != np->frame - 1);
+        nes_run_frame(nes);
+    }
+
+    nes->ppu.skip_render = skip_render;
+
+    elapsed = nes_netplay_now_ns() - start;
+
+    np->rollbacks++;
+    np->resim_frames += np->frame - from;
+    if (elapsed > np->resim_max_ns)
+        np->resim_max_ns = elapsed;
+}
+
+// Hashes states whose inputs are now confirmed on both sides, and
+// compares against the peer's hash of the same frame.
+static void nes_netplay_check(struct nes_netplay *np)
+{
+    uint32_t frame;
+
+    for (;;) {
+        frame = np->hashed ? np->hash_frame + NES_NETPLAY_HASH_INTERVAL : 0;
+
+        // States are saved at the start of a frame, so the state
+        // for frame is final once the inputs before it are known.
+        if (frame >= np->frame || frame > np->remote_frame)
+            break;
+
+        np->hash_frame = frame;
+        np->hash = nes_state_crc32(&np->states[H(frame)]);
+        np->hashes[H(frame)] = np->hash;
+        np->hashed = 1;
+    }
+
+    if (!np->remote_hash_valid || !np->hashed)
+        return;
+
+    // Not hashed locally yet
+    if ((int32_t)(np->remote_hash_frame - np->hash_frame) > 0)
+        return;
+
+    np->remote_hash_valid = 0;
+
+    // Too old to still be in the history
+    if (np->hash_frame - np->remote_hash_frame >= NES_NETPLAY_HISTORY)
+        return;
+
+    np->hash_checks++;
+
+    if (np->hashes[H(np->remote_hash_frame)] != np->remote_hash && !np->desync) {
+        np->desync = 1;
+        np->desync_frame = np->remote_hash_frame;
+    }
+}
+
+// Runs one host frame. Returns 1 when the session stalled waiting
+// for the peer and no frame was emulated.
+int nes_netplay_advance(struct nes_netplay *np, uint8_t buttons)
+{
+    uint32_t rollback;
+
+    rollback = nes_netplay_poll(np);
+    if (rollback != UINT32_MAX)
+        nes_netplay_rollback(np, rollback);
+
+    nes_netplay_check(np);
+
+    if ((int32_t)(np->frame - np->remote_frame) >= NES_NETPLAY_MAX_ROLLBACK) {
+        np->stalls++;
+        nes_netplay_send(np);
+        return 1;
+    }
+
+    np->local_input[H(np->frame)] = buttons;
+
+    nes_state_save(np->nes, &np->states[H(np->frame)]);
+    nes_netplay_apply(np, np->frame);
+    nes_run_frame(np->nes);
+
+    np->frame++;
+
+    nes_netplay_send(np);
+
+    return 0;
+}
+
+static int nes_udp_send(void *ctx, const void *buf, size_t len)
+{
+    return send((int)(intptr_t)ctx, buf, len, 0);
+}
+
+static int nes_udp_recv(void *ctx, void *buf, size_t len)
+{
+    ssize_t ret;
+
+    ret = recv((int)(intptr_t)ctx, buf, len, 0);
+    if (ret < 0)
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+
+    return ret;
+}
+
+static void nes_udp_close(void *ctx)
+{
+    close((int)(intptr_t)ctx);
+}
+
+int nes_udp_open(struct nes_transport *t, uint16_t port,
+                 const char *peer, uint16_t peer_port)
+{
+    struct sockaddr_in addr;
+    int fd;
+
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0)
+        return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)))
+        goto err;
+
+    addr.sin_port = htons(peer_port);
+    if (inet_pton(AF_INET, peer, &addr.sin_addr) != 1)
+        goto err;
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)))
+        goto err;
+
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK))
+        goto err;
+
+    t->ctx = (void *)(intptr_t)fd;
+    t->send = nes_udp_send;
+    t->recv = nes_udp_recv;
+    t->close = nes_udp_close;
+
+    return 0;
+
+err:
+    close(fd);
+
+    return -1;
+}
+
+#define NES_LOOPBACK_QUEUE      256
+#define NES_LOOPBACK_MTU        64
+
+struct nes_loopback_packet {
+    uint32_t deliver;
+    uint16_t len;
+    uint8_t data[NES_LOOPBACK_MTU];
+};
+
+struct nes_loopback;
+
+struct nes_loopback_end {
+    struct nes_loopback *lb;
+    int side;
+};
+
+// In-process transport for testing. Packets are held back for
+// delay ticks and a loss percentage of them is dropped, using a
+// seeded generator so runs are reproducible. The clock only moves
+// on nes_loopback_tick(), once per host frame.
+struct nes_loopback {
+    struct nes_loopback_end ends[2];
+
+    // queue[i] holds packets on their way to side i
+    struct nes_loopback_packet queue[2][NES_LOOPBACK_QUEUE];
+    uint32_t head[2];
+    uint32_t tail[2];
+
+    uint32_t now;
+    uint32_t delay;
+    uint32_t loss;
+    uint32_t seed;
+    int refs;
+};
+
+static uint32_t nes_loopback_rand(struct nes_loopback *lb)
+{
+    // xorshift32
+    lb->seed ^= lb->seed << 13;
+    lb->seed ^= lb->seed >> 17;
+    lb->seed ^= lb->seed << 5;
+
+    return lb->seed;
+}
+
+static int nes_loopback_send(void *ctx, const void *buf, size_t len)
+{
+    struct nes_loopback_end *end = ctx;
+    struct nes_loopback *lb = end->lb;
+    struct nes_loopback_packet *pkt;
+    int to = !end->side;
+
+    if (len > NES_LOOPBACK_MTU)
+        return -1;
+
+    if ((nes_loopback_rand(lb) % 100) < lb->loss)
+        return len;
+
+    if (lb->head[to] - lb->tail[to] == NES_LOOPBACK_QUEUE)
+        return len;
+
+    pkt = &lb->queue[to][lb->head[to]++ % NES_LOOPBACK_QUEUE];
+    pkt->deliver = lb->now + lb->delay;
+    pkt->len = len;
+    memcpy(pkt->data, buf, len);
+
+    return len;
+}
+
+static int nes_loopback_recv(void *ctx, void *buf, size_t len)
+{
+    struct nes_loopback_end *end = ctx;
+    struct nes_loopback *lb = end->lb;
+    struct nes_loopback_packet *pkt;
+    int me = end->side;
+
+    if (lb->head[me] == lb->tail[me])
+        return 0;
+
+    pkt = &lb->queue[me][lb->tail[me] % NES_LOOPBACK_QUEUE];
+    if ((int32_t)(pkt->deliver - lb->now) > 0)
+        return 0;
+
+    lb->tail[me]++;
+
+    if (pkt->len > len)
+        return -1;
+
+    memcpy(buf, pkt->data, pkt->len);
+
+    return pkt->len;
+}
+
+static void nes_loopback_close(void *ctx)
+{
+    struct nes_loopback_end *end = ctx;
+
+    if (--end->lb->refs == 0)
+        free(end->lb);
+}
+
+int nes_loopback_open(struct nes_transport *a, struct nes_transport *b,
+                      uint32_t delay, uint32_t loss, uint32_t seed)
+{
+    struct nes_loopback *lb;
+    struct nes_transport *t[2] = { a, b };
+
+    lb = calloc(1, sizeof(*lb));
+    if (!lb)
+        return -1;
+
+    lb->delay = delay;
+    lb->loss = loss;
+    lb->seed = seed ? seed : 0x2545f491;
+    lb->refs = 2;
+
+    for (int i = 0; i < 2; ++i) {
+        lb->ends[i].lb = lb;
+        lb->ends[i].side = i;
+
+        t[i]->ctx = &lb->ends[i];
+        t[i]->send = nes_loopback_send;
+        t[i]->recv = nes_loopback_recv;
+        t[i]->close = nes_loopback_close;
+    }
+
+    return 0;
+}
+
+// Either end of the pair may be used to move the shared clock
+void nes_loopback_tick(struct nes_transport *t)
+{
+    struct nes_loopback_end *end = t->ctx;
+
+    end->lb->now++;
+}
@@ -0,0 +1,129 @@
+#ifndef NES_NETPLAY_HEADER
+#define NES_NETPLAY_HEADER
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "savestate.h"
+
+// Deepest rollback allowed. A peer that has not confirmed input
+// for this many frames makes the local side stall instead.
+#define NES_NETPLAY_MAX_ROLLBACK    8
+
+// Frames of input and state history, a power of two larger than
+// the rollback window.
+#define NES_NETPLAY_HISTORY         32
+
+// Confirmed state hashes are exchanged every this many frames
+#define NES_NETPLAY_HASH_INTERVAL   16
+
+// Most datagrams read per poll, so a socket that keeps failing
+// cannot hold up the frame
+#define NES_NETPLAY_DRAIN           1024
+
+#define NES_NETPLAY_MAGIC           0x4e50
+
+// Packet flags
+#define NES_NETPLAY_HAS_HASH        0x01
+
+struct nes_emu;
+
+// A datagram transport. recv() must not block and returns the
+// size of the packet read, 0 when nothing is pending, or -1.
+struct nes_transport {
+    void *ctx;
+
+    int (*send)(void *ctx, const void *buf, size_t len);
+    int (*recv)(void *ctx, void *buf, size_t len);
+    void (*close)(void *ctx);
+};
+
+// Sent once per frame. Carries every local input the peer has
+// not acknowledged yet, so a lost packet is covered by the next
+// one. Both sides stall at the rollback window, so the peer can
+// never be missing more than two windows worth of our input.
+// Fields are in host byte order.
+struct nes_netplay_packet {
+    uint16_t magic;
+    uint8_t count;
+    uint8_t flags;
+
+    // Frame of inputs[0]
+    uint32_t frame;
+
+    // Next frame of the peer's input we are waiting for
+    uint32_t ack;
+
+    // Hash of our state at the start of hash_frame, a frame
+    // whose input is confirmed on both sides.
+    uint32_t hash_frame;
+    uint32_t hash;
+
+    uint8_t inputs[NES_NETPLAY_MAX_ROLLBACK * 2];
+} __attribute__((packed));
+
+// Rollback session between two instances running the same
+// cartridge. Each side runs ahead with predicted remote input
+// (the last input received is assumed to still be held). When
+// the real input arrives and differs, the instance rolls back
+// to the savestate of the first mispredicted frame and quietly
+// re-simulates up to the present.
+struct nes_netplay {
+    struct nes_emu *nes;
+    struct nes_transport *transport;
+
+    // Controller port of the local player (0 or 1)
+    int local;
+
+    // The next frame to be emulated
+    uint32_t frame;
+
+    // Remote input is known for every frame before this one
+    uint32_t remote_frame;
+
+    // The peer has our input for every frame before this one
+    uint32_t peer_ack;
+
+    uint8_t local_input[NES_NETPLAY_HISTORY];
+    uint8_t remote_input[NES_NETPLAY_HISTORY];
+
+    // Remote input each frame was last simulated with
+    uint8_t predicted[NES_NETPLAY_HISTORY];
+
+    // State at the start of each frame in the history
+    struct nes_savestate states[NES_NETPLAY_HISTORY];
+
+    // Latest confirmed state hash, valid once hashed is set
+    uint8_t hashed;
+    uint32_t hash_frame;
+    uint32_t hash;
+    uint32_t hashes[NES_NETPLAY_HISTORY];
+
+    // Latest hash received from the peer, pending until compared
+    uint8_t remote_hash_seen;
+    uint8_t remote_hash_valid;
+    uint32_t remote_hash_frame;
+    uint32_t remote_hash;
+
+    uint8_t desync;
+    uint32_t desync_frame;
+    uint64_t hash_checks;
+
+    uint64_t rollbacks;
+    uint64_t resim_frames;
+    uint64_t resim_max_ns;
+    uint64_t stalls;
+};
+
+int nes_netplay_init(struct nes_netplay *np, struct nes_emu *nes,
+                     struct nes_transport *transport, int local);
+int nes_netplay_advance(struct nes_netplay *np, uint8_t buttons);
+
+int nes_udp_open(struct nes_transport *t, uint16_t port,
+                 const char *peer, uint16_t peer_port);
+
+int nes_loopback_open(struct nes_transport *a, struct nes_transport *b,
+                      uint32_t delay, uint32_t loss, uint32_t seed);
+void nes_loopback_tick(struct nes_transport *t);
+
+#endif
@@ -0,0 +1,130 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "palette.h"
+
+/* NES 64-color 32-bit colors RGB palette */
+const uint32_t nes_canonical_palette[NES_PALETTE_COLORS] = {
+    0xff757575, 0xff271b8f,
+    0xff0000ab, 0xff47009f,
+    0xff8f0077, 0xffa7004e,
+    0xffb7001e, 0xffb00000,
+    0xffa70000, 0xff7f0b00,
+    0xff432f00, 0xff004700,
+    0xff005100, 0xff003f17,
+    0xff1b3f5f, 0xff000000,
+    0xffbcbcbc, 0xff0073ef,
+    0xff233bef, 0xff8300f3,
+    0xffbf00bf, 0xffe7005b,
+    0xfff30017, 0xffef2b00,
+    0xffcb4f0f, 0xff8b7300,
+    0xff009700, 0xff00ab00,
+    0xff00933b, 0xff00838b,
+    0xff000000, 0xff000000,
+    0xffffffff, 0xff3fbfff,
+    0xff5f73ff, 0xff9f3fff,
+    0xffbf3fbf, 0xffff3f8f,
+    0xffff5f3f, 0xffff7b0f,
+    0xffef9f0f, 0xffbfbf00,
+    0xff5fdf00, 0xff3fef5f,
+    0xff3fef9f, 0xff3fcfcf,
+    0xff000000, 0xff000000,
+    0xffffffff, 0xffabe7ff,
+    0xffc7d7ff, 0xffd7c7ff,
+    0xffe7c7e7, 0xffffc7cf,
+    0xffffd7c7, 0xffffe7b7,
+    0xfffff7a3, 0xffe3ffa3,
+    0xffc3ffb3, 0xffb3ffcf,
+    0xffb3fff3, 0xffb3e3ff,
+    0xff000000, 0xff000000
+};
+
+void nes_palette_default(struct nes_palette *pal)
+{
+    uint32_t c;
+
+    memset(pal, 0, sizeof(*pal));
+
+    for (int i = 0; i < NES_PALETTE_COLORS; ++i) {
+        c = nes_canonical_palette[i];
+        pal->rgb[i][0] = c >> 16;
+        pal->rgb[i][1] = c >> 8;
+        pal->rgb[i][2] = c;
+    }
+
+    pal->colors = NES_PALETTE_COLORS;
+}
+
+// Loads a .pal file: 64 RGB triplets, or 512 with the emphasized
+// colors included (in PPUMASK bit order, 64 colors per block).
+int nes_palette_load(struct nes_palette *pal, const char *name)
+{
+    uint8_t buf[sizeof(pal->rgb) + 1];
+    size_t len;
+    FILE *fp;
+
+    fp = fopen(name, "rb");
+    if (!fp)
+        return -1;
+
+    len = fread(buf, 1, sizeof(buf), fp);
+    fclose(fp);
+
+    if (len != NES_PALETTE_COLORS * 3 && len != NES_PALETTE_ENTRIES * 3)
+        return -1;
+
+    memset(pal, 0, sizeof(*pal));
+    memcpy(pal->rgb, buf, len);
+    pal->colors = len / 3;
+
+    return 0;
+}
+
+static inline uint32_t nes_palette_pack(enum nes_pixel_format format,
+                                        const uint8_t *rgb)
+{
+    switch (format) {
+    case NES_PIXEL_ABGR8888:
+        return 0xff000000 | rgb[2] << 16 | rgb[1] << 8 | rgb[0];
+    default:
+        return 0xff000000 | rgb[0] << 16 | rgb[1] << 8 | rgb[2];
+    }
+}
+
+// Builds the 512 entry output table for a palette. Without colors
+// for them in the palette, emphasis dims the two channels not
+// emphasized to about 80% for each bit set, the way the NTSC PPU
+// attenuates its signal. The columns that are always black stay
+// black.
+void nes_palette_lut(const struct nes_palette *pal,
+                     enum nes_pixel_format format, uint32_t *lut)
+{
+    uint8_t rgb[3];
+    int scale;
+
+    if (pal->colors == NES_PALETTE_ENTRIES) {
+        for (int i = 0; i < NES_PALETTE_ENTRIES; ++i)
+            lut[i] = nes_palette_pack(format, pal->rgb[i]);
+        return;
+    }
+
+    for (int e = 0; e < 8; ++e) {
+        for (int i = 0; i < NES_PALETTE_COLORS; ++i) {
+            for (int c = 0; c < 3; ++c) {
+                // Bit 5 emphasizes red, 6 green and 7 blue
+                scale = 256;
+                for (int b = 0; b < 3; ++b) {
+                    if ((e & (1 << b)) && b != c)
+                        scale = scale * 209 >> 8;
+                }
+
+                if ((i & 0x0e) == 0x0e)
+                    scale = 256;
+
+                rgb[c] = pal->rgb[i][c] * scale >> 8;
+            }
+
+            lut[e * NES_PALETTE_COLORS + i] = nes_palette_pack(format, rgb);
+        }
+    }
+}
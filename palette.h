@@ -0,0 +1,41 @@
+#ifndef NES_PALETTE_HEADER
+#define NES_PALETTE_HEADER
+
+#include <stdint.h>
+#include <stddef.h>
+
+// 64 colors for each of the 8 combinations of the PPUMASK color
+// emphasis bits
+#define NES_PALETTE_COLORS      64
+#define NES_PALETTE_ENTRIES     (8 * NES_PALETTE_COLORS)
+
+enum nes_pixel_format {
+    NES_PIXEL_ARGB8888 = 0,
+    NES_PIXEL_ABGR8888,
+};
+
+// Source colors of a palette as 8-bit RGB triplets. Files with
+// only the 64 base colors leave emphasis to nes_palette_lut().
+struct nes_palette {
+    uint8_t rgb[NES_PALETTE_ENTRIES][3];
+    size_t colors;
+};
+
+extern const uint32_t nes_canonical_palette[NES_PALETTE_COLORS];
+
+// Output color of a palette index under the given PPUMASK, looked
+// up in a table made by nes_palette_lut(). Greyscale keeps only
+// the luma column of the index, emphasis picks one of 8 blocks.
+static inline uint32_t nes_palette_color(const uint32_t *lut, uint8_t mask,
+                                         uint8_t index)
+{
+    return lut[((mask & 0xe0) << 1) | (index & ((mask & 0x01) ? 0x30 : 0x3f))];
+}
+
+void nes_palette_default(struct nes_palette *pal);
+int nes_palette_load(struct nes_palette *pal, const char *name);
+
+void nes_palette_lut(const struct nes_palette *pal,
+                     enum nes_pixel_format format, uint32_t *lut);
+
+#endif
@@ -0,0 +1,132 @@
+#include <string.h>
+#include <unistd.h>
+
+#include "pool.h"
+
+static void nes_pool_work(struct nes_pool *pool)
+{
+    int start, end;
+
+    for (;;) {
+        start = __atomic_fetch_add(&pool->next, pool->stripe, __ATOMIC_RELAXED);
+        if (start >= pool->rows)
+            break;
+
+        end = start + pool->stripe;
+        if (end > pool->rows)
+            end = pool->rows;
+
+        pool->fn(pool->arg, start, end);
+    }
+}
+
+static void *nes_pool_thread(void *arg)
+{
+    struct nes_pool *pool = arg;
+    uint64_t seen = 0;
+
+    pthread_mutex_lock(&pool->lock);
+
+    for (;;) {
+        while (pool->generation == seen && !pool->stop)
+            pthread_cond_wait(&pool->start, &pool->lock);
+
+        if (pool->stop)
+            break;
+
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        nes_pool_work(pool);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->busy == 0)
+            pthread_cond_signal(&pool->done);
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+int nes_pool_init(struct nes_pool *pool, int threads)
+{
+    memset(pool, 0, sizeof(*pool));
+
+    if (threads > NES_POOL_MAX_THREADS)
+        threads = NES_POOL_MAX_THREADS;
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    for (int i = 0; i < threads; ++i) {
+        if (pthread_create(&pool->threads[i], NULL, nes_pool_thread, pool)) {
+            nes_pool_destroy(pool);
+            return -1;
+        }
+
+        pool->count++;
+    }
+
+    return 0;
+}
+
+void nes_pool_run(struct nes_pool *pool, nes_pool_fn fn, void *arg,
+                  int rows, int stripe)
+{
+    if (stripe < 1)
+        stripe = 1;
+
+    // Not worth waking anybody up for a single stripe
+    if (pool->count == 0 || rows <= stripe) {
+        fn(arg, 0, rows);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->fn = fn;
+    pool->arg = arg;
+    pool->rows = rows;
+    pool->stripe = stripe;
+    pool->next = 0;
+    pool->busy = pool->count;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    nes_pool_work(pool);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->busy)
+        pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void nes_pool_destroy(struct nes_pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->count; ++i)
+        pthread_join(pool->threads[i], NULL);
+
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->start);
+    pthread_mutex_destroy(&pool->lock);
+
+    pool->count = 0;
+}
+
+// One worker per online CPU beyond the caller's own
+int nes_pool_default_threads(void)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (cpus <= 1)
+        return 0;
+
+    return (cpus - 1 > NES_POOL_MAX_THREADS) ? NES_POOL_MAX_THREADS : cpus - 1;
+}
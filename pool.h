@@ -0,0 +1,43 @@
+#ifndef NES_POOL_HEADER
+#define NES_POOL_HEADER
+
+#include <stdint.h>
+#include <pthread.h>
+
+#define NES_POOL_MAX_THREADS    16
+
+// Processes rows [start, end) of a job
+typedef void (*nes_pool_fn)(void *arg, int start, int end);
+
+// A small fixed set of worker threads that split a job into
+// stripes of rows. Workers (and the caller, which always takes
+// part) pull the next stripe from a shared counter, so uneven
+// stripes balance themselves out. nes_pool_run() returns once
+// every row has been processed.
+struct nes_pool {
+    pthread_t threads[NES_POOL_MAX_THREADS];
+    int count;
+
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+
+    uint64_t generation;
+    int busy;
+    uint8_t stop;
+
+    nes_pool_fn fn;
+    void *arg;
+    int rows;
+    int stripe;
+    int next;
+};
+
+int nes_pool_init(struct nes_pool *pool, int threads);
+void nes_pool_run(struct nes_pool *pool, nes_pool_fn fn, void *arg,
+                  int rows, int stripe);
+void nes_pool_destroy(struct nes_pool *pool);
+
+int nes_pool_default_threads(void);
+
+#endif
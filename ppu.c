@@ -1,47 +1,53 @@
 #include "ppu.h"
+#include "palette.h"
 #include <stdio.h>
 
 uint8_t nes_ppu_read(struct nes_ppu *ppu, uint16_t addr)
 {
-    uint8_t pal;
-    
     addr &= 0x3fff;
 
-    switch (addr) {
-    case 0x0000 ... 0x1fff:
-        // No support for CHR RAM for now
-        return ppu->cart->chr_rom[addr];
-    case 0x2000 ... 0x3eff:
-        addr = nes_nametable_addr_calc(ppu, addr);
-        return ppu->vram[addr];
-    case 0x3f00 ... 0x3fff:
-        pal = nes_palette_addr_calc(ppu, addr);
-        return ppu->palette[pal];
-    default:
-        return 0;
-    }
+    if (addr >= 0x3f00)
+        return ppu->palette[nes_palette_addr_calc(ppu, addr)];
+
+    return ppu->pages[addr >> 10][addr & 0x3ff];
 }
 
 void nes_ppu_write(struct nes_ppu *ppu, uint16_t addr, uint8_t data)
 {
+    uint8_t *page;
     uint8_t pal;
 
     addr &= 0x3fff;
 
-    switch (addr) {
-    case 0x0000 ... 0x1fff:
-        // No support for CHR RAM for now
-        break;
-    case 0x2000 ... 0x3eff:
-        addr = nes_nametable_addr_calc(ppu, addr);
-        ppu->vram[addr] = data;
-        break;
-    case 0x3f00 ... 0x3fff:
+    if (addr >= 0x3f00) {
         pal = nes_palette_addr_calc(ppu, addr);
+
+        if (ppu->log && ppu->scanline < 240)
+            nes_render_log_event(ppu, NES_RENDER_PALETTE, pal, data);
+
         ppu->palette[pal] = data;
-    default:
         return;
     }
+
+    // CHR ROM
+    if (!(ppu->page_ram & (1 << (addr >> 10))))
+        return;
+
+    page = ppu->pages[addr >> 10];
+
+    // Logged as offsets into CHR RAM and nametable RAM, which is
+    // what the deferred renderer keeps copies of.
+    if (ppu->log && ppu->scanline < 240) {
+        if (addr < 0x2000)
+            nes_render_log_event(ppu, NES_RENDER_CHR,
+                                 page - ppu->cart->chr_rom + (addr & 0x3ff),
+                                 data);
+        else
+            nes_render_log_event(ppu, NES_RENDER_VRAM,
+                                 page - ppu->vram + (addr & 0x3ff), data);
+    }
+
+    page[addr & 0x3ff] = data;
 }
 
 uint8_t nes_ppu_reg_read(struct nes_ppu *ppu, uint16_t addr)
@@ -80,9 +86,16 @@ void nes_ppu_reg_write(struct nes_ppu *ppu, uint16_t addr, uint8_t data)
 
     switch (addr) {
     case 0x2000:
+        if (ppu->log && ppu->scanline < 240)
+            nes_render_log_event(ppu, NES_RENDER_CTRL, 0, data);
+
         ppu->ctrl = data;
+        ppu->reg.t = (ppu->reg.t & ~0x0c00) | ((data & 0x03) << 10);
         break;
     case 0x2001:
+        if (ppu->log && ppu->scanline < 240)
+            nes_render_log_event(ppu, NES_RENDER_MASK, 0, data);
+
         ppu->mask = data;
         break;
     case 0x2003:
@@ -91,10 +104,16 @@ void nes_ppu_reg_write(struct nes_ppu *ppu, uint16_t addr, uint8_t data)
     case 0x2004:
         ppu->oam[ppu->oam_addr++] = data;
         break;
-    case 0x2005: // TODO: scrolling
+    case 0x2005:
         if (ppu->reg.w) {
+            // Fine y and coarse y
+            ppu->reg.t = (ppu->reg.t & ~0x73e0) |
+                         ((data & 0x07) << 12) | ((data & 0xf8) << 2);
             ppu->reg.w = 0;
         } else {
+            // Coarse x and fine x
+            ppu->reg.t = (ppu->reg.t & ~0x001f) | (data >> 3);
+            ppu->reg.x = data & 0x07;
             ppu->reg.w = 1;
         }
         break;
@@ -104,6 +123,7 @@ void nes_ppu_reg_write(struct nes_ppu *ppu, uint16_t addr, uint8_t data)
             ppu->reg.w = 1;
         } else {
             ppu->reg.t = (ppu->reg.t & 0xFF00) | data;
+            ppu->reg.v = ppu->reg.t;
             ppu->vram_addr = ppu->reg.t & 0x3FFF;
             ppu->reg.w = 0;
         }
@@ -117,22 +137,39 @@ void nes_ppu_reg_write(struct nes_ppu *ppu, uint16_t addr, uint8_t data)
     }
 }
 
-uint16_t nes_nametable_addr_calc(struct nes_ppu *ppu,  uint16_t addr)
+// Points the 16 PPU pages at the cartridge's CHR banks and at
+// CIRAM as its mirroring wires it up. Mappers call this whenever
+// they switch either.
+void nes_ppu_map(struct nes_ppu *ppu)
 {
-    addr &= 0x2fff;             // Mirrored
-
-    if (ppu->cart->mirroring)
-        // Vertical arrangement: 0x2000 and 0x2400 contain the
-        // first nametable, and 0x2800 and 0x2C00 contain the
-        // second nametable, accomplished by connecting CIRAM
-        // A10 to PPU A11.
-        return addr & 0x07ff;
-    else
-        // Horizontal arrangement: 0x2000 and 0x2800 contain 
-        // the first nametable, and 0x2400 and 0x2c00 contain 
-        // the second nametable accomplished by connecting 
-        // CIRAM A10 to PPU A10.
-        return ((addr >> 1 ) & 0x400) | (addr & 0x3ff);
+    static const uint16_t nametables[][4] = {
+        [NES_MIRROR_HORIZONTAL]  = { 0x000, 0x000, 0x400, 0x400 },
+        [NES_MIRROR_VERTICAL]    = { 0x000, 0x400, 0x000, 0x400 },
+        [NES_MIRROR_FOUR_SCREEN] = { 0x000, 0x400, 0x800, 0xc00 },
+        [NES_MIRROR_SINGLE_LOW]  = { 0x000, 0x000, 0x000, 0x000 },
+        [NES_MIRROR_SINGLE_HIGH] = { 0x400, 0x400, 0x400, 0x400 },
+    };
+    struct nes_cart *cart = ppu->cart;
+    uint16_t banks;
+
+    // Lines already logged were drawn with the old mapping, and
+    // so was the current one if its pixels are out. Switching in
+    // the middle of a line draws all of it with the new one.
+    if (ppu->log && ppu->scanline < 240)
+        nes_render_log_flush(ppu, ppu->scanline + (ppu->cycle > 256));
+
+    banks = cart->chr_ram ? 8 : cart->header.chr_rom_size * 8;
+
+    for (int i = 0; i < 8; ++i)
+        ppu->pages[i] = cart->chr_rom ?
+            cart->chr_rom + (cart->chr_banks[i] % banks) * 0x400 : NULL;
+
+    // $3000-$3EFF mirrors $2000-$2EFF
+    for (int i = 0; i < 8; ++i)
+        ppu->pages[8 + i] = ppu->vram +
+                            nametables[cart->mirroring][i & 0x03];
+
+    ppu->page_ram = cart->chr_ram ? 0xffff : 0xff00;
 }
 
 uint8_t nes_palette_addr_calc(struct nes_ppu *ppu,  uint16_t addr)
@@ -168,12 +205,71 @@ void nes_ppu_tick(struct nes_ppu *ppu)
     }
 }
 
+// Dots until the next point at which PPUSTATUS can change on its
+// own or an NMI can fire: vblank start and end, and on visible
+// lines the sprite 0 hit and sprite overflow checks. Sprite 0 is
+// only evaluated at dot 1, so until then a line counts as an
+// event as well. The start of the next frame always is one. The
+// dot the PPU is at has not been run yet, so it can be the event
+// itself, 0 dots away.
+uint32_t nes_ppu_dots_to_event(struct nes_ppu *ppu)
+{
+    uint32_t pos, line, event;
+
+    pos = ppu->scanline * 341 + ppu->cycle;
+    line = ppu->scanline * 341;
+
+    if (pos <= 241 * 341 + 1)
+        event = 241 * 341 + 1;
+    else if (pos <= 261 * 341 + 1)
+        event = 261 * 341 + 1;
+    else
+        event = 262 * 341;
+
+    if (ppu->scanline < 240 && (ppu->status & 0x60) != 0x60) {
+        if (ppu->cycle <= 1)
+            line += 1;
+        else if (ppu->sprite0_dot >= ppu->cycle)
+            line += ppu->sprite0_dot;
+        else if (ppu->cycle <= 257)
+            line += 257;
+        else
+            line += 341 + 1;
+
+        if (line < event)
+            event = line;
+    }
+
+    return event - pos;
+}
+
 void nes_ppu_pipeline_tick(struct nes_ppu *ppu)
 {
     switch (ppu->scanline) {
     case 0 ... 239:
-        if (ppu->cycle >= 1 && ppu->cycle <= 256)
-            nes_ppu_visible_scanline_tick(ppu);
+        if (ppu->cycle == 0 && ppu->log)
+            nes_render_log_line(ppu);
+
+        if (ppu->cycle == 1)
+            nes_ppu_sprite0_eval(ppu);
+
+        if (ppu->cycle >= 1 && ppu->cycle <= 256) {
+            if (ppu->cycle == ppu->sprite0_dot)
+                ppu->status |= 0x40;
+
+            if (!ppu->skip_render && !ppu->log)
+                nes_ppu_visible_scanline_tick(ppu);
+        }
+
+        if (ppu->cycle == 257)
+            nes_ppu_sprite_eval(ppu);
+
+        nes_ppu_scroll_tick(ppu);
+
+        // The whole picture is known once the last visible
+        // line is over
+        if (ppu->cycle == 340 && ppu->scanline == 239 && ppu->log)
+            nes_render_log_flush(ppu, 240);
         break;
     // Scanlines 240 is PPU idle, so skip it
     case 241 ... 260:
@@ -181,6 +277,7 @@ void nes_ppu_pipeline_tick(struct nes_ppu *ppu)
         break;
     case 261:
         nes_ppu_prerender_scanline_tick(ppu);
+        nes_ppu_scroll_tick(ppu);
         break;
     }
 }
@@ -202,6 +299,163 @@ void nes_ppu_visible_scanline_tick(struct nes_ppu *ppu)
         nes_ppu_backdrop_render(ppu);
 }
 
+void nes_ppu_scroll_tick(struct nes_ppu *ppu)
+{
+    uint16_t cycle, v, cy;
+
+    if (!(ppu->mask & 0x18))
+        return;
+
+    cycle = ppu->cycle;
+    v = ppu->reg.v;
+
+    // Coarse x moves on to the next tile after every 8 dots,
+    // wrapping into the horizontally adjacent nametable.
+    if ((cycle >= 8 && cycle <= 256 && !(cycle & 0x07)) ||
+        cycle == 328 || cycle == 336) {
+        if ((v & 0x001f) == 31)
+            v = (v & ~0x001f) ^ 0x0400;
+        else
+            v++;
+    }
+
+    // Fine y, then coarse y, at the end of the visible dots.
+    // Row 29 is the last one of a nametable, rows 30 and 31
+    // hold attributes and wrap without switching nametables.
+    if (cycle == 256) {
+        if ((v & 0x7000) != 0x7000) {
+            v += 0x1000;
+        } else {
+            v &= ~0x7000;
+            cy = (v & 0x03e0) >> 5;
+
+            if (cy == 29) {
+                cy = 0;
+                v ^= 0x0800;
+            } else if (cy == 31) {
+                cy = 0;
+            } else {
+                cy++;
+            }
+
+            v = (v & ~0x03e0) | (cy << 5);
+        }
+    }
+
+    // Horizontal bits are reloaded from t for the next scanline
+    if (cycle == 257)
+        v = (v & ~0x041f) | (ppu->reg.t & 0x041f);
+
+    // and the vertical bits once per frame, before rendering
+    if (ppu->scanline == 261 && cycle >= 280 && cycle <= 304)
+        v = (v & ~0x7be0) | (ppu->reg.t & 0x7be0);
+
+    ppu->reg.v = v;
+}
+
+void nes_ppu_sprite0_eval(struct nes_ppu *ppu)
+{
+    uint16_t row, height, pattern_addr, x;
+    uint8_t tile_indx, attr, pattern_lo, pattern_hi, shift;
+
+    ppu->sprite0_dot = 0;
+
+    // The hit needs both layers enabled, and is only reported
+    // once per frame.
+    if ((ppu->mask & 0x18) != 0x18 || (ppu->status & 0x40))
+        return;
+
+    // Sprites are drawn one scanline below their OAM y
+    height = (ppu->ctrl & 0x20) ? 16 : 8;
+    row = ppu->scanline - (ppu->oam[0] + 1);
+    if (row >= height)
+        return;
+
+    tile_indx = ppu->oam[1];
+    attr = ppu->oam[2];
+
+    if (attr & 0x80)
+        row = height - 1 - row;
+
+    if (height == 16) {
+        // 8x16 sprites select the pattern table with bit 0
+        // of the tile index, and use two consecutive tiles.
+        pattern_addr = ((tile_indx & 0x01) << 12) | ((tile_indx & 0xfe) << 4);
+        if (row >= 8)
+            pattern_addr += 0x10;
+    } else {
+        pattern_addr = ((ppu->ctrl & 0x08) << 9) | (tile_indx << 4);
+    }
+
+    pattern_lo = nes_ppu_read(ppu, pattern_addr + (row & 0x07));
+    pattern_hi = nes_ppu_read(ppu, pattern_addr + (row & 0x07) + 8);
+
+    // Only the pixels sprite 0 actually covers are tested,
+    // and only until the first opaque overlap is found.
+    for (int i = 0; i < 8; ++i) {
+        x = ppu->oam[3] + i;
+
+        // Never at x=255, nor in the left 8 pixels while
+        // either layer is clipped there.
+        if (x >= 255)
+            break;
+        if (x < 8 && (ppu->mask & 0x06) != 0x06)
+            continue;
+
+        shift = (attr & 0x40) ? i : 7 - i;
+        if (!(((pattern_lo >> shift) & 0x01) | ((pattern_hi >> shift) & 0x01)))
+            continue;
+
+        if (!nes_ppu_bkg_pixel(ppu, x, ppu->scanline))
+            continue;
+
+        ppu->sprite0_dot = x + 1;
+        return;
+    }
+}
+
+void nes_ppu_sprite_eval(struct nes_ppu *ppu)
+{
+    uint16_t height, row;
+    uint8_t count;
+
+    if (!(ppu->mask & 0x18))
+        return;
+
+    height = (ppu->ctrl & 0x20) ? 16 : 8;
+    count = 0;
+
+    // Only the overflow flag is observable by the CPU, so the
+    // secondary OAM itself is not built here.
+    for (int i = 0; i < 64; ++i) {
+        row = ppu->scanline - ppu->oam[i << 2];
+        if (row < height)
+            count++;
+    }
+
+    if (count > 8)
+        ppu->status |= 0x20;
+}
+
+// Background pixel index (0 is transparent) at screen coordinates
+// [x, y], without any of the palette lookups of the renderer.
+uint8_t nes_ppu_bkg_pixel(struct nes_ppu *ppu, uint16_t x, uint16_t y)
+{
+    uint16_t base_addr, pattern_addr;
+    uint8_t tile_indx, pattern_lo, pattern_hi, shift;
+
+    base_addr =  0x2000 | (ppu->ctrl & 0x03) << 0x0a;
+    tile_indx = nes_ppu_read(ppu, base_addr + ((y >> 3) << 5) + (x >> 3));
+
+    pattern_addr = ((ppu->ctrl & 0x10) << 8) + (tile_indx << 4) + (y & 0x07);
+    pattern_lo = nes_ppu_read(ppu, pattern_addr);
+    pattern_hi = nes_ppu_read(ppu, pattern_addr + 8);
+
+    shift = 7 - (x & 0x07);
+
+    return (((pattern_hi >> shift) & 0x01) << 1) | ((pattern_lo >> shift) & 0x01);
+}
+
 void nes_ppu_bkg_render(struct nes_ppu *ppu)
 {
     uint16_t tile_addr, attr_addr, palette_index, pattern_addr, pixel_index, x, y;
@@ -235,7 +489,8 @@ void nes_ppu_bkg_render(struct nes_ppu *ppu)
     x = ppu->cycle - 1;
     y = ppu->scanline;
 
-    ppu->frame_buffer[FRAME_BUFF_OFFSET(x, y)] = ppu->palette_table[rgb_index];
+    ppu->frame_buffer[FRAME_BUFF_OFFSET(x, y)] =
+        nes_palette_color(ppu->palette_table, ppu->mask, rgb_index);
 }
 
 uint16_t nes_tile_addr_calc(struct nes_ppu *ppu)
@@ -331,13 +586,14 @@ void nes_ppu_backdrop_render(struct nes_ppu *ppu)
     y = ppu->scanline;
 
 	ppu->frame_buffer[FRAME_BUFF_OFFSET(x, y)] = 
-        ppu->palette_table[ppu->palette[0] & 0x3f];
+        nes_palette_color(ppu->palette_table, ppu->mask, ppu->palette[0]);
 }
 
 void nes_ppu_prerender_scanline_tick(struct nes_ppu *ppu)
 {
+    // Clears vblank, sprite 0 hit and sprite overflow
     if (ppu->cycle == 1)
-        ppu->status &= ~0x80;
+        ppu->status &= ~0xe0;
 }
 
 void nes_ppu_vblank_scanline_tick(struct nes_ppu *ppu)
@@ -4,8 +4,10 @@
 #include <stdint.h>
 
 #include "cartridge.h"
+#include "render.h"
 
 #define FRAME_BUFF_OFFSET(x, y)   ((y) * 256 + (x))
+#define FRAME_BUFF_SZ             (256 * 240 * sizeof(uint32_t))
 
 struct nes_cart;
 
@@ -33,20 +35,63 @@ struct nes_ppu_internal_reg {
     uint8_t w;
 };
 
+// Fields are ordered by how often they are touched. The first
+// block is read or written on every dot and fits in one cache
+// line, followed by the small arrays the renderer fetches from,
+// so the frame buffer (which lives outside the struct) is the
+// only large allocation a dot ever reaches for.
 struct nes_ppu {
+    uint16_t cycle;
+    uint16_t scanline;
+
     uint8_t ctrl;
     uint8_t mask;
     uint8_t status;
-    uint8_t oam_addr;
-    uint16_t scroll;
+
+    // When set, visible dots only update the state the CPU can
+    // observe (status flags, scroll registers) and never touch
+    // the frame buffer. Meant to be toggled between frames, for
+    // fast-forward or frames that are going to be dropped.
+    uint8_t skip_render;
+
+    // Dot on the current scanline at which sprite 0 hits the
+    // background, or 0 when there is no hit on this scanline.
+    uint16_t sprite0_dot;
+
+    struct nes_ppu_internal_reg reg;
+
+    struct nes_cart *cart;
+
+    // Output colors for every palette index under each of the 8
+    // emphasis settings, see nes_palette_color()
+    const uint32_t *palette_table;
+
+    // 256x240 ARGB8888 pixels, allocated by the owner of the
+    // instance.
+    uint32_t *frame_buffer;
+
+    // Deferred rendering log, see render.h. Visible dots do not
+    // draw while one is attached.
+    struct nes_render_log *log;
+
+    // The PPU address space $0000-$3FFF in 1 KB pages, each
+    // pointing into CHR ROM/RAM or the nametable RAM below, and
+    // the pages that can be written. $3F00-$3FFF is palette RAM
+    // whatever the last page says. Built by nes_ppu_map().
+    uint8_t *pages[16];
+    uint16_t page_ram;
+
+    // Register state only touched by CPU accesses
     uint16_t vram_addr;
+    uint16_t scroll;
     uint8_t vram_data_latch;
+    uint8_t oam_addr;
     uint8_t oam_dma;
 
-    uint16_t cycle;
-    uint16_t scanline;
-
-    struct nes_ppu_internal_reg reg;
+    // The palette stores indeces into the NES color palette table defined
+    // by the hardware. The pogram can change these palette entries to
+    // change the colors displayed on screen.
+    uint8_t palette[0x020];
 
     // The OAM (Object Attribute Memory) is 256 bytes
     // used to hold sprite information (position, tile
@@ -67,60 +112,17 @@ struct nes_ppu {
     // | Nametable 2 (mirror)      | 1 KB   |
     // +---------------------------+        |
     // | Nametable 3 (mirror)      | 1 KB  /
+    // +---------------------------+ 0x3000
+    // | Mirrors of 0x2000-0x2EFF  |
     // +---------------------------+ 0x3F00
     // | Palette RAM               | 32 bytes
     // +---------------------------+ 0x3F20
     // | Palette Mirroring         | mirrors every 32 bytes
     // +---------------------------+ 0x3FFF
-    uint8_t vram[0x0800];
-    
-    // The palette stores indeces into the NES color palette table defined
-    // by the hardware. The pogram can change these palette entries to
-    // change the colors displayed on screen.
-    uint8_t palette[0x020];
-
-    uint32_t frame_buffer[256 * 240];
-
-    // Predefined NES color palette in 32-bit RGB format.
-    uint32_t *palette_table;
-
-    struct nes_cart *cart;
-};
-
-/* NES 64-color 32-bit colors RGB palette */
-static uint32_t nes_canonical_palette[64] = {
-    0xff757575, 0xff271b8f, 
-    0xff0000ab, 0xff47009f,
-    0xff8f0077, 0xffa7004e, 
-    0xffb7001e, 0xffb00000,
-    0xffa70000, 0xff7f0b00, 
-    0xff432f00, 0xff004700,
-    0xff005100, 0xff003f17, 
-    0xff1b3f5f, 0xff000000,
-    0xffbcbcbc, 0xff0073ef, 
-    0xff233bef, 0xff8300f3,
-    0xffbf00bf, 0xffe7005b, 
-    0xfff30017, 0xffef2b00,
-    0xffcb4f0f, 0xff8b7300, 
-    0xff009700, 0xff00ab00,
-    0xff00933b, 0xff00838b, 
-    0xff000000, 0xff000000,
-    0xffffffff, 0xff3fbfff, 
-    0xff5f73ff, 0xff9f3fff,
-    0xffbf3fbf, 0xffff3f8f, 
-    0xffff5f3f, 0xffff7b0f,
-    0xffef9f0f, 0xffbfbf00, 
-    0xff5fdf00, 0xff3fef5f,
-    0xff3fef9f, 0xff3fcfcf, 
-    0xff000000, 0xff000000,
-    0xffffffff, 0xffabe7ff, 
-    0xffc7d7ff, 0xffd7c7ff,
-    0xffe7c7e7, 0xffffc7cf, 
-    0xffffd7c7, 0xffffe7b7,
-    0xfffff7a3, 0xffe3ffa3, 
-    0xffc3ffb3, 0xffb3ffcf,
-    0xffb3fff3, 0xffb3e3ff, 
-    0xff000000, 0xff000000
+    //
+    // The upper 2 KB are only used by four-screen carts, which
+    // bring that much extra nametable RAM of their own.
+    uint8_t vram[0x1000];
 };
 
 uint8_t nes_ppu_reg_read(struct nes_ppu *ppu, uint16_t addr);
@@ -129,7 +131,8 @@ uint8_t nes_ppu_read(struct nes_ppu *ppu, uint16_t addr);
 uint8_t nes_palette_addr_calc(struct nes_ppu *ppu,  uint16_t addr);
 uint8_t nes_attr_palette_calc(struct nes_ppu *ppu, uint8_t attr_byte);
 
-uint16_t nes_nametable_addr_calc(struct nes_ppu *ppu,  uint16_t addr);
+void nes_ppu_map(struct nes_ppu *ppu);
+
 uint16_t nes_tile_addr_calc(struct nes_ppu *ppu);
 uint16_t nes_tile_attr_addr_calc(struct nes_ppu *ppu);
 uint16_t nes_tile_pattern_addr_calc(struct nes_ppu *ppu, uint8_t tile_index);
@@ -139,12 +142,19 @@ uint16_t nes_pattern_addr_calc(struct nes_ppu *ppu, uint8_t tile_index);
 void nes_ppu_write(struct nes_ppu *ppu, uint16_t addr, uint8_t data);
 void nes_ppu_reg_write(struct nes_ppu *ppu, uint16_t addr, uint8_t data);
 
+uint32_t nes_ppu_dots_to_event(struct nes_ppu *ppu);
+
 void nes_ppu_tick(struct nes_ppu *ppu);
 void nes_ppu_pipeline_tick(struct nes_ppu *ppu);
 void nes_ppu_visible_scanline_tick(struct nes_ppu *ppu);
 void nes_ppu_prerender_scanline_tick(struct nes_ppu *ppu);
 void nes_ppu_vblank_scanline_tick(struct nes_ppu *ppu);
 
+void nes_ppu_scroll_tick(struct nes_ppu *ppu);
+void nes_ppu_sprite0_eval(struct nes_ppu *ppu);
+void nes_ppu_sprite_eval(struct nes_ppu *ppu);
+uint8_t nes_ppu_bkg_pixel(struct nes_ppu *ppu, uint16_t x, uint16_t y);
+
 void nes_ppu_bkg_render(struct nes_ppu *ppu);
 void nes_ppu_sprite_render(struct nes_ppu *ppu);
 void nes_ppu_backdrop_render(struct nes_ppu *ppu);
@@ -0,0 +1,347 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "profile.h"
+#include "nes.h"
+
+#define NES_PROF_HASH_SIZE      (NES_PROF_NODES * 2)
+
+int nes_prof_init(struct nes_prof *prof)
+{
+    memset(prof, 0, sizeof(*prof));
+
+    prof->pc_cycles = calloc(0x10000, sizeof(*prof->pc_cycles));
+    prof->nodes = calloc(NES_PROF_NODES, sizeof(*prof->nodes));
+    prof->node_hash = calloc(NES_PROF_HASH_SIZE, sizeof(*prof->node_hash));
+
+    if (!prof->pc_cycles || !prof->nodes || !prof->node_hash) {
+        nes_prof_free(prof);
+        return -1;
+    }
+
+    // Node 0 is whatever runs outside of any call: the reset
+    // code and usually the main loop
+    prof->nodes[0].bank = NES_CART_NO_BANK;
+    prof->nodes[0].kind = NES_PROF_RESET;
+    prof->node_count = 1;
+
+    return 0;
+}
+
+void nes_prof_free(struct nes_prof *prof)
+{
+    free(prof->pc_cycles);
+    free(prof->nodes);
+    free(prof->node_hash);
+
+    memset(prof, 0, sizeof(*prof));
+}
+
+// Finds or adds the node for routine pc called from parent
+static uint32_t nes_prof_child(struct nes_prof *prof, uint32_t parent,
+                               uint16_t pc, uint8_t bank, uint8_t kind)
+{
+    struct nes_prof_node *node;
+    uint32_t h, slot;
+
+    h = (parent * 0x9e3779b1u) ^ (pc * 0x85ebca6bu) ^ (bank << 24) ^ kind;
+
+    for (slot = h & (NES_PROF_HASH_SIZE - 1); prof->node_hash[slot];
+         slot = (slot + 1) & (NES_PROF_HASH_SIZE - 1)) {
+        node = &prof->nodes[prof->node_hash[slot] - 1];
+
+        if (node->parent == parent && node->pc == pc &&
+            node->bank == bank && node->kind == kind)
+            return prof->node_hash[slot] - 1;
+    }
+
+    // Out of nodes, keep charging the caller
+    if (prof->node_count == NES_PROF_NODES) {
+        prof->lost_nodes++;
+        return parent;
+    }
+
+    node = &prof->nodes[prof->node_count];
+    node->parent = parent;
+    node->pc = pc;
+    node->bank = bank;
+    node->kind = kind;
+
+    prof->node_hash[slot] = ++prof->node_count;
+
+    return prof->node_count - 1;
+}
+
+static void nes_prof_push(struct nes_prof *prof, uint32_t node, uint8_t s)
+{
+    if (prof->depth == NES_PROF_DEPTH) {
+        prof->lost_nodes++;
+        return;
+    }
+
+    prof->stack[prof->depth] = prof->node;
+    prof->stack_s[prof->depth] = s;
+    prof->depth++;
+
+    prof->node = node;
+}
+
+static inline int nes_prof_reads_status(const uint8_t *op)
+{
+    switch (op[0]) {
+    case 0x2c:      // BIT abs
+    case 0xac:      // LDY abs
+    case 0xad:      // LDA abs
+    case 0xae:      // LDX abs
+        return ((op[1] | (op[2] << 8)) & 0xe007) == 0x2002;
+    default:
+        return 0;
+    }
+}
+
+static inline int nes_prof_is_branch(uint8_t op)
+{
+    return (op & 0x1f) == 0x10;
+}
+
+// Charges the previous instruction, which ran in prof->node
+static void nes_prof_charge(struct nes_prof *prof, uint32_t cycles)
+{
+    struct nes_prof_node *node = &prof->nodes[prof->node];
+
+    prof->pc_cycles[prof->last_pc] += cycles;
+    prof->bank_cycles[prof->last_bank] += cycles;
+    prof->total += cycles;
+    prof->frame_cycles += cycles;
+    node->self += cycles;
+
+    if (prof->poll_active) {
+        node->poll += cycles;
+        prof->poll_total += cycles;
+        prof->frame_poll += cycles;
+    }
+}
+
+// Called by the CPU before executing the instruction at cpu->pc,
+// with the opcode and the two bytes following it.
+void nes_prof_instr(struct nes_prof *prof, struct nes_bus *bus,
+                    const uint8_t *op)
+{
+    struct cpu_6502 *cpu = bus->hooks->cpu;
+    uint16_t pc = cpu->pc;
+    uint8_t bank = nes_cart_prg_bank(bus->cart, pc);
+
+    if (prof->have_last) {
+        nes_prof_charge(prof, (prof->pending_irq ? prof->pending_cycles :
+                               cpu->cycles) - prof->last_cycles);
+
+        switch (prof->last_op[0]) {
+        case 0x20:  // JSR
+            nes_prof_push(prof, nes_prof_child(prof, prof->node, pc, bank,
+                                               NES_PROF_ROUTINE),
+                          prof->last_s);
+            break;
+        case 0x40:  // RTI
+        case 0x60:  // RTS
+            // Every frame entered at or below the stack pointer
+            // is gone, which also copes with code that drops
+            // return addresses and returns to a caller further up.
+            while (prof->depth && prof->stack_s[prof->depth - 1] <= cpu->s)
+                prof->node = prof->stack[--prof->depth];
+            break;
+        }
+
+        // A PPUSTATUS read that the branch after it keeps coming
+        // back to
+        if (nes_prof_is_branch(prof->last_op[0]) &&
+            prof->last_pc == pc + 3 && nes_prof_reads_status(op)) {
+            prof->poll_active = 1;
+            prof->poll_pc = pc;
+        } else if (prof->poll_active && pc != prof->poll_pc &&
+                   pc != prof->poll_pc + 3) {
+            prof->poll_active = 0;
+        }
+    }
+
+    if (prof->pending_irq) {
+        nes_prof_push(prof, nes_prof_child(prof, prof->node, pc, bank,
+                                           prof->pending_irq),
+                      prof->pending_s);
+        prof->pending_irq = 0;
+        prof->poll_active = 0;
+
+        // The interrupt sequence itself goes to the handler
+        prof->last_pc = pc;
+        prof->last_bank = bank;
+        nes_prof_charge(prof, cpu->cycles - prof->pending_cycles);
+    }
+
+    prof->last_cycles = cpu->cycles;
+    prof->last_pc = pc;
+    prof->last_s = cpu->s;
+    prof->last_bank = bank;
+    memcpy(prof->last_op, op, sizeof(prof->last_op));
+    prof->have_last = 1;
+}
+
+// Called by the CPU when it takes an interrupt, before pushing
+// the return address. The handler's first instruction opens a
+// new frame.
+void nes_prof_interrupt(struct nes_prof *prof, struct nes_bus *bus,
+                        uint8_t kind)
+{
+    prof->pending_irq = kind;
+    prof->pending_s = bus->hooks->cpu->s;
+    prof->pending_cycles = bus->hooks->cpu->cycles;
+}
+
+void nes_prof_frame(struct nes_prof *prof, uint32_t frame)
+{
+    struct nes_prof_frame *f;
+
+    f = &prof->frames[prof->frame_count++ % NES_PROF_FRAMES];
+    f->frame = frame;
+    f->cycles = prof->frame_cycles;
+    f->poll = prof->frame_poll;
+
+    prof->frame_cycles = 0;
+    prof->frame_poll = 0;
+}
+
+static int nes_prof_name(const struct nes_prof_node *node, char *buf,
+                         size_t len)
+{
+    switch (node->kind) {
+    case NES_PROF_RESET:
+        return snprintf(buf, len, "reset");
+    case NES_PROF_NMI:
+        return snprintf(buf, len, "NMI $%04X", node->pc);
+    case NES_PROF_IRQ:
+        return snprintf(buf, len, "IRQ $%04X", node->pc);
+    default:
+        if (node->bank == NES_CART_NO_BANK)
+            return snprintf(buf, len, "$%04X", node->pc);
+        return snprintf(buf, len, "$%02X:%04X", node->bank, node->pc);
+    }
+}
+
+// Writes one line per calling context, "caller;callee cycles",
+// the input format of flamegraph.pl and most flame graph viewers.
+int nes_prof_dump_folded(struct nes_prof *prof, const char *name)
+{
+    uint32_t chain[NES_PROF_DEPTH + 2];
+    char path[(NES_PROF_DEPTH + 2) * 16];
+    struct nes_prof_node *node;
+    uint64_t self;
+    int depth, len;
+    FILE *fp;
+
+    fp = fopen(name, "w");
+    if (!fp)
+        return -1;
+
+    for (uint32_t i = 0; i < prof->node_count; ++i) {
+        node = &prof->nodes[i];
+        if (!node->self)
+            continue;
+
+        // Walk up to the root, then print top down
+        depth = 0;
+        for (uint32_t n = i; ; n = prof->nodes[n].parent) {
+            chain[depth++] = n;
+            if (!n || depth == NES_PROF_DEPTH + 2)
+                break;
+        }
+
+        len = 0;
+        while (depth--) {
+            len += nes_prof_name(&prof->nodes[chain[depth]], path + len,
+                                 sizeof(path) - len);
+            if (depth)
+                path[len++] = ';';
+        }
+
+        self = node->self - node->poll;
+        if (self)
+            fprintf(fp, "%s %llu\n", path, (unsigned long long)self);
+        if (node->poll)
+            fprintf(fp, "%s;[$2002 poll] %llu\n", path,
+                    (unsigned long long)node->poll);
+    }
+
+    return fclose(fp) ? -1 : 0;
+}
+
+struct nes_prof_pc {
+    uint64_t cycles;
+    uint16_t pc;
+};
+
+static int nes_prof_pc_cmp(const void *a, const void *b)
+{
+    uint64_t x = ((const struct nes_prof_pc *)a)->cycles;
+    uint64_t y = ((const struct nes_prof_pc *)b)->cycles;
+
+    return (x < y) - (x > y);
+}
+
+void nes_prof_report(struct nes_prof *prof, FILE *fp, int top)
+{
+    uint64_t frames, cycles = 0, poll = 0, worst = 0;
+    uint32_t worst_frame = 0;
+    struct nes_prof_pc *pcs;
+    int count = 0;
+
+    frames = prof->frame_count < NES_PROF_FRAMES ?
+             prof->frame_count : NES_PROF_FRAMES;
+
+    for (uint64_t i = 0; i < frames; ++i) {
+        cycles += prof->frames[i].cycles;
+        poll += prof->frames[i].poll;
+
+        if (prof->frames[i].cycles - prof->frames[i].poll > worst) {
+            worst = prof->frames[i].cycles - prof->frames[i].poll;
+            worst_frame = prof->frames[i].frame;
+        }
+    }
+
+    fprintf(fp, "profile: %llu cycles, %.1f%% polling $2002, %u routines\n",
+            (unsigned long long)prof->total,
+            prof->total ? 100.0 * prof->poll_total / prof->total : 0.0,
+            prof->node_count);
+
+    if (frames)
+        fprintf(fp, "last %llu frames: %.0f cycles/frame, %.0f busy, "
+                "busiest frame %u (%llu cycles)\n",
+                (unsigned long long)frames, (double)cycles / frames,
+                (double)(cycles - poll) / frames, worst_frame,
+                (unsigned long long)worst);
+
+    for (int i = 0; i < 256; ++i) {
+        if (prof->bank_cycles[i] && i != NES_CART_NO_BANK)
+            fprintf(fp, "  bank %02X: %5.1f%%\n", i,
+                    100.0 * prof->bank_cycles[i] / prof->total);
+    }
+
+    pcs = malloc(0x10000 * sizeof(*pcs));
+    if (!pcs)
+        return;
+
+    for (int pc = 0; pc < 0x10000; ++pc) {
+        if (!prof->pc_cycles[pc])
+            continue;
+
+        pcs[count].cycles = prof->pc_cycles[pc];
+        pcs[count].pc = pc;
+        count++;
+    }
+
+    qsort(pcs, count, sizeof(*pcs), nes_prof_pc_cmp);
+
+    for (int i = 0; i < count && i < top; ++i)
+        fprintf(fp, "  $%04X %12llu %5.1f%%\n", pcs[i].pc,
+                (unsigned long long)pcs[i].cycles,
+                100.0 * pcs[i].cycles / prof->total);
+
+    free(pcs);
+}
@@ -0,0 +1,100 @@
+#ifndef NES_PROFILE_HEADER
+#define NES_PROFILE_HEADER
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define NES_PROF_NODES          16384
+#define NES_PROF_DEPTH          64
+#define NES_PROF_FRAMES         4096
+
+// Node kinds, NMI and IRQ also for nes_prof_interrupt()
+#define NES_PROF_ROUTINE        0
+#define NES_PROF_NMI            1
+#define NES_PROF_IRQ            2
+#define NES_PROF_RESET          3
+
+struct nes_bus;
+
+// A node of the calling context tree: one routine (or interrupt
+// handler) as reached through one particular chain of callers.
+struct nes_prof_node {
+    uint32_t parent;
+    uint16_t pc;
+    uint8_t bank;
+    uint8_t kind;
+
+    // Cycles spent in the routine itself, and the part of them
+    // spent spinning on $2002
+    uint64_t self;
+    uint64_t poll;
+};
+
+struct nes_prof_frame {
+    uint32_t frame;
+    uint32_t cycles;
+    uint32_t poll;
+};
+
+// Counting profiler for guest code. The CPU reports every
+// instruction through nes_prof_instr(), and the cycles each one
+// took are charged to its PC, its PRG bank and the routine on top
+// of a call stack rebuilt from JSR/RTS and interrupts.
+//
+// Short loops that read PPUSTATUS until a flag changes
+// (LDA/BIT $2002 followed by a branch back to it) are accounted
+// separately, so waiting for the PPU does not hide the routines
+// that do the actual work of a frame.
+struct nes_prof {
+    uint64_t *pc_cycles;
+    uint64_t bank_cycles[256];
+
+    struct nes_prof_node *nodes;
+    uint32_t node_count;
+    uint32_t *node_hash;
+
+    // Shadow call stack: node and stack pointer at entry
+    uint32_t stack[NES_PROF_DEPTH];
+    uint8_t stack_s[NES_PROF_DEPTH];
+    int depth;
+    uint32_t node;
+
+    // Instruction seen last, charged once the next one shows up
+    // and the cycles it took are known
+    uint64_t last_cycles;
+    uint64_t pending_cycles;
+    uint16_t last_pc;
+    uint8_t last_op[3];
+    uint8_t last_s;
+    uint8_t last_bank;
+    uint8_t have_last;
+    uint8_t pending_irq;
+    uint8_t pending_s;
+
+    // PPUSTATUS read of the polling loop being executed
+    uint16_t poll_pc;
+    uint8_t poll_active;
+
+    uint32_t frame_cycles;
+    uint32_t frame_poll;
+    struct nes_prof_frame frames[NES_PROF_FRAMES];
+    uint64_t frame_count;
+
+    uint64_t total;
+    uint64_t poll_total;
+    uint64_t lost_nodes;
+};
+
+int nes_prof_init(struct nes_prof *prof);
+void nes_prof_free(struct nes_prof *prof);
+
+void nes_prof_instr(struct nes_prof *prof, struct nes_bus *bus,
+                    const uint8_t *op);
+void nes_prof_interrupt(struct nes_prof *prof, struct nes_bus *bus,
+                        uint8_t kind);
+void nes_prof_frame(struct nes_prof *prof, uint32_t frame);
+
+int nes_prof_dump_folded(struct nes_prof *prof, const char *name);
+void nes_prof_report(struct nes_prof *prof, FILE *fp, int top);
+
+#endif
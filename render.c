@@ -0,0 +1,354 @@
+#include <string.h>
+
+#include "render.h"
+#include "ppu.h"
+#include "palette.h"
+#include "pool.h"
+
+struct nes_render_job {
+    const struct nes_ppu *ppu;
+    const struct nes_render_log *log;
+    uint8_t *vram;
+    uint8_t *chr;
+
+    // The PPU pages, moved into the copies above when taken
+    const uint8_t *pattern[8];
+    const uint8_t *nametable[4];
+
+    // Index of the first event of every line, and one past the last
+    int row_event[241];
+
+    int base;
+};
+
+void nes_render_log_init(struct nes_render_log *log, struct nes_pool *pool)
+{
+    memset(log, 0, sizeof(*log));
+
+    log->pool = pool;
+    log->first = -1;
+}
+
+void nes_render_log_attach(struct nes_render_log *log, struct nes_ppu *ppu)
+{
+    log->first = -1;
+    log->drawn = 0;
+    log->count = 0;
+    log->copied = 0;
+    log->chr_copied = 0;
+
+    ppu->log = log;
+}
+
+void nes_render_log_detach(struct nes_ppu *ppu)
+{
+    ppu->log = NULL;
+}
+
+// Called at dot 0 of every visible line
+void nes_render_log_line(struct nes_ppu *ppu)
+{
+    struct nes_render_log *log = ppu->log;
+    struct nes_render_line *line = &log->lines[ppu->scanline];
+
+    if (log->first < 0)
+        log->first = ppu->scanline;
+
+    line->ctrl = ppu->ctrl;
+    line->mask = ppu->mask;
+    memcpy(line->palette, ppu->palette, sizeof(line->palette));
+}
+
+// Called before the write is applied, while on a visible line
+void nes_render_log_event(struct nes_ppu *ppu, uint8_t kind, uint16_t addr,
+                          uint8_t data)
+{
+    struct nes_render_log *log = ppu->log;
+    struct nes_render_event *ev;
+    uint16_t x, y;
+
+    if (log->first < 0 || ppu->skip_render)
+        return;
+
+    // A write before dot n is seen by the pixel of dot n
+    x = ppu->cycle ? ppu->cycle - 1 : 0;
+    if (x > 256)
+        x = 256;
+
+    // Register writes after the last pixel are picked up by the
+    // next line's snapshot
+    if (kind != NES_RENDER_VRAM && kind != NES_RENDER_CHR && x == 256)
+        return;
+
+    // The line was drawn early by nes_ppu_map(), which only
+    // happens after its last pixel, so the write belongs to the
+    // start of the next one
+    y = ppu->scanline;
+    if (y < log->first) {
+        y = log->first;
+        x = 0;
+    }
+
+    if (kind == NES_RENDER_VRAM && !log->copied) {
+        memcpy(log->vram, ppu->vram, sizeof(log->vram));
+        log->copied = 1;
+    }
+
+    if (kind == NES_RENDER_CHR && !log->chr_copied) {
+        memcpy(log->chr, ppu->cart->chr_rom, sizeof(log->chr));
+        log->chr_copied = 1;
+    }
+
+    if (log->count == NES_RENDER_EVENTS) {
+        nes_render_log_flush(ppu, y);
+        log->flushes++;
+    }
+
+    // All of them on this line, draw it as far as it got
+    if (log->count == NES_RENDER_EVENTS)
+        nes_render_log_split(ppu, y, x);
+
+    ev = &log->events[log->count++];
+    ev->x = x;
+    ev->y = y;
+    ev->kind = kind;
+    ev->addr = addr;
+    ev->data = data;
+}
+
+// Draws pixels [x0, x1) of line y, with the same results as the
+// per-dot renderer, a tile at a time.
+static void nes_render_span(const struct nes_render_job *job,
+                            const struct nes_render_line *st, int y,
+                            int x0, int x1)
+{
+    const struct nes_ppu *ppu = job->ppu;
+    uint32_t *dst = ppu->frame_buffer + FRAME_BUFF_OFFSET(0, y);
+    const uint8_t *nametable, *chr;
+    uint16_t pattern;
+    uint8_t tile, attr, pal, lo, hi, pix, shift;
+    const uint32_t *lut;
+    uint32_t backdrop;
+    uint8_t grey;
+    int x, end;
+
+    // Emphasis picks the block of the table, greyscale masks the
+    // index, both once for the span
+    lut = ppu->palette_table + ((st->mask & 0xe0) << 1);
+    grey = (st->mask & 0x01) ? 0x30 : 0x3f;
+
+    // The sprite layer is not drawn yet, and with either layer
+    // off the per-dot renderer ends up showing the backdrop.
+    if ((st->mask & 0x18) != 0x18) {
+        backdrop = lut[st->palette[0] & grey];
+
+        for (x = x0; x < x1; ++x)
+            dst[x] = backdrop;
+        return;
+    }
+
+    // A line never fetches past the nametable it starts in
+    nametable = job->nametable[st->ctrl & 0x03];
+
+    for (x = x0; x < x1; x = end) {
+        end = (x | 0x07) + 1;
+        if (end > x1)
+            end = x1;
+
+        tile = nametable[((y >> 3) << 5) + (x >> 3)];
+        attr = nametable[0x03c0 + ((y >> 5) << 3) + (x >> 5)];
+        pal = (attr >> (((((x >> 4) & 0x01) | ((y >> 4) & 0x01) << 1)) << 1)) & 0x03;
+
+        pattern = ((st->ctrl & 0x10) << 8) + (tile << 4) + (y & 0x07);
+        chr = job->pattern[pattern >> 10];
+        lo = chr[pattern & 0x3ff];
+        hi = chr[(pattern & 0x3ff) + 8];
+
+        for (int i = x; i < end; ++i) {
+            shift = 7 - (i & 0x07);
+            pix = (((hi >> shift) & 0x01) << 1) | ((lo >> shift) & 0x01);
+
+            if (pix)
+                dst[i] = lut[st->palette[((pal << 2) | pix) & 0x3f] & grey];
+            else
+                dst[i] = lut[st->palette[0] & grey];
+        }
+    }
+}
+
+// Draws pixels [x, x1) of line y from the state st, applying the
+// line's events to it on the way.
+static void nes_render_row_span(struct nes_render_job *job,
+                                struct nes_render_line *st, int y,
+                                int x, int x1)
+{
+    const struct nes_render_event *ev;
+
+    for (int i = job->row_event[y]; i < job->row_event[y + 1]; ++i) {
+        ev = &job->log->events[i];
+
+        if (ev->x > x) {
+            nes_render_span(job, st, y, x, ev->x);
+            x = ev->x;
+        }
+
+        switch (ev->kind) {
+        case NES_RENDER_CTRL:
+            st->ctrl = ev->data;
+            break;
+        case NES_RENDER_MASK:
+            st->mask = ev->data;
+            break;
+        case NES_RENDER_PALETTE:
+            st->palette[ev->addr] = ev->data;
+            break;
+        case NES_RENDER_VRAM:
+            job->vram[ev->addr] = ev->data;
+            break;
+        case NES_RENDER_CHR:
+            job->chr[ev->addr] = ev->data;
+            break;
+        }
+    }
+
+    if (x < x1)
+        nes_render_span(job, st, y, x, x1);
+}
+
+// Nametable and CHR RAM writes update job->vram and job->chr, so
+// lines holding them must not run in parallel with any other.
+static void nes_render_row(struct nes_render_job *job, int y)
+{
+    struct nes_render_line st = job->log->lines[y];
+
+    nes_render_row_span(job, &st, y,
+                        y == job->log->first ? job->log->drawn : 0, 256);
+}
+
+static void nes_render_rows(void *arg, int start, int end)
+{
+    struct nes_render_job *job = arg;
+
+    for (int y = start; y < end; ++y)
+        nes_render_row(job, job->base + y);
+}
+
+static void nes_render_segment(struct nes_render_job *job, int start, int end)
+{
+    struct nes_pool *pool = job->log->pool;
+
+    if (end <= start)
+        return;
+
+    job->base = start;
+
+    if (pool && end - start > 1)
+        nes_pool_run(pool, nes_render_rows, job, end - start, 8);
+    else
+        nes_render_rows(job, 0, end - start);
+}
+
+static void nes_render_job_init(struct nes_render_job *job,
+                                struct nes_ppu *ppu)
+{
+    struct nes_render_log *log = ppu->log;
+    int y, i;
+
+    job->ppu = ppu;
+    job->log = log;
+    job->vram = log->copied ? log->vram : ppu->vram;
+    job->chr = log->chr_copied ? log->chr : ppu->cart->chr_rom;
+
+    for (i = 0; i < 8; ++i)
+        job->pattern[i] = ppu->cart->chr_ram ?
+            job->chr + (ppu->pages[i] - ppu->cart->chr_rom) : ppu->pages[i];
+
+    for (i = 0; i < 4; ++i)
+        job->nametable[i] = job->vram + (ppu->pages[8 + i] - ppu->vram);
+
+    // Events are logged in time order, so already sorted by line
+    for (y = 0, i = 0; y <= 240; ++y) {
+        while (i < log->count && log->events[i].y < y)
+            ++i;
+        job->row_event[y] = i;
+    }
+}
+
+// Draws the first x pixels of line y, the only line left in a
+// full log, and restarts the line's log from there: its snapshot
+// becomes the state at x and the events are dropped.
+void nes_render_log_split(struct nes_ppu *ppu, int y, int x)
+{
+    struct nes_render_log *log = ppu->log;
+    struct nes_render_job job;
+
+    nes_render_job_init(&job, ppu);
+    nes_render_row_span(&job, &log->lines[y], y, log->drawn, x);
+
+    log->drawn = x;
+    log->count = 0;
+}
+
+// Draws the logged lines before end, and forgets about them
+void nes_render_log_flush(struct nes_ppu *ppu, int end)
+{
+    struct nes_render_log *log = ppu->log;
+    struct nes_render_job job;
+    int y, i, kept, start;
+
+    if (log->first < 0)
+        return;
+
+    // Dropped frames are logged all the same, but not drawn
+    if (ppu->skip_render)
+        goto done;
+
+    nes_render_job_init(&job, ppu);
+
+    start = log->first;
+
+    if (log->copied || log->chr_copied) {
+        // Lines with nametable or CHR writes are drawn on their
+        // own, the ones in between in parallel
+        for (y = start; y < end; ++y) {
+            for (i = job.row_event[y]; i < job.row_event[y + 1]; ++i) {
+                if (log->events[i].kind == NES_RENDER_VRAM ||
+                    log->events[i].kind == NES_RENDER_CHR)
+                    break;
+            }
+
+            if (i == job.row_event[y + 1])
+                continue;
+
+            nes_render_segment(&job, start, y);
+            nes_render_row(&job, y);
+            start = y + 1;
+        }
+    }
+
+    nes_render_segment(&job, start, end);
+
+done:
+    if (end >= 240) {
+        log->first = -1;
+        log->drawn = 0;
+        log->count = 0;
+        log->copied = 0;
+        log->chr_copied = 0;
+        return;
+    }
+
+    // Keep the events of the lines not drawn yet
+    for (i = 0; i < log->count && log->events[i].y < end; ++i)
+        ;
+
+    kept = log->count - i;
+    memmove(log->events, log->events + i, kept * sizeof(*log->events));
+
+    log->count = kept;
+
+    if (end > log->first) {
+        log->first = end;
+        log->drawn = 0;
+    }
+}
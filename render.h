@@ -0,0 +1,86 @@
+#ifndef NES_RENDER_HEADER
+#define NES_RENDER_HEADER
+
+#include <stdint.h>
+
+#define NES_RENDER_EVENTS       2048
+
+// Kinds of logged writes
+#define NES_RENDER_CTRL         0
+#define NES_RENDER_MASK         1
+#define NES_RENDER_PALETTE      2
+#define NES_RENDER_VRAM         3
+#define NES_RENDER_CHR          4
+
+struct nes_ppu;
+struct nes_pool;
+
+// Registers the background renderer depends on, as they were at
+// the start of a scanline
+struct nes_render_line {
+    uint8_t ctrl;
+    uint8_t mask;
+    uint8_t palette[0x20];
+};
+
+// A write made while a visible scanline was being drawn. x is
+// the first pixel it affects, 256 when the line was already done.
+struct nes_render_event {
+    uint16_t x;
+    uint8_t y;
+    uint8_t kind;
+    uint16_t addr;
+    uint8_t data;
+};
+
+// Deferred rendering. While attached through ppu.log, visible
+// dots only do the work the CPU can observe (status flags, sprite
+// 0, scroll registers). The registers in effect on each scanline
+// and the writes made in between are logged instead, and the 240
+// lines are drawn after the last dot of line 239, in parallel on
+// the pool.
+//
+// Writes to the nametables or CHR RAM during the visible lines
+// split the frame: the lines between such writes are drawn in
+// parallel from a copy of that memory, which is brought up to date
+// line by line. A copy is only taken once the first such write
+// happens. The PPU page table is taken as it is at flush time,
+// nes_ppu_map() flushes before changing it.
+struct nes_render_log {
+    struct nes_pool *pool;
+
+    // First line logged this frame, -1 before the next line 0
+    // once attached
+    int first;
+
+    // Pixels of line first already drawn, when a full log had to
+    // be split in the middle of it
+    int drawn;
+
+    int count;
+    uint8_t copied;
+    uint8_t chr_copied;
+
+    // Times the event log filled up and the lines logged so far
+    // had to be drawn early
+    uint64_t flushes;
+
+    struct nes_render_line lines[240];
+    struct nes_render_event events[NES_RENDER_EVENTS];
+
+    uint8_t vram[0x1000];
+    uint8_t chr[0x2000];
+};
+
+void nes_render_log_init(struct nes_render_log *log, struct nes_pool *pool);
+
+void nes_render_log_attach(struct nes_render_log *log, struct nes_ppu *ppu);
+void nes_render_log_detach(struct nes_ppu *ppu);
+
+void nes_render_log_line(struct nes_ppu *ppu);
+void nes_render_log_event(struct nes_ppu *ppu, uint8_t kind, uint16_t addr,
+                          uint8_t data);
+void nes_render_log_flush(struct nes_ppu *ppu, int end);
+void nes_render_log_split(struct nes_ppu *ppu, int y, int x);
+
+#endif
@@ -0,0 +1,115 @@
+#include <string.h>
+
+#include "savestate.h"
+#include "hash.h"
+#include "nes.h"
+
+void nes_state_save(struct nes_emu *nes, struct nes_savestate *st)
+{
+    struct nes_ppu *ppu = &nes->ppu;
+
+    // Zero padding bytes as well, so identical machine states
+    // always produce identical blobs (and hashes).
+    memset(st, 0, sizeof(*st));
+
+    st->version = NES_SAVESTATE_VERSION;
+    st->frame = nes->frame;
+    memcpy(&st->cpu, &nes->cpu, sizeof(st->cpu));
+
+    st->ppu.ctrl = ppu->ctrl;
+    st->ppu.mask = ppu->mask;
+    st->ppu.status = ppu->status;
+    st->ppu.oam_addr = ppu->oam_addr;
+    st->ppu.scroll = ppu->scroll;
+    st->ppu.vram_addr = ppu->vram_addr;
+    st->ppu.vram_data_latch = ppu->vram_data_latch;
+    st->ppu.oam_dma = ppu->oam_dma;
+    st->ppu.cycle = ppu->cycle;
+    st->ppu.scanline = ppu->scanline;
+    st->ppu.v = ppu->reg.v;
+    st->ppu.t = ppu->reg.t;
+    st->ppu.x = ppu->reg.x;
+    st->ppu.w = ppu->reg.w;
+
+    memcpy(st->cart.chr_banks, nes->cart.chr_banks,
+           sizeof(st->cart.chr_banks));
+    st->cart.mirroring = nes->cart.mirroring;
+
+    memcpy(st->pads, nes->pads, sizeof(st->pads));
+    memcpy(st->oam, ppu->oam, sizeof(st->oam));
+    memcpy(st->vram, ppu->vram, sizeof(st->vram));
+    memcpy(st->palette, ppu->palette, sizeof(st->palette));
+    memcpy(st->ram, nes->ram, sizeof(st->ram));
+
+    if (nes->cart.prg_ram)
+        memcpy(st->prg_ram, nes->cart.prg_ram, sizeof(st->prg_ram));
+
+    if (nes->cart.chr_ram)
+        memcpy(st->chr_ram, nes->cart.chr_rom, sizeof(st->chr_ram));
+}
+
+int nes_state_load(struct nes_emu *nes, const struct nes_savestate *st)
+{
+    struct nes_ppu *ppu = &nes->ppu;
+
+    if (st->version != NES_SAVESTATE_VERSION ||
+        st->cart.mirroring > NES_MIRROR_SINGLE_HIGH)
+        return -1;
+
+    nes->frame = st->frame;
+    nes->cpu = st->cpu;
+
+    ppu->ctrl = st->ppu.ctrl;
+    ppu->mask = st->ppu.mask;
+    ppu->status = st->ppu.status;
+    ppu->oam_addr = st->ppu.oam_addr;
+    ppu->scroll = st->ppu.scroll;
+    ppu->vram_addr = st->ppu.vram_addr;
+    ppu->vram_data_latch = st->ppu.vram_data_latch;
+    ppu->oam_dma = st->ppu.oam_dma;
+    ppu->cycle = st->ppu.cycle;
+    ppu->scanline = st->ppu.scanline;
+    ppu->reg.v = st->ppu.v;
+    ppu->reg.t = st->ppu.t;
+    ppu->reg.x = st->ppu.x;
+    ppu->reg.w = st->ppu.w;
+
+    memcpy(nes->cart.chr_banks, st->cart.chr_banks,
+           sizeof(nes->cart.chr_banks));
+    nes->cart.mirroring = st->cart.mirroring;
+
+    memcpy(nes->pads, st->pads, sizeof(st->pads));
+    memcpy(ppu->oam, st->oam, sizeof(st->oam));
+    memcpy(ppu->vram, st->vram, sizeof(st->vram));
+    memcpy(ppu->palette, st->palette, sizeof(st->palette));
+    memcpy(nes->ram, st->ram, sizeof(st->ram));
+
+    if (nes->cart.prg_ram)
+        memcpy(nes->cart.prg_ram, st->prg_ram, sizeof(st->prg_ram));
+
+    if (nes->cart.chr_ram)
+        memcpy(nes->cart.chr_rom, st->chr_ram, sizeof(st->chr_ram));
+
+    // Lines logged before belong to the abandoned timeline, the
+    // log starts over with the next frame
+    if (ppu->log)
+        nes_render_log_attach(ppu->log, ppu);
+
+    nes_ppu_map(ppu);
+
+    return 0;
+}
+
+uint32_t nes_state_crc32(const struct nes_savestate *st)
+{
+    return nes_crc32(0, st, sizeof(*st));
+}
+
+uint32_t nes_state_hash(struct nes_emu *nes)
+{
+    struct nes_savestate st;
+
+    nes_state_save(nes, &st);
+
+    return nes_state_crc32(&st);
+}
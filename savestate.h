@@ -0,0 +1,62 @@
+#ifndef NES_SAVESTATE_HEADER
+#define NES_SAVESTATE_HEADER
+
+#include <stdint.h>
+
+#include "controller.h"
+#include "cpu.h"
+
+#define NES_SAVESTATE_VERSION   3
+
+struct nes_emu;
+
+// A snapshot of everything that affects future emulation. The
+// frame buffer is output only and is deliberately left out, as
+// are the ROMs which never change. Pointers are never stored so
+// the blob can be written to disk and loaded into any instance
+// running the same cartridge.
+struct nes_savestate {
+    uint32_t version;
+    uint32_t frame;
+
+    struct cpu_6502 cpu;
+
+    struct {
+        uint8_t ctrl;
+        uint8_t mask;
+        uint8_t status;
+        uint8_t oam_addr;
+        uint16_t scroll;
+        uint16_t vram_addr;
+        uint8_t vram_data_latch;
+        uint8_t oam_dma;
+        uint16_t cycle;
+        uint16_t scanline;
+        uint16_t v;
+        uint16_t t;
+        uint16_t x;
+        uint8_t w;
+    } ppu;
+
+    struct {
+        uint16_t chr_banks[8];
+        uint8_t mirroring;
+    } cart;
+
+    struct nes_controller pads[2];
+
+    uint8_t oam[0x0100];
+    uint8_t vram[0x1000];
+    uint8_t palette[0x020];
+    uint8_t ram[0x0800];
+    uint8_t prg_ram[0x2000];
+    uint8_t chr_ram[0x2000];
+};
+
+void nes_state_save(struct nes_emu *nes, struct nes_savestate *st);
+int nes_state_load(struct nes_emu *nes, const struct nes_savestate *st);
+
+uint32_t nes_state_crc32(const struct nes_savestate *st);
+uint32_t nes_state_hash(struct nes_emu *nes);
+
+#endif
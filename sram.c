@@ -0,0 +1,162 @@
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "sram.h"
+
+static void *nes_sram_thread(void *arg)
+{
+    struct nes_sram *sram = arg;
+    struct timespec deadline;
+
+    pthread_mutex_lock(&sram->lock);
+
+    while (!sram->stop) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += NES_SRAM_FLUSH_MS / 1000;
+        deadline.tv_nsec += (NES_SRAM_FLUSH_MS % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        while (!sram->stop &&
+               pthread_cond_timedwait(&sram->cond, &sram->lock,
+                                      &deadline) == 0)
+            ;
+
+        if (sram->stop)
+            break;
+
+        // Clean pages cost nothing to sync, so there is no point
+        // in tracking guest writes on the emulation side.
+        pthread_mutex_unlock(&sram->lock);
+        nes_sram_sync(sram);
+        pthread_mutex_lock(&sram->lock);
+    }
+
+    pthread_mutex_unlock(&sram->lock);
+
+    return NULL;
+}
+
+// Maps size bytes of the save file, creating it (zero filled)
+// if needed. An existing file keeps its contents.
+int nes_sram_open(struct nes_sram *sram, const char *name, size_t size)
+{
+    pthread_condattr_t attr;
+    struct stat st;
+
+    memset(sram, 0, sizeof(*sram));
+    sram->fd = -1;
+
+    sram->fd = open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (sram->fd < 0)
+        goto err;
+
+    if (fstat(sram->fd, &st))
+        goto err;
+
+    // Pages past the end of the file would fault on access
+    if ((size_t)st.st_size < size && ftruncate(sram->fd, size))
+        goto err;
+
+    sram->data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      sram->fd, 0);
+    if (sram->data == MAP_FAILED) {
+        sram->data = NULL;
+        goto err;
+    }
+
+    sram->size = size;
+
+    pthread_mutex_init(&sram->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&sram->cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if (pthread_create(&sram->thread, NULL, nes_sram_thread, sram)) {
+        pthread_cond_destroy(&sram->cond);
+        pthread_mutex_destroy(&sram->lock);
+        goto err;
+    }
+
+    return 0;
+
+err:
+    if (sram->data)
+        munmap(sram->data, size);
+    if (sram->fd >= 0)
+        close(sram->fd);
+
+    memset(sram, 0, sizeof(*sram));
+    sram->fd = -1;
+
+    return -1;
+}
+
+// Writes dirty pages back and waits for them to reach the disk
+int nes_sram_sync(struct nes_sram *sram)
+{
+    if (msync(sram->data, sram->size, MS_SYNC)) {
+        __atomic_add_fetch(&sram->errors, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+
+    __atomic_add_fetch(&sram->flushes, 1, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+// Stops the flush thread and syncs one last time. Returns -1 if
+// that final sync failed, the mapping is released either way.
+int nes_sram_close(struct nes_sram *sram)
+{
+    int ret;
+
+    if (!sram->data)
+        return 0;
+
+    pthread_mutex_lock(&sram->lock);
+    sram->stop = 1;
+    pthread_cond_signal(&sram->cond);
+    pthread_mutex_unlock(&sram->lock);
+
+    pthread_join(sram->thread, NULL);
+
+    pthread_cond_destroy(&sram->cond);
+    pthread_mutex_destroy(&sram->lock);
+
+    ret = nes_sram_sync(sram);
+
+    munmap(sram->data, sram->size);
+    close(sram->fd);
+
+    sram->data = NULL;
+    sram->fd = -1;
+
+    return ret;
+}
+
+// Save file name for a ROM: the extension replaced by .sav
+int nes_sram_name(const char *rom, char *buf, size_t len)
+{
+    const char *dot, *slash;
+    size_t stem;
+
+    dot = strrchr(rom, '.');
+    slash = strrchr(rom, '/');
+
+    stem = (dot && (!slash || dot > slash)) ? (size_t)(dot - rom) :
+                                              strlen(rom);
+
+    if (snprintf(buf, len, "%.*s.sav", (int)stem, rom) >= (int)len)
+        return -1;
+
+    return 0;
+}
@@ -0,0 +1,36 @@
+#ifndef NES_SRAM_HEADER
+#define NES_SRAM_HEADER
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+// How often the background thread writes dirty save pages back
+#define NES_SRAM_FLUSH_MS       2000
+
+// Battery-backed RAM kept in a .sav file mapped MAP_SHARED. Guest
+// writes land in the page cache directly, so a crashed instance
+// loses nothing, and a thread msync()s the mapping now and then
+// so a crashed host loses at most a few seconds. Nothing on the
+// emulation side ever waits for the disk.
+struct nes_sram {
+    uint8_t *data;
+    size_t size;
+    int fd;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint8_t stop;
+
+    uint64_t flushes;
+    uint64_t errors;
+};
+
+int nes_sram_open(struct nes_sram *sram, const char *name, size_t size);
+int nes_sram_sync(struct nes_sram *sram);
+int nes_sram_close(struct nes_sram *sram);
+
+int nes_sram_name(const char *rom, char *buf, size_t len);
+
+#endif
@@ -0,0 +1,395 @@
+// Checks idle loop skipping (see idle.h) without a CPU core. A few
+// synthetic guest programs are run by a minimal 6502 interpreter,
+// which only knows the opcodes they use, against the real PPU and
+// bus. Every program runs three times: without skipping, with it,
+// and in verify mode. The runs have to agree on when each NMI was
+// taken and each RAM write made, verify mode must not report a
+// mismatch, and only the loops that really are idle may be
+// skipped.
+//
+//   $ ./nesidle
+//   vblank + nmi flag  skips 144900  verified 144900  ok
+//   ...
+//
+// Exits non-zero when a check fails.
+//
+// Build, from the top of the tree:
+//
+//   cc -O2 -pthread -o nesidle tools/nesidle.c idle.c ppu.c render.c
+//       pool.c palette.c bus.c cartridge.c controller.c hash.c trace.c
+//       watch.c
+
+#include <stdio.h>
+#include <string.h>
+
+#include "../nes.h"
+#include "../idle.h"
+
+#define NESIDLE_FRAMES      300
+#define NESIDLE_NMI         0xc000
+
+struct program {
+    const char *name;
+    const uint8_t *code;
+    size_t len;
+    uint8_t ctrl;
+
+    // Whether the loops are idle and have to be skipped
+    int idle;
+
+    // Every iteration reads $2002, so a skip must never follow
+    // one that saw the vblank flag
+    int polls;
+};
+
+// wait: LDA $2002 / BPL wait, then INC $20, and wait for the NMI
+// handler to set $10: LDA $10 / BEQ, clear it and start over
+static const uint8_t prog_frame[] = {
+    0xad, 0x02, 0x20, 0x10, 0xfb, 0xe6, 0x20, 0xa5, 0x10, 0xf0, 0xfc,
+    0xa9, 0x00, 0x85, 0x10, 0x4c, 0x00, 0x80,
+};
+
+// JMP *, everything happens in the NMI handler
+static const uint8_t prog_jmp[] = {
+    0x4c, 0x00, 0x80,
+};
+
+// Stores what it reads, so it is never idle
+static const uint8_t prog_store[] = {
+    0xad, 0x02, 0x20, 0x85, 0x30, 0x10, 0xf9, 0x4c, 0x00, 0x80,
+};
+
+// Counts X down, the registers never repeat
+static const uint8_t prog_count[] = {
+    0xa9, 0x00, 0xa2, 0x00, 0xca, 0xd0, 0xfd, 0x4c, 0x00, 0x80,
+};
+
+// LDA $2002 / AND #$00 / BEQ with NMIs off: the registers are the
+// same whatever the read returns, vblank included
+static const uint8_t prog_poll[] = {
+    0xad, 0x02, 0x20, 0x29, 0x00, 0xf0, 0xf9,
+};
+
+// INC $10 / RTI
+static const uint8_t nmi_handler[] = {
+    0xe6, 0x10, 0x40,
+};
+
+static const struct program programs[] = {
+    { "vblank + nmi flag", prog_frame, sizeof(prog_frame), 0x80, 1, 0 },
+    { "jmp to self", prog_jmp, sizeof(prog_jmp), 0x80, 1, 0 },
+    { "store in loop", prog_store, sizeof(prog_store), 0x80, 0, 0 },
+    { "count down", prog_count, sizeof(prog_count), 0x80, 0, 0 },
+    { "status poll", prog_poll, sizeof(prog_poll), 0x00, 1, 1 },
+};
+
+struct machine {
+    struct nes_emu nes;
+    uint8_t mem[0x10000];
+    uint8_t chr[0x2000];
+    uint32_t frame_buffer[256 * 240];
+
+    int nmi;
+    uint16_t nmi_return;
+
+    // Last value read from PPUSTATUS
+    uint8_t status;
+
+    // Hash of the NMIs taken and RAM writes made, with their cycle
+    uint32_t timeline;
+    uint64_t instrs;
+    int vblank_skips;
+};
+
+static struct machine m;
+
+static void machine_init(const struct program *prog)
+{
+    struct nes_emu *nes = &m.nes;
+    struct nes_palette pal;
+
+    memset(&m, 0, sizeof(m));
+
+    memcpy(m.mem + 0x8000, prog->code, prog->len);
+    memcpy(m.mem + NESIDLE_NMI, nmi_handler, sizeof(nmi_handler));
+
+    nes->cart.chr_rom = m.chr;
+    nes->cart.chr_ram = 1;
+    nes->cart.mirroring = NES_MIRROR_VERTICAL;
+    for (int i = 0; i < 8; ++i)
+        nes->cart.chr_banks[i] = i;
+
+    nes_palette_default(&pal);
+    nes_palette_lut(&pal, NES_PIXEL_ARGB8888, nes->palette_lut);
+
+    nes->ppu.cart = &nes->cart;
+    nes->ppu.frame_buffer = m.frame_buffer;
+    nes->ppu.palette_table = nes->palette_lut;
+    nes->ppu.ctrl = prog->ctrl;
+    nes_ppu_map(&nes->ppu);
+
+    nes->hooks.nes = nes;
+    nes->hooks.cpu = &nes->cpu;
+    nes->bus.ppu = &nes->ppu;
+    nes->bus.cart = &nes->cart;
+    nes->bus.pads = nes->pads;
+    nes->bus.ram = nes->ram;
+    nes->bus.pages = nes_bus_fast_pages;
+    nes->bus.hooks = &nes->hooks;
+
+    nes->cpu.pc = 0x8000;
+    nes->cpu.s = 0xfd;
+}
+
+static void tick(uint32_t cycles)
+{
+    struct nes_ppu *ppu = &m.nes.ppu;
+
+    for (uint32_t i = 0; i < cycles * 3; ++i) {
+        if (ppu->scanline == 241 && ppu->cycle == 1 && (ppu->ctrl & 0x80))
+            m.nmi = 1;
+        nes_ppu_tick(ppu);
+    }
+}
+
+static void record(uint64_t cycles, uint32_t what)
+{
+    m.timeline = m.timeline * 31 + (uint32_t)cycles;
+    m.timeline = m.timeline * 31 + what;
+}
+
+static uint8_t read(uint16_t addr)
+{
+    uint8_t data = nes_bus_read(&m.nes.bus, addr);
+
+    if ((addr & 0xe007) == 0x2002)
+        m.status = data;
+
+    return data;
+}
+
+static void write(uint16_t addr, uint8_t data)
+{
+    record(m.nes.cpu.cycles, addr << 8 | data);
+    nes_bus_write(&m.nes.bus, addr, data);
+}
+
+static void set_nz(struct cpu_6502 *cpu, uint8_t v)
+{
+    cpu->p = (cpu->p & ~0x82) | (v & 0x80) | (v ? 0 : 0x02);
+}
+
+static int branch(const struct cpu_6502 *cpu, uint8_t op)
+{
+    switch (op) {
+    case 0x10:
+        return !(cpu->p & 0x80);
+    case 0xd0:
+        return !(cpu->p & 0x02);
+    default:
+        return cpu->p & 0x02;
+    }
+}
+
+static int step(struct nes_idle *idle, const struct program *prog)
+{
+    struct cpu_6502 *cpu = &m.nes.cpu;
+    const uint8_t *op;
+    uint16_t abs;
+    uint32_t cycles, skip;
+    uint8_t v;
+
+    if (m.nmi) {
+        m.nmi = 0;
+        m.nmi_return = cpu->pc;
+        cpu->s -= 3;
+        record(cpu->cycles, 0xffffffff);
+        cpu->cycles += 7;
+        tick(7);
+        cpu->pc = NESIDLE_NMI;
+    }
+
+    op = &m.mem[cpu->pc];
+    abs = op[1] | op[2] << 8;
+
+    if (idle) {
+        skip = nes_idle_instr(idle, &m.nes.bus, op);
+        if (skip) {
+            if (prog->polls && (m.status & 0x80))
+                m.vblank_skips++;
+            cpu->cycles += skip;
+            tick(skip);
+            return 0;
+        }
+    }
+
+    m.instrs++;
+
+    switch (op[0]) {
+    case 0xad:      // LDA abs
+        cpu->a = read(abs);
+        set_nz(cpu, cpu->a);
+        cpu->pc += 3;
+        cycles = 4;
+        break;
+    case 0xa5:      // LDA zp
+        cpu->a = read(op[1]);
+        set_nz(cpu, cpu->a);
+        cpu->pc += 2;
+        cycles = 3;
+        break;
+    case 0xa9:      // LDA #
+        cpu->a = op[1];
+        set_nz(cpu, cpu->a);
+        cpu->pc += 2;
+        cycles = 2;
+        break;
+    case 0x29:      // AND #
+        cpu->a &= op[1];
+        set_nz(cpu, cpu->a);
+        cpu->pc += 2;
+        cycles = 2;
+        break;
+    case 0x85:      // STA zp
+        write(op[1], cpu->a);
+        cpu->pc += 2;
+        cycles = 3;
+        break;
+    case 0xe6:      // INC zp
+        v = read(op[1]) + 1;
+        write(op[1], v);
+        set_nz(cpu, v);
+        cpu->pc += 2;
+        cycles = 5;
+        break;
+    case 0xa2:      // LDX #
+        cpu->x = op[1];
+        set_nz(cpu, cpu->x);
+        cpu->pc += 2;
+        cycles = 2;
+        break;
+    case 0xca:      // DEX
+        cpu->x--;
+        set_nz(cpu, cpu->x);
+        cpu->pc += 1;
+        cycles = 2;
+        break;
+    case 0x10:      // BPL, BNE, BEQ
+    case 0xd0:
+    case 0xf0:
+        cpu->pc += 2;
+        cycles = 2;
+        if (branch(cpu, op[0])) {
+            cpu->pc += (int8_t)op[1];
+            cycles = 3;
+        }
+        break;
+    case 0x4c:      // JMP abs
+        cpu->pc = abs;
+        cycles = 3;
+        break;
+    case 0x40:      // RTI
+        cpu->s += 3;
+        cpu->pc = m.nmi_return;
+        cycles = 6;
+        break;
+    default:
+        fprintf(stderr, "unknown opcode $%02X at $%04X\n", op[0], cpu->pc);
+        return -1;
+    }
+
+    cpu->cycles += cycles;
+    tick(cycles);
+
+    return 0;
+}
+
+static int run(const struct program *prog, struct nes_idle *idle)
+{
+    uint64_t end = (uint64_t)NESIDLE_FRAMES * 341 * 262 / 3;
+
+    machine_init(prog);
+
+    while (m.nes.cpu.cycles < end) {
+        if (step(idle, prog))
+            return -1;
+    }
+
+    return 0;
+}
+
+static int check(const struct program *prog)
+{
+    struct nes_idle skip, verify;
+    uint32_t timeline[3];
+    uint64_t instrs;
+    int ok = 1;
+
+    nes_idle_init(&skip, 0);
+    nes_idle_init(&verify, 1);
+
+    if (run(prog, NULL))
+        return -1;
+    timeline[0] = m.timeline;
+    instrs = m.instrs;
+
+    if (run(prog, &skip))
+        return -1;
+    timeline[1] = m.timeline;
+
+    if (m.vblank_skips) {
+        printf("  %d skips after an iteration that read vblank\n",
+               m.vblank_skips);
+        ok = 0;
+    }
+
+    if (run(prog, &verify))
+        return -1;
+    timeline[2] = m.timeline;
+
+    if (m.instrs != instrs) {
+        printf("  verify mode ran %llu instructions, expected %llu\n",
+               (unsigned long long)m.instrs, (unsigned long long)instrs);
+        ok = 0;
+    }
+
+    if (timeline[1] != timeline[0] || timeline[2] != timeline[0]) {
+        printf("  NMIs or writes moved: %08x, %08x skipping, "
+               "%08x verifying\n", timeline[0], timeline[1], timeline[2]);
+        ok = 0;
+    }
+
+    if (verify.mismatches) {
+        printf("  %llu verify mismatches, first at $%04X cycle %llu\n",
+               (unsigned long long)verify.mismatches, verify.mismatch_pc,
+               (unsigned long long)verify.mismatch_cycles);
+        ok = 0;
+    }
+
+    if (prog->idle != (skip.skips != 0) ||
+        prog->idle != (verify.verified != 0)) {
+        printf("  loop %s idle, but %llu skips and %llu verified\n",
+               prog->idle ? "is" : "is not",
+               (unsigned long long)skip.skips,
+               (unsigned long long)verify.verified);
+        ok = 0;
+    }
+
+    printf("%-18s skips %llu  verified %llu  %s\n", prog->name,
+           (unsigned long long)skip.skips,
+           (unsigned long long)verify.verified, ok ? "ok" : "FAIL");
+
+    return ok ? 0 : -1;
+}
+
+int main(void)
+{
+    int ret = 0;
+
+    for (size_t i = 0; i < sizeof(programs) / sizeof(programs[0]); ++i) {
+        if (check(&programs[i]))
+            ret = 1;
+    }
+
+    return ret;
+}
@@ -0,0 +1,184 @@
+// Checks the guest profiler (see profile.h) without a CPU core, by
+// feeding it a synthetic instruction stream the way the CPU would:
+// a main loop that makes a nested JSR, spins on $2002, and takes
+// an NMI, on even frames in the polling loop and on odd ones in
+// the middle of the innermost routine. Every node of the calling
+// context tree, the polling cycles and the per-frame totals are
+// compared with what the stream adds up to.
+//
+//   $ ./nesprof
+//   root              self 316  poll 252  ok
+//   ...
+//
+// Exits non-zero when a check fails.
+//
+// Build, from the top of the tree:
+//
+//   cc -O2 -o nesprof tools/nesprof.c profile.c cartridge.c hash.c
+
+#include <stdio.h>
+
+#include "../nes.h"
+#include "../profile.h"
+
+#define NESPROF_FRAMES      4
+
+// Cycles of one frame of the stream, and of the part of its
+// polling loop after the first iteration
+#define NESPROF_FRAME       116
+#define NESPROF_POLL        63
+
+static struct nes_prof prof;
+static struct cpu_6502 cpu;
+static struct nes_bus_hooks hooks;
+static struct nes_cart cart;
+static struct nes_bus bus;
+
+// Reports the instruction at pc, then runs it: cycles and stack
+// pointer change as it would change them
+static void instr(uint16_t pc, uint8_t op0, uint8_t op1, uint8_t op2,
+                  uint32_t cycles, int s)
+{
+    const uint8_t op[3] = { op0, op1, op2 };
+
+    cpu.pc = pc;
+    nes_prof_instr(&prof, &bus, op);
+
+    cpu.cycles += cycles;
+    cpu.s += s;
+}
+
+static void nmi(void)
+{
+    nes_prof_interrupt(&prof, &bus, NES_PROF_NMI);
+    cpu.s -= 3;
+    cpu.cycles += 7;
+
+    instr(0xc000, 0xea, 0x00, 0x00, 2, 0);      // NOP
+    instr(0xc001, 0x40, 0x00, 0x00, 6, 3);      // RTI
+}
+
+static void frame(uint32_t f)
+{
+    instr(0x8010, 0x20, 0x00, 0x90, 6, -2);     // JSR $9000
+    instr(0x9000, 0x20, 0x00, 0x91, 6, -2);     //   JSR $9100
+    instr(0x9100, 0xea, 0x00, 0x00, 2, 0);      //     NOP
+    if (f & 1)
+        nmi();
+    instr(0x9101, 0x60, 0x00, 0x00, 6, 2);      //     RTS
+    instr(0x9003, 0xea, 0x00, 0x00, 2, 0);      //   NOP
+    instr(0x9004, 0x60, 0x00, 0x00, 6, 2);      //   RTS
+
+    for (int i = 0; i < 10; ++i) {
+        instr(0x8000, 0xad, 0x02, 0x20, 4, 0);  // LDA $2002
+        instr(0x8003, 0x10, 0xfb, 0x00, 3, 0);  // BPL $8000
+    }
+
+    if (!(f & 1))
+        nmi();
+
+    instr(0x8005, 0x4c, 0x10, 0x80, 3, 0);      // JMP $8010
+
+    nes_prof_frame(&prof, f);
+}
+
+static const struct nes_prof_node *find(uint32_t parent, uint16_t pc,
+                                        uint8_t kind, uint32_t *id)
+{
+    for (uint32_t i = 1; i < prof.node_count; ++i) {
+        const struct nes_prof_node *node = &prof.nodes[i];
+
+        if (node->parent == parent && node->pc == pc && node->kind == kind) {
+            *id = i;
+            return node;
+        }
+    }
+
+    return NULL;
+}
+
+static int check(const char *name, const struct nes_prof_node *node,
+                 uint64_t self, uint64_t poll)
+{
+    int ok = node && node->self == self && node->poll == poll;
+
+    if (!node)
+        printf("%-17s missing  FAIL\n", name);
+    else
+        printf("%-17s self %llu  poll %llu  %s\n", name,
+               (unsigned long long)node->self,
+               (unsigned long long)node->poll, ok ? "ok" : "FAIL");
+
+    return ok;
+}
+
+int main(void)
+{
+    const struct nes_prof_node *outer, *inner, *nmi_main, *nmi_inner;
+    uint32_t outer_id = 0, inner_id = 0, id;
+    int ok = 1;
+
+    cart.header.prg_rom_size = 2;
+    hooks.cpu = &cpu;
+    bus.cart = &cart;
+    bus.hooks = &hooks;
+    cpu.s = 0xfd;
+
+    if (nes_prof_init(&prof)) {
+        fprintf(stderr, "cannot allocate profiler\n");
+        return 1;
+    }
+
+    for (uint32_t f = 0; f < NESPROF_FRAMES; ++f)
+        frame(f);
+
+    // Charges the last JMP
+    instr(0x8010, 0xea, 0x00, 0x00, 2, 0);
+
+    outer = find(0, 0x9000, NES_PROF_ROUTINE, &outer_id);
+    inner = outer ? find(outer_id, 0x9100, NES_PROF_ROUTINE, &inner_id) : NULL;
+    nmi_main = find(0, 0xc000, NES_PROF_NMI, &id);
+    nmi_inner = inner ? find(inner_id, 0xc000, NES_PROF_NMI, &id) : NULL;
+
+    // JSR, polling loop and JMP
+    ok &= check("root", &prof.nodes[0], (6 + 70 + 3) * NESPROF_FRAMES,
+                NESPROF_POLL * NESPROF_FRAMES);
+    // JSR, NOP and RTS
+    ok &= check("$9000", outer, 14 * NESPROF_FRAMES, 0);
+    // NOP and RTS
+    ok &= check("$9000 > $9100", inner, 8 * NESPROF_FRAMES, 0);
+    // Interrupt sequence, NOP and RTI
+    ok &= check("nmi", nmi_main, 15 * (NESPROF_FRAMES / 2), 0);
+    ok &= check("$9100 > nmi", nmi_inner, 15 * (NESPROF_FRAMES / 2), 0);
+
+    if (prof.node_count != 5 || prof.depth || prof.lost_nodes) {
+        printf("%u nodes, depth %d, %llu lost, expected 5, 0 and 0\n",
+               prof.node_count, prof.depth,
+               (unsigned long long)prof.lost_nodes);
+        ok = 0;
+    }
+
+    if (prof.total != NESPROF_FRAME * NESPROF_FRAMES ||
+        prof.poll_total != NESPROF_POLL * NESPROF_FRAMES) {
+        printf("%llu cycles, %llu polling, expected %u and %u\n",
+               (unsigned long long)prof.total,
+               (unsigned long long)prof.poll_total,
+               NESPROF_FRAME * NESPROF_FRAMES, NESPROF_POLL * NESPROF_FRAMES);
+        ok = 0;
+    }
+
+    // The JMP ending a frame is charged to the next one
+    for (uint32_t f = 1; f < NESPROF_FRAMES; ++f) {
+        if (prof.frames[f].cycles != NESPROF_FRAME ||
+            prof.frames[f].poll != NESPROF_POLL) {
+            printf("frame %u: %u cycles, %u polling, expected %u and %u\n",
+                   f, prof.frames[f].cycles, prof.frames[f].poll,
+                   NESPROF_FRAME, NESPROF_POLL);
+            ok = 0;
+        }
+    }
+
+    nes_prof_free(&prof);
+
+    return ok ? 0 : 1;
+}
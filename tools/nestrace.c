@@ -0,0 +1,240 @@
+// Renders a trace ring dump (see nes_trace_dump()) as text in the
+// layout of the nestest.log reference, so it can be diffed against
+// reference logs directly:
+//
+//   C000  4C F5 C5  JMP $C5F5                       A:00 X:00 Y:00 P:24 SP:FD PPU:  0, 21 CYC:7
+//
+// The "= xx" memory annotations of nestest.log are not reproduced,
+// as the trace does not record operand values; strip them from the
+// reference before diffing. With -b, register accesses are printed
+// too, as lines starting with "#".
+//
+// Build: cc -O2 -o nestrace tools/nestrace.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../trace.h"
+
+enum mode {
+    IMP, ACC, IMM, ZP, ZPX, ZPY, ABS, ABX, ABY, IND, IZX, IZY, REL,
+};
+
+struct opcode {
+    const char *name;
+    enum mode mode;
+    uint8_t illegal;
+};
+
+#define O(n, m)     { n, m, 0 }
+#define X(n, m)     { n, m, 1 }
+
+static const struct opcode opcodes[256] = {
+    // 0x00
+    O("BRK", IMP), O("ORA", IZX), X("KIL", IMP), X("SLO", IZX),
+    X("NOP", ZP),  O("ORA", ZP),  O("ASL", ZP),  X("SLO", ZP),
+    O("PHP", IMP), O("ORA", IMM), O("ASL", ACC), X("ANC", IMM),
+    X("NOP", ABS), O("ORA", ABS), O("ASL", ABS), X("SLO", ABS),
+    // 0x10
+    O("BPL", REL), O("ORA", IZY), X("KIL", IMP), X("SLO", IZY),
+    X("NOP", ZPX), O("ORA", ZPX), O("ASL", ZPX), X("SLO", ZPX),
+    O("CLC", IMP), O("ORA", ABY), X("NOP", IMP), X("SLO", ABY),
+    X("NOP", ABX), O("ORA", ABX), O("ASL", ABX), X("SLO", ABX),
+    // 0x20
+    O("JSR", ABS), O("AND", IZX), X("KIL", IMP), X("RLA", IZX),
+    O("BIT", ZP),  O("AND", ZP),  O("ROL", ZP),  X("RLA", ZP),
+    O("PLP", IMP), O("AND", IMM), O("ROL", ACC), X("ANC", IMM),
+    O("BIT", ABS), O("AND", ABS), O("ROL", ABS), X("RLA", ABS),
+    // 0x30
+    O("BMI", REL), O("AND", IZY), X("KIL", IMP), X("RLA", IZY),
+    X("NOP", ZPX), O("AND", ZPX), O("ROL", ZPX), X("RLA", ZPX),
+    O("SEC", IMP), O("AND", ABY), X("NOP", IMP), X("RLA", ABY),
+    X("NOP", ABX), O("AND", ABX), O("ROL", ABX), X("RLA", ABX),
+    // 0x40
+    O("RTI", IMP), O("EOR", IZX), X("KIL", IMP), X("SRE", IZX),
+    X("NOP", ZP),  O("EOR", ZP),  O("LSR", ZP),  X("SRE", ZP),
+    O("PHA", IMP), O("EOR", IMM), O("LSR", ACC), X("ALR", IMM),
+    O("JMP", ABS), O("EOR", ABS), O("LSR", ABS), X("SRE", ABS),
+    // 0x50
+    O("BVC", REL), O("EOR", IZY), X("KIL", IMP), X("SRE", IZY),
+    X("NOP", ZPX), O("EOR", ZPX), O("LSR", ZPX), X("SRE", ZPX),
+    O("CLI", IMP), O("EOR", ABY), X("NOP", IMP), X("SRE", ABY),
+    X("NOP", ABX), O("EOR", ABX), O("LSR", ABX), X("SRE", ABX),
+    // 0x60
+    O("RTS", IMP), O("ADC", IZX), X("KIL", IMP), X("RRA", IZX),
+    X("NOP", ZP),  O("ADC", ZP),  O("ROR", ZP),  X("RRA", ZP),
+    O("PLA", IMP), O("ADC", IMM), O("ROR", ACC), X("ARR", IMM),
+    O("JMP", IND), O("ADC", ABS), O("ROR", ABS), X("RRA", ABS),
+    // 0x70
+    O("BVS", REL), O("ADC", IZY), X("KIL", IMP), X("RRA", IZY),
+    X("NOP", ZPX), O("ADC", ZPX), O("ROR", ZPX), X("RRA", ZPX),
+    O("SEI", IMP), O("ADC", ABY), X("NOP", IMP), X("RRA", ABY),
+    X("NOP", ABX), O("ADC", ABX), O("ROR", ABX), X("RRA", ABX),
+    // 0x80
+    X("NOP", IMM), O("STA", IZX), X("NOP", IMM), X("SAX", IZX),
+    O("STY", ZP),  O("STA", ZP),  O("STX", ZP),  X("SAX", ZP),
+    O("DEY", IMP), X("NOP", IMM), O("TXA", IMP), X("XAA", IMM),
+    O("STY", ABS), O("STA", ABS), O("STX", ABS), X("SAX", ABS),
+    // 0x90
+    O("BCC", REL), O("STA", IZY), X("KIL", IMP), X("AHX", IZY),
+    O("STY", ZPX), O("STA", ZPX), O("STX", ZPY), X("SAX", ZPY),
+    O("TYA", IMP), O("STA", ABY), O("TXS", IMP), X("TAS", ABY),
+    X("SHY", ABX), O("STA", ABX), X("SHX", ABY), X("AHX", ABY),
+    // 0xa0
+    O("LDY", IMM), O("LDA", IZX), O("LDX", IMM), X("LAX", IZX),
+    O("LDY", ZP),  O("LDA", ZP),  O("LDX", ZP),  X("LAX", ZP),
+    O("TAY", IMP), O("LDA", IMM), O("TAX", IMP), X("LAX", IMM),
+    O("LDY", ABS), O("LDA", ABS), O("LDX", ABS), X("LAX", ABS),
+    // 0xb0
+    O("BCS", REL), O("LDA", IZY), X("KIL", IMP), X("LAX", IZY),
+    O("LDY", ZPX), O("LDA", ZPX), O("LDX", ZPY), X("LAX", ZPY),
+    O("CLV", IMP), O("LDA", ABY), O("TSX", IMP), X("LAS", ABY),
+    O("LDY", ABX), O("LDA", ABX), O("LDX", ABY), X("LAX", ABY),
+    // 0xc0
+    O("CPY", IMM), O("CMP", IZX), X("NOP", IMM), X("DCP", IZX),
+    O("CPY", ZP),  O("CMP", ZP),  O("DEC", ZP),  X("DCP", ZP),
+    O("INY", IMP), O("CMP", IMM), O("DEX", IMP), X("AXS", IMM),
+    O("CPY", ABS), O("CMP", ABS), O("DEC", ABS), X("DCP", ABS),
+    // 0xd0
+    O("BNE", REL), O("CMP", IZY), X("KIL", IMP), X("DCP", IZY),
+    X("NOP", ZPX), O("CMP", ZPX), O("DEC", ZPX), X("DCP", ZPX),
+    O("CLD", IMP), O("CMP", ABY), X("NOP", IMP), X("DCP", ABY),
+    X("NOP", ABX), O("CMP", ABX), O("DEC", ABX), X("DCP", ABX),
+    // 0xe0
+    O("CPX", IMM), O("SBC", IZX), X("NOP", IMM), X("ISB", IZX),
+    O("CPX", ZP),  O("SBC", ZP),  O("INC", ZP),  X("ISB", ZP),
+    O("INX", IMP), O("SBC", IMM), O("NOP", IMP), X("SBC", IMM),
+    O("CPX", ABS), O("SBC", ABS), O("INC", ABS), X("ISB", ABS),
+    // 0xf0
+    O("BEQ", REL), O("SBC", IZY), X("KIL", IMP), X("ISB", IZY),
+    X("NOP", ZPX), O("SBC", ZPX), O("INC", ZPX), X("ISB", ZPX),
+    O("SED", IMP), O("SBC", ABY), X("NOP", IMP), X("ISB", ABY),
+    X("NOP", ABX), O("SBC", ABX), O("INC", ABX), X("ISB", ABX),
+};
+
+static int operand_bytes(enum mode mode)
+{
+    switch (mode) {
+    case IMP:
+    case ACC:
+        return 0;
+    case ABS:
+    case ABX:
+    case ABY:
+    case IND:
+        return 2;
+    default:
+        return 1;
+    }
+}
+
+static void disassemble(const struct nes_trace_record *rec, char *out,
+                        size_t len)
+{
+    const struct opcode *op = &opcodes[rec->op[0]];
+    uint16_t abs = rec->op[1] | (rec->op[2] << 8);
+    uint16_t target = rec->addr + 2 + (int8_t)rec->op[1];
+
+    switch (op->mode) {
+    case IMP: snprintf(out, len, "%s", op->name); break;
+    case ACC: snprintf(out, len, "%s A", op->name); break;
+    case IMM: snprintf(out, len, "%s #$%02X", op->name, rec->op[1]); break;
+    case ZP:  snprintf(out, len, "%s $%02X", op->name, rec->op[1]); break;
+    case ZPX: snprintf(out, len, "%s $%02X,X", op->name, rec->op[1]); break;
+    case ZPY: snprintf(out, len, "%s $%02X,Y", op->name, rec->op[1]); break;
+    case ABS: snprintf(out, len, "%s $%04X", op->name, abs); break;
+    case ABX: snprintf(out, len, "%s $%04X,X", op->name, abs); break;
+    case ABY: snprintf(out, len, "%s $%04X,Y", op->name, abs); break;
+    case IND: snprintf(out, len, "%s ($%04X)", op->name, abs); break;
+    case IZX: snprintf(out, len, "%s ($%02X,X)", op->name, rec->op[1]); break;
+    case IZY: snprintf(out, len, "%s ($%02X),Y", op->name, rec->op[1]); break;
+    case REL: snprintf(out, len, "%s $%04X", op->name, target); break;
+    }
+}
+
+static void print_cpu(const struct nes_trace_record *rec)
+{
+    const struct opcode *op = &opcodes[rec->op[0]];
+    char bytes[16], text[40];
+    int n = operand_bytes(op->mode);
+
+    if (n == 0)
+        snprintf(bytes, sizeof(bytes), "%02X", rec->op[0]);
+    else if (n == 1)
+        snprintf(bytes, sizeof(bytes), "%02X %02X", rec->op[0], rec->op[1]);
+    else
+        snprintf(bytes, sizeof(bytes), "%02X %02X %02X",
+                 rec->op[0], rec->op[1], rec->op[2]);
+
+    disassemble(rec, text, sizeof(text));
+
+    printf("%04X  %-8s %c%-32sA:%02X X:%02X Y:%02X P:%02X SP:%02X "
+           "PPU:%3u,%3u CYC:%llu\n",
+           rec->addr, bytes, op->illegal ? '*' : ' ', text,
+           rec->a, rec->x, rec->y, rec->p, rec->s,
+           rec->scanline, rec->dot, (unsigned long long)rec->cycle);
+}
+
+static void print_bus(const struct nes_trace_record *rec)
+{
+    printf("# %s $%04X %s $%02X  frame %u PPU:%3u,%3u CYC:%llu\n",
+           rec->type == NES_TRACE_READ ? "read " : "write",
+           rec->addr, rec->type == NES_TRACE_READ ? "->" : "<-",
+           rec->op[0], rec->frame, rec->scanline, rec->dot,
+           (unsigned long long)rec->cycle);
+}
+
+int main(int argc, char *argv[])
+{
+    struct nes_trace_file hdr;
+    struct nes_trace_record rec;
+    const char *name = NULL;
+    int bus = 0;
+    FILE *fp;
+
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "-b"))
+            bus = 1;
+        else
+            name = argv[i];
+    }
+
+    if (!name) {
+        fprintf(stderr, "usage: %s [-b] <trace dump>\n", argv[0]);
+        return 1;
+    }
+
+    fp = fopen(name, "rb");
+    if (!fp) {
+        perror(name);
+        return 1;
+    }
+
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+        memcmp(hdr.magic, NES_TRACE_MAGIC, 4) ||
+        hdr.version != NES_TRACE_VERSION ||
+        hdr.record_size != sizeof(rec)) {
+        fprintf(stderr, "%s: not a trace dump\n", name);
+        fclose(fp);
+        return 1;
+    }
+
+    if (hdr.dropped)
+        fprintf(stderr, "%s: %llu older records were overwritten\n",
+                name, (unsigned long long)hdr.dropped);
+
+    for (uint64_t i = 0; i < hdr.count; ++i) {
+        if (fread(&rec, sizeof(rec), 1, fp) != 1)
+            break;
+
+        if (rec.type == NES_TRACE_CPU)
+            print_cpu(&rec);
+        else if (bus)
+            print_bus(&rec);
+    }
+
+    fclose(fp);
+
+    return 0;
+}
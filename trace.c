@@ -0,0 +1,159 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+#include "nes.h"
+
+// records must be a power of two
+int nes_trace_init(struct nes_trace *trace, uint32_t records)
+{
+    memset(trace, 0, sizeof(*trace));
+
+    if (!records || (records & (records - 1)))
+        return -1;
+
+    trace->ring = calloc(records, sizeof(*trace->ring));
+    if (!trace->ring)
+        return -1;
+
+    trace->mask = records - 1;
+
+    nes_trace_filter(trace, NES_TRACE_ALL, 0x0000, 0xffff, 0, UINT32_MAX);
+
+    return 0;
+}
+
+void nes_trace_free(struct nes_trace *trace)
+{
+    free(trace->ring);
+
+    memset(trace, 0, sizeof(*trace));
+}
+
+void nes_trace_attach(struct nes_trace *trace, struct nes_bus *bus)
+{
+    bus->hooks->trace = trace;
+    nes_bus_update_pages(bus);
+}
+
+void nes_trace_detach(struct nes_bus *bus)
+{
+    bus->hooks->trace = NULL;
+    nes_bus_update_pages(bus);
+}
+
+void nes_trace_filter(struct nes_trace *trace, uint8_t types,
+                      uint16_t addr_lo, uint16_t addr_hi,
+                      uint32_t frame_first, uint32_t frame_last)
+{
+    trace->types = types;
+    trace->addr_lo = addr_lo;
+    trace->addr_hi = addr_hi;
+    trace->frame_first = frame_first;
+    trace->frame_last = frame_last;
+}
+
+static struct nes_trace_record *nes_trace_next(struct nes_trace *trace,
+                                               struct nes_bus *bus,
+                                               uint8_t type, uint16_t addr)
+{
+    struct nes_trace_record *rec;
+    struct cpu_6502 *cpu = bus->hooks->cpu;
+    uint32_t frame = bus->hooks->nes->frame;
+
+    if (!(trace->types & type) ||
+        addr < trace->addr_lo || addr > trace->addr_hi ||
+        frame < trace->frame_first || frame > trace->frame_last)
+        return NULL;
+
+    rec = &trace->ring[trace->head++ & trace->mask];
+
+    rec->cycle = cpu->cycles;
+    rec->frame = frame;
+    rec->addr = addr;
+    rec->scanline = bus->ppu->scanline;
+    rec->dot = bus->ppu->cycle;
+    rec->type = type;
+    rec->a = cpu->a;
+    rec->x = cpu->x;
+    rec->y = cpu->y;
+    rec->p = cpu->p;
+    rec->s = cpu->s;
+
+    return rec;
+}
+
+// Called by the CPU before executing the instruction at cpu->pc,
+// with the opcode and the two bytes following it.
+void nes_trace_cpu(struct nes_trace *trace, struct nes_bus *bus,
+                   const uint8_t *op)
+{
+    struct nes_trace_record *rec;
+
+    rec = nes_trace_next(trace, bus, NES_TRACE_CPU, bus->hooks->cpu->pc);
+    if (!rec)
+        return;
+
+    rec->op[0] = op[0];
+    rec->op[1] = op[1];
+    rec->op[2] = op[2];
+}
+
+void nes_trace_bus(struct nes_trace *trace, struct nes_bus *bus,
+                   uint8_t type, uint16_t addr, uint8_t data)
+{
+    struct nes_trace_record *rec;
+
+    rec = nes_trace_next(trace, bus, type, addr);
+    if (!rec)
+        return;
+
+    rec->op[0] = data;
+    rec->op[1] = 0;
+    rec->op[2] = 0;
+}
+
+int nes_trace_dump(struct nes_trace *trace, const char *name)
+{
+    struct nes_trace_file hdr;
+    uint64_t size, first, count;
+    FILE *fp;
+    int ret = 0;
+
+    size = (uint64_t)trace->mask + 1;
+    count = trace->head < size ? trace->head : size;
+    first = trace->head - count;
+
+    memcpy(hdr.magic, NES_TRACE_MAGIC, 4);
+    hdr.version = NES_TRACE_VERSION;
+    hdr.record_size = sizeof(struct nes_trace_record);
+    hdr.count = count;
+    hdr.dropped = first;
+
+    fp = fopen(name, "wb");
+    if (!fp)
+        return -1;
+
+    if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1)
+        ret = -1;
+
+    // Oldest records first, the ring may wrap once
+    for (uint64_t i = first; !ret && i < trace->head; ) {
+        uint64_t pos = i & trace->mask;
+        uint64_t run = size - pos;
+
+        if (run > trace->head - i)
+            run = trace->head - i;
+
+        if (fwrite(&trace->ring[pos], sizeof(*trace->ring), run, fp) != run)
+            ret = -1;
+
+        i += run;
+    }
+
+    if (fclose(fp))
+        ret = -1;
+
+    return ret;
+}
@@ -0,0 +1,82 @@
+#ifndef NES_TRACE_HEADER
+#define NES_TRACE_HEADER
+
+#include <stdint.h>
+
+#define NES_TRACE_MAGIC         "NEST"
+#define NES_TRACE_VERSION       1
+
+// Record types, also used as bits in nes_trace.types
+#define NES_TRACE_CPU           0x01
+#define NES_TRACE_READ          0x02
+#define NES_TRACE_WRITE         0x04
+#define NES_TRACE_ALL           0x07
+
+struct nes_bus;
+
+// One fixed-size record per executed instruction or per access
+// to the PPU/APU/IO registers ($2000-$401F). For bus records, addr
+// is the register and op[0] the byte transferred, the CPU fields
+// hold the registers of the instruction doing the access.
+struct nes_trace_record {
+    uint64_t cycle;
+    uint32_t frame;
+    uint16_t addr;
+    uint16_t scanline;
+    uint16_t dot;
+    uint8_t type;
+    uint8_t op[3];
+    uint8_t a;
+    uint8_t x;
+    uint8_t y;
+    uint8_t p;
+    uint8_t s;
+    uint8_t reserved[5];
+};
+
+// Dump file layout: this header, then count records oldest first
+struct nes_trace_file {
+    uint8_t magic[4];
+    uint16_t version;
+    uint16_t record_size;
+    uint64_t count;
+    uint64_t dropped;
+} __attribute__((packed));
+
+// In-memory ring of trace records. nes_trace_attach() flags the
+// register pages with NES_BUS_TRACE, so while detached tracing
+// costs register accesses nothing but the page flag test they
+// make for watchpoints anyway. Once full, the oldest records are
+// overwritten.
+struct nes_trace {
+    struct nes_trace_record *ring;
+    uint32_t mask;
+    uint64_t head;
+
+    // Runtime filters. The address window applies to the PC of
+    // CPU records and to the register of bus records.
+    uint8_t types;
+    uint16_t addr_lo;
+    uint16_t addr_hi;
+    uint32_t frame_first;
+    uint32_t frame_last;
+};
+
+int nes_trace_init(struct nes_trace *trace, uint32_t records);
+void nes_trace_free(struct nes_trace *trace);
+
+void nes_trace_attach(struct nes_trace *trace, struct nes_bus *bus);
+void nes_trace_detach(struct nes_bus *bus);
+
+void nes_trace_filter(struct nes_trace *trace, uint8_t types,
+                      uint16_t addr_lo, uint16_t addr_hi,
+                      uint32_t frame_first, uint32_t frame_last);
+
+void nes_trace_cpu(struct nes_trace *trace, struct nes_bus *bus,
+                   const uint8_t *op);
+void nes_trace_bus(struct nes_trace *trace, struct nes_bus *bus,
+                   uint8_t type, uint16_t addr, uint8_t data);
+
+int nes_trace_dump(struct nes_trace *trace, const char *name);
+
+#endif
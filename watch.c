@@ -0,0 +1,187 @@
+#include <string.h>
+
+#include "watch.h"
+#include "nes.h"
+
+void nes_watch_init(struct nes_watch *watch, nes_watch_fn fn, void *ctx)
+{
+    memset(watch, 0, sizeof(*watch));
+
+    watch->fn = fn;
+    watch->ctx = ctx;
+}
+
+// Flags the pages of every mirror of the watched ones as well
+static void nes_watch_update_pages(struct nes_watch *watch)
+{
+    memset(watch->pages, 0, sizeof(watch->pages));
+
+    for (int i = 0; i < NES_WATCH_MAX; ++i) {
+        struct nes_watchpoint *wp = &watch->points[i];
+
+        if (!wp->used)
+            continue;
+
+        for (int page = wp->lo >> 8; page <= wp->hi >> 8; ++page) {
+            switch (page) {
+            case 0x00 ... 0x1f:
+                for (int m = page & 0x07; m < 0x20; m += 0x08)
+                    watch->pages[m] |= wp->types;
+                break;
+            case 0x20 ... 0x3f:
+                for (int m = 0x20; m < 0x40; ++m)
+                    watch->pages[m] |= wp->types;
+                break;
+            default:
+                watch->pages[page] |= wp->types;
+                break;
+            }
+        }
+    }
+
+    if (watch->bus)
+        nes_bus_update_pages(watch->bus);
+}
+
+// Whether any mirror of addr within [base, end], repeating every
+// mask + 1 bytes, falls in the watched range
+static int nes_watch_mirror_match(const struct nes_watchpoint *wp,
+                                  uint16_t addr, uint16_t base,
+                                  uint16_t end, uint16_t mask)
+{
+    uint16_t lo, hi;
+
+    lo = wp->lo > base ? wp->lo : base;
+    hi = wp->hi < end ? wp->hi : end;
+    if (lo > hi)
+        return 0;
+
+    // First mirror at or above lo
+    return lo + ((addr - lo) & mask) <= hi;
+}
+
+static int nes_watch_match(const struct nes_watchpoint *wp, uint16_t addr)
+{
+    switch (addr) {
+    case 0x0000 ... 0x1fff:
+        return nes_watch_mirror_match(wp, addr, 0x0000, 0x1fff, 0x07ff);
+    case 0x2000 ... 0x3fff:
+        return nes_watch_mirror_match(wp, addr, 0x2000, 0x3fff, 0x0007);
+    default:
+        return addr >= wp->lo && addr <= wp->hi;
+    }
+}
+
+// Returns the watchpoint id, or -1 when all slots are taken
+int nes_watch_add(struct nes_watch *watch, uint16_t lo, uint16_t hi,
+                  uint8_t types)
+{
+    if (lo > hi || !types)
+        return -1;
+
+    for (int i = 0; i < NES_WATCH_MAX; ++i) {
+        struct nes_watchpoint *wp = &watch->points[i];
+
+        if (wp->used)
+            continue;
+
+        wp->lo = lo;
+        wp->hi = hi;
+        wp->types = types;
+        wp->used = 1;
+
+        nes_watch_update_pages(watch);
+
+        return i;
+    }
+
+    return -1;
+}
+
+void nes_watch_remove(struct nes_watch *watch, int id)
+{
+    if (id < 0 || id >= NES_WATCH_MAX)
+        return;
+
+    watch->points[id].used = 0;
+
+    nes_watch_update_pages(watch);
+}
+
+void nes_watch_attach(struct nes_watch *watch, struct nes_bus *bus)
+{
+    watch->bus = bus;
+    bus->hooks->watch = watch;
+    nes_bus_update_pages(bus);
+}
+
+void nes_watch_detach(struct nes_bus *bus)
+{
+    if (bus->hooks->watch)
+        bus->hooks->watch->bus = NULL;
+
+    bus->hooks->watch = NULL;
+    nes_bus_update_pages(bus);
+}
+
+// Returns 1 and fills hit when a queued hit was pending
+int nes_watch_poll(struct nes_watch *watch, struct nes_watch_hit *hit)
+{
+    if (watch->tail == watch->head)
+        return 0;
+
+    *hit = watch->queue[watch->tail++ % NES_WATCH_QUEUE];
+
+    return 1;
+}
+
+static void nes_watch_deliver(struct nes_watch *watch,
+                              const struct nes_watch_hit *hit)
+{
+    watch->hits++;
+
+    if (watch->fn) {
+        if (watch->fn(watch->ctx, hit))
+            watch->halted = 1;
+        return;
+    }
+
+    if (watch->head - watch->tail == NES_WATCH_QUEUE) {
+        watch->dropped++;
+        return;
+    }
+
+    watch->queue[watch->head++ % NES_WATCH_QUEUE] = *hit;
+}
+
+void nes_watch_check(struct nes_bus *bus, uint8_t type, uint16_t addr,
+                     uint8_t data)
+{
+    struct nes_watch *watch = bus->hooks->watch;
+    struct nes_watch_hit hit;
+
+    for (int i = 0; i < NES_WATCH_MAX; ++i) {
+        struct nes_watchpoint *wp = &watch->points[i];
+
+        if (!wp->used || !(wp->types & type) || !nes_watch_match(wp, addr))
+            continue;
+
+        hit.id = i;
+        hit.type = type;
+        hit.data = data;
+        hit.addr = addr;
+        hit.cpu = *bus->hooks->cpu;
+        hit.scanline = bus->ppu->scanline;
+        hit.dot = bus->ppu->cycle;
+        hit.frame = bus->hooks->nes->frame;
+        hit.ctrl = bus->ppu->ctrl;
+        hit.mask = bus->ppu->mask;
+        hit.status = bus->ppu->status;
+        hit.w = bus->ppu->reg.w;
+        hit.v = bus->ppu->reg.v;
+        hit.t = bus->ppu->reg.t;
+        hit.x = bus->ppu->reg.x;
+
+        nes_watch_deliver(watch, &hit);
+    }
+}
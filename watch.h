@@ -0,0 +1,102 @@
+#ifndef NES_WATCH_HEADER
+#define NES_WATCH_HEADER
+
+#include <stdint.h>
+
+#include "cpu.h"
+
+#define NES_WATCH_MAX           32
+#define NES_WATCH_QUEUE         256
+
+// Access types, also used as bits in the bus page flags
+#define NES_WATCH_READ          0x01
+#define NES_WATCH_WRITE         0x02
+#define NES_WATCH_EXEC          0x04
+
+struct nes_bus;
+
+// Everything known about the machine at the time of the access
+struct nes_watch_hit {
+    int id;
+    uint8_t type;
+    uint8_t data;
+    uint16_t addr;
+
+    struct cpu_6502 cpu;
+    uint16_t scanline;
+    uint16_t dot;
+    uint32_t frame;
+
+    // PPU registers and the internal scroll state (v, t, fine x
+    // and the write toggle)
+    uint8_t ctrl;
+    uint8_t mask;
+    uint8_t status;
+    uint8_t w;
+    uint16_t v;
+    uint16_t t;
+    uint16_t x;
+};
+
+// Returning non-zero from the callback requests a break, see
+// nes_watch.halted.
+typedef int (*nes_watch_fn)(void *ctx, const struct nes_watch_hit *hit);
+
+struct nes_watchpoint {
+    uint16_t lo;
+    uint16_t hi;
+    uint8_t types;
+    uint8_t used;
+};
+
+// Set of watchpoints for one instance. Only the 256-byte pages
+// overlapping a watchpoint are flagged in the bus dispatch, so
+// accesses to every other page never look at this structure.
+//
+// Internal RAM and the PPU registers are matched through their
+// mirrors: a watch on $0300 also fires for $0B00, one on $2002
+// for $200A or $3FFA.
+//
+// Hits go to the callback when one is set and are queued for
+// nes_watch_poll() otherwise. The queue drops new hits when full.
+struct nes_watch {
+    // Per-page OR of the types watched on that page, used by
+    // the bus as its slow page table while attached
+    uint8_t pages[256];
+
+    // Bus attached to, NULL while detached
+    struct nes_bus *bus;
+
+    struct nes_watchpoint points[NES_WATCH_MAX];
+
+    nes_watch_fn fn;
+    void *ctx;
+
+    struct nes_watch_hit queue[NES_WATCH_QUEUE];
+    uint32_t head;
+    uint32_t tail;
+
+    // Set when a callback asked to break. The CPU stops stepping
+    // until the owner clears it.
+    uint8_t halted;
+
+    uint64_t hits;
+    uint64_t dropped;
+};
+
+void nes_watch_init(struct nes_watch *watch, nes_watch_fn fn, void *ctx);
+
+int nes_watch_add(struct nes_watch *watch, uint16_t lo, uint16_t hi,
+                  uint8_t types);
+void nes_watch_remove(struct nes_watch *watch, int id);
+
+void nes_watch_attach(struct nes_watch *watch, struct nes_bus *bus);
+void nes_watch_detach(struct nes_bus *bus);
+
+int nes_watch_poll(struct nes_watch *watch, struct nes_watch_hit *hit);
+
+// Slow path of the bus, only called for flagged pages
+void nes_watch_check(struct nes_bus *bus, uint8_t type, uint16_t addr,
+                     uint8_t data);
+
+#endif